@@ -1,11 +1,23 @@
 #include "cesium.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cesium/trace.h>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <list>
 #include <map>
+#include <pthread.h>
+#include <set>
 #include <string>
 #include <string/stringutils.h>
 #include <svm/detector.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <util/directory.h>
 #include <util/matlab.h>
 #include <util/system.h>
@@ -16,18 +28,101 @@ DEFINE_string(cesium_working_directory, "/srv/cluster-fs",
 	      "The root directory where the input files live and the output files will be saved.");
 DEFINE_string(cesium_temporary_directory, "/tmp", "Directory to store temp files.");
 
-DEFINE_bool(cesium_export_log, true, "If true, will export the master's log to the working directory.");
-DEFINE_int32(cesium_wait_interval, 5, "The number of seconds to wait between checking status of job.");
+DEFINE_bool(cesium_export_log, true, 
+	    "If true, the master's log is mirrored to master.log in the working directory as it is written.");
+DEFINE_string(cesium_metrics_file, "",
+	      "If set, the master periodically rewrites this file with the progress of the running jobs (queue "
+	      "depth, per-node throughput, ETA, bytes sent and received, serialization and checkpoint time) in "
+	      "the Prometheus text format, e.g. for the node_exporter textfile collector.");
+DEFINE_double(cesium_metrics_interval, 1.0, 
+	      "The minimum number of seconds between updates of cesium_metrics_file.");
+DEFINE_string(cesium_trace_file, "",
+	      "If set, every node records how long it spends serializing, sending and receiving jobs, running "
+	      "each index, and merging and checkpointing outputs. When the master finishes, the records of all "
+	      "nodes are written to this file as a Chrome trace (open it in chrome://tracing). Must be set on "
+	      "every node.");
+DEFINE_int32(cesium_wait_interval, 5, 
+	     "The minimum number of seconds between progress reports (and log exports) while a job runs. "
+	     "This does not affect how quickly nodes are handed new work.");
+
+DEFINE_bool(cesium_adaptive_batch_size, true, 
+	    "If true (and intelligent parameters are enabled), batch sizes are adapted to the measured "
+	    "throughput of each node instead of being fixed for the whole job.");
+DEFINE_double(cesium_target_batch_seconds, 30.0, 
+	      "With adaptive batch sizes, the number of seconds each batch should take a node to process.");
+DEFINE_double(cesium_speculative_execution_fraction, -1.0, 
+	      "Once this fraction of a job's indices has completed and there is nothing left to hand out, "
+	      "idle nodes re-run the batches of the slowest nodes and the first result is kept. "
+	      "Disabled if <= 0. Only enable this if your commands can safely run the same index twice.");
+
+DEFINE_int32(cesium_compute_threads, 1, 
+	     "The number of threads each compute node starts to run the indices of its batches in parallel. "
+	     "Commands then run concurrently: they may read their inputs and write their own output, and "
+	     "MatlabMatrix serializes its own Matlab API calls, but they must not share any other mutable "
+	     "state and must hold a slib::util::MatlabApiLock around any mx* or mat* calls of their own. "
+	     "Consider running one node per host when using this.");
+DEFINE_int32(cesium_local_workers, 0, 
+	     "When the program runs as a single process (e.g. without mpirun), jobs run on this many threads "
+	     "of that process instead of on other nodes, and inputs and outputs are handed over in memory. "
+	     "0 uses one per core. With more than one, registered commands must be thread-safe.");
+DEFINE_int32(cesium_variable_cache_megabytes, 1024, 
+	     "The most memory each compute node spends on keeping cached (and shared) variables around "
+	     "between batches and jobs. The least recently used variables are dropped first.");
+DEFINE_bool(cesium_broadcast_variables, false, 
+	    "If true, the variables of a job that every node is sent in full are broadcast to the idle "
+	    "nodes when the job starts and cached there, so the batches only carry the indices and the "
+	    "partial variables. The master sends them to two nodes, each of which passes them on to two "
+	    "more, and so on. This turns every complete variable into a cached one.");
+DEFINE_bool(cesium_prefetch_batches, false, 
+	    "If true, each busy node is sent its next batch while it is still computing the current one "
+	    "so that it never waits on the master between batches. The next batch is received (and its "
+	    "variables deserialized) while a command runs, so leave this off if your commands are not "
+	    "safe to run alongside other MATLAB API calls.");
+DEFINE_bool(cesium_locality_aware_scheduling, true,
+	    "If true, each node is preferably sent the indices that follow its previous batch, or "
+	    "indices from ranges it was sent before (in this or an earlier job), so that partial "
+	    "variables are read from disk in long forward runs and nodes keep working on the same data.");
+DEFINE_int32(cesium_max_message_bytes, 1 << 30,
+	     "The variables of a job (or its output) are sent in messages of at most this many bytes, "
+	     "so that variables and batches of more than 2GB can be sent, and the receiver can start "
+	     "reading the first variables while the rest are still on their way.");
+DEFINE_int32(cesium_compression_threshold, 1 << 16,
+	     "Variables of type COMPRESSED_VARIABLE are compressed (with zlib) when they are sent, "
+	     "if they are at least this many bytes and compressing makes them smaller.");
 
 // TODO(sean): Remove me and use a VariableType like CACHED_VARIABLE
 DEFINE_string(cesium_checkpointed_variables, "", 
 	      "A comma-separated liste of variable names that should be loaded via checkpoints");
 
 DEFINE_bool(cesium_checkpoint_variables, true, "Set to false if you don't want to checkpoint variables.");
+DEFINE_bool(cesium_journal_jobs, false,
+	    "If true, every job keeps a journal of its dispatched and completed batches (and their "
+	    "outputs) in cesium_temporary_directory so that it can be resumed with cesium_resume_jobs.");
+DEFINE_bool(cesium_resume_jobs, false,
+	    "If true, jobs with a journal from an earlier run of the same program (same command and "
+	    "indices) start from it instead of rerunning the indices that had completed.");
+DEFINE_int32(cesium_checkpoint_compaction_interval, 16,
+	     "Checkpoints only append the outputs that completed since the previous one. After this many "
+	     "appends they are compacted into a single file (in the background).");
 DEFINE_int32(cesium_partial_variable_chunk_size, 50, 
 	     "The size of each chunk of a partial variable. "
 	     "If a variable is NxM and is a partial row variable, "
 	     "there will a set of partial_variable_chunck_sizexM files that comprise it in the working directory.");
+DEFINE_double(cesium_index_timeout, -1.0,
+	      "If positive, nodes send heartbeats while they run a batch. A node that runs a single index for "
+	      "longer than this many seconds, or stops sending heartbeats for that long, is considered hung: "
+	      "its indices are handed to other nodes and it gets no more work until it reports back.");
+DEFINE_double(cesium_heartbeat_interval, 1.0, 
+	      "The number of seconds between the heartbeats of a node (see cesium_index_timeout).");
+DEFINE_int32(cesium_max_index_failures, 3,
+	     "An index that was running on a node each time a node died or hung this many times is "
+	     "quarantined: it is reported and skipped instead of being retried again.");
+DEFINE_int32(cesium_submaster_group_size, 0,
+	     "If greater than 1, the nodes are organized as a two-level tree: the nodes of each host are "
+	     "split into groups of this many consecutive ranks, and the first node of each group becomes "
+	     "a sub-master that takes batches for the whole group from the master and merges the outputs "
+	     "of the group before sending them back. Keeps the master from becoming the bottleneck with "
+	     "hundreds of nodes. Otherwise every node reports to the master directly.");
 
 DEFINE_bool(cesium_debug_mode, false, 
 	    "Whether the job should run in a debugging mode that will skip inputs, etc based on "
@@ -44,9 +139,12 @@ using slib::util::Directory;
 using slib::util::MatlabMatrix;
 using slib::util::System;
 using slib::util::Timer;
+using std::deque;
+using std::list;
 using std::make_pair;
 using std::map;
 using std::pair;
+using std::set;
 using std::string;
 using std::vector;
 
@@ -56,11 +154,54 @@ namespace slib {
     scoped_ptr<Cesium> Cesium::_singleton;
     map<int, bool> Cesium::_dead_processors;
     bool Cesium::_started = false;
-    
+
+    // The broadcast pieces this process is still sending. Nothing
+    // ever waits for them, so a node that does not take its pieces
+    // cannot hold up the one sending them. The buffers stay alive
+    // with the messages until every request is done.
+    struct BroadcastSend {
+      JobMessages messages;
+      vector<MPI_Request> requests;
+    };
+    static list<BroadcastSend*> broadcast_sends;
+
+    // Frees the broadcast sends that are done.
+    static void CompleteBroadcastSends() {
+      for (list<BroadcastSend*>::iterator iter = broadcast_sends.begin(); iter != broadcast_sends.end(); ) {
+	BroadcastSend* send = *iter;
+	int flag = 1;
+	if (send->requests.size() > 0 
+	    && MPI_Testall((int) send->requests.size(), &send->requests[0], &flag, MPI_STATUSES_IGNORE) 
+	    != MPI_SUCCESS) {
+	  LOG(ERROR) << "Could not send broadcast variables";
+	  flag = 1;
+	}
+	if (flag) {
+	  delete send;
+	  iter = broadcast_sends.erase(iter);
+	} else {
+	  iter++;
+	}
+      }
+    }
+
+    // Called before the process finishes. The buffers of sends that
+    // are still not done are left alone, since MPI may yet read them.
+    static void AbandonBroadcastSends() {
+      CompleteBroadcastSends();
+      if (broadcast_sends.size() > 0) {
+	LOG(WARNING) << "Abandoning " << broadcast_sends.size() << " broadcasts that were never received";
+	broadcast_sends.clear();
+      }
+    }
+
     Cesium::Cesium() 
       : _rank(-1)
       , _size(-1)
+      , _local_workers(0)
       , _hostname("")
+      , _next_handle(0)
+      , _last_metrics_time(-1.0)
       , _batch_size(-1)
       , _checkpoint_interval(-1)
       , _stripped_feature_dimensions(-1) {}
@@ -118,122 +259,307 @@ namespace slib {
 
     void Cesium::SetExecutionNodes(const vector<int>& nodes) { 
       InitializeInstance();
-      _instance->available_processors = vector<int>(nodes);
+      _instance->execution_nodes.clear();
+      for (int i = 0; i < (int) nodes.size(); i++) {
+	_instance->execution_nodes[nodes[i]] = true;
+      }
     }
 
-    map<string, vector<int> > Cesium::GetHostnameNodes() const {
-      JobController controller;
-      
-      map<string, vector<int> > info;
+    void Cesium::SetOutputReducer(const string& variable_name, OutputReducer* reducer) {
+      InitializeInstance();
+      OutputReducer*& current = _instance->output_reducers[variable_name];
+      if (current != NULL && current != reducer) {
+	delete current;
+      }
+      current = reducer;
+      _instance->output_variable_types[variable_name] = STREAMED_VARIABLE;
+    }
 
-      JobDescription hostname;
-      hostname.command = CESIUM_IDENTIFY_HOSTNAME_JOB_STRING;
-      for (int node = 0; node < _size; node++) {
-	if (node == MPI_ROOT_NODE) {
-	  info[_hostname].push_back(node);
-	  continue;
-	}
-	controller.StartJobOnNode(hostname, node);
-	const string hostname = JobNode::WaitForString(node);
+    string Cesium::GetOutputStoreFilename(const string& variable_name) const {
+      return FLAGS_cesium_working_directory + "/" + variable_name + ".store";
+    }
 
-	info[hostname].push_back(node);
+    map<string, vector<int> > Cesium::GetHostnameNodes() const {
+      map<string, vector<int> > info;
+      for (int node = 0; node < (int) _node_hostnames.size(); node++) {
+	info[_node_hostnames[node]].push_back(node);
       }
 
       return info;
     }
 
     vector<string> Cesium::GetNodeHostnames() const {
-      JobController controller;
-      
-      vector<string> info(_size);
+      return _node_hostnames;
+    }
 
-      JobDescription hostname;
-      hostname.command = CESIUM_IDENTIFY_HOSTNAME_JOB_STRING;
-      for (int node = 0; node < _size; node++) {
-	if (node == MPI_ROOT_NODE) {
-	  info[node] = _hostname;
-	  continue;
+    void Cesium::SetParametersIntelligently(CesiumExecutionInstance* instance) {
+      const int total_indices = instance->total_indices;
+      int num_nodes = 0;
+      for (int node = 1; node < _size; node++) {
+	if (_node_parents[node] == MPI_ROOT_NODE && CanRunOnNode(instance, node) 
+	    && _dead_processors.find(node) == _dead_processors.end()) {
+	  num_nodes += GetNumberOfWorkers(node);
 	}
-	controller.StartJobOnNode(hostname, node);
-	const string hostname = JobNode::WaitForString(node);
-
-	info[node] = hostname;
       }
 
-      return info;
-    }
-
-    void Cesium::SetParametersIntelligently() {
-      const int total_indices = _instance->total_indices;
-      const int num_nodes = _instance->available_processors.size();
-
       if (total_indices < 15) {
-	_batch_size = 3;
+	instance->batch_size = 3;
       } else if (total_indices < 30) {
-	_batch_size = 7;
+	instance->batch_size = 7;
       } else if (total_indices < 100) {
-	_batch_size = 10;
+	instance->batch_size = 10;
       } else {
-	_batch_size = 25;
+	instance->batch_size = 25;
       }
       
       const int even = (int) (floor(((float) total_indices) / ((float) num_nodes)));
-      if (_batch_size > even) {
-	_batch_size = even;
+      if (instance->batch_size > even) {
+	instance->batch_size = even;
       }
       
-      if (_batch_size <= 0) {
-	_batch_size = 1;
+      if (instance->batch_size <= 0) {
+	instance->batch_size = 1;
       }
             
       // In general we want about a checkpoint every couple of batches.
       if (num_nodes < 5) {
-	_checkpoint_interval = _batch_size * 2;
+	instance->checkpoint_interval = instance->batch_size * 2;
       } else if (num_nodes < 50) {
-	_checkpoint_interval = _batch_size * 10;
+	instance->checkpoint_interval = instance->batch_size * 10;
       } else if (num_nodes < 100) {
-	_checkpoint_interval = _batch_size * 20;
+	instance->checkpoint_interval = instance->batch_size * 20;
       } else {
-	_checkpoint_interval = _batch_size * 50;
+	instance->checkpoint_interval = instance->batch_size * 50;
       }
       
       LOG(INFO) << "***********************************************";
-      LOG(INFO) << "Setting batch size: " << _batch_size;
+      LOG(INFO) << "Setting batch size: " << instance->batch_size;
+      if (FLAGS_cesium_adaptive_batch_size) {
+	LOG(INFO) << "Batch sizes will adapt to a target of " << FLAGS_cesium_target_batch_seconds 
+		  << " seconds per batch";
+      }
       if (FLAGS_cesium_checkpoint_variables) {
-	LOG(INFO) << "Setting checkpoint interval: " << _checkpoint_interval;
+	LOG(INFO) << "Setting checkpoint interval: " << instance->checkpoint_interval;
       } else {
-	_checkpoint_interval = -1;
+	instance->checkpoint_interval = -1;
       }
       LOG(INFO) << "***********************************************";
     }
+
+    int Cesium::GetBatchSizeForNode(const CesiumExecutionInstance* instance, const int& node) const {
+      // A sub-master takes a batch for each node of its group at once.
+      const int workers = GetNumberOfWorkers(node);
+      if (!instance->use_intelligent_parameters || !FLAGS_cesium_adaptive_batch_size || instance->batch_size <= 0) {
+	return instance->batch_size > 0 ? instance->batch_size * workers : instance->batch_size;
+      }
+
+      // The measured throughput of a sub-master is already that of its
+      // whole group.
+      const double seconds_per_index = GetSecondsPerIndex(instance, node);
+      int batch_size = instance->batch_size * workers;
+      if (seconds_per_index > 0.0) {
+	batch_size = (int) (FLAGS_cesium_target_batch_seconds / seconds_per_index);
+      }
+
+      // Guided self-scheduling: shrink batches as the job drains so
+      // that the tail is spread over all of the nodes.
+      int num_nodes = 0;
+      for (int i = 0; i < (int) _available_processors.size(); i++) {
+	if (CanRunOnNode(instance, _available_processors[i])) {
+	  num_nodes += GetNumberOfWorkers(_available_processors[i]);
+	}
+      }
+      for (map<int, vector<int> >::const_iterator iter = instance->node_indices.begin();
+	   iter != instance->node_indices.end(); iter++) {
+	num_nodes += GetNumberOfWorkers(iter->first);
+      }
+      if (num_nodes > 0) {
+	const int share = (instance->indices.GetNumberOfReady() * workers + num_nodes - 1) / num_nodes;
+	if (batch_size > share) {
+	  batch_size = share;
+	}
+      }
+
+      return batch_size > 0 ? batch_size : 1;
+    }
+
+    double Cesium::GetSecondsPerIndex(const CesiumExecutionInstance* instance, const int& node) const {
+      // Use the node's own throughput if we have seen it complete a
+      // batch, otherwise the average over all measured nodes.
+      const map<int, double>::const_iterator iter = instance->node_seconds_per_index.find(node);
+      if (iter != instance->node_seconds_per_index.end()) {
+	return iter->second;
+      } else if (instance->node_seconds_per_index.size() > 0) {
+	double total = 0.0;
+	for (map<int, double>::const_iterator it = instance->node_seconds_per_index.begin();
+	     it != instance->node_seconds_per_index.end(); it++) {
+	  total += it->second;
+	}
+	return total / ((double) instance->node_seconds_per_index.size());
+      }
+      return -1.0;
+    }
+
+    int Cesium::DispatchIndicesForNode(CesiumExecutionInstance* instance, const int& node, 
+				       const int& max_indices, vector<int>* indices) {
+      if (max_indices <= 0) {
+	return 0;
+      }
+      if (!FLAGS_cesium_locality_aware_scheduling) {
+	return instance->indices.Dispatch(max_indices, indices);
+      }
+
+      // Pick up a range the node was sent before (newest first),
+      // otherwise continue where its previous batch of this job ended.
+      // What follows a batch of an earlier job is likely another
+      // node's range, so that is left alone.
+      deque<pair<int, int> >& ranges = _node_index_ranges[node];
+      int first = -1;
+      int max_range_indices = max_indices;
+      for (deque<pair<int, int> >::reverse_iterator iter = ranges.rbegin(); 
+	   first < 0 && iter != ranges.rend(); iter++) {
+	first = instance->indices.FindReady(iter->first, iter->second);
+	if (first >= 0) {
+	  max_range_indices = std::min(max_indices, iter->second - first + 1);
+	}
+      }
+      const map<int, int>::const_iterator last_iter = instance->node_last_indices.find(node);
+      if (first < 0 && last_iter != instance->node_last_indices.end() 
+	  && instance->indices.IsReady(last_iter->second + 1)) {
+	first = last_iter->second + 1;
+      }
+
+      // A short batch is better than one topped up from the front of
+      // the ready queue, which holds other nodes' ranges.
+      int added = 0;
+      if (first >= 0) {
+	added = instance->indices.DispatchRange(first, max_range_indices, indices);
+	VLOG(2) << "Sent node " << node << " " << added << " indices it has seen before, starting at " << first;
+      } else {
+	added = instance->indices.Dispatch(max_indices, indices);
+      }
+
+      if (added > 0) {
+	const int last = indices->size() - 1;
+	const int start = last - added + 1;
+	int low = (*indices)[start];
+	int high = (*indices)[start];
+	for (int i = start + 1; i <= last; i++) {
+	  low = std::min(low, (*indices)[i]);
+	  high = std::max(high, (*indices)[i]);
+	}
+	ranges.push_back(make_pair(low, high));
+	instance->node_last_indices[node] = high;
+	// Enough to cover a few passes over the node's share of a job.
+	while (ranges.size() > 32) {
+	  ranges.pop_front();
+	}
+      }
+      return added;
+    }
     
     CesiumNodeType Cesium::Start() {
       int flag;
       MPI_Initialized(&flag);
       if (!flag) {
 	VLOG(1) << "Initializing MPI";
-	MPI_Init(NULL, NULL);
+	// Compute threads never make MPI calls themselves.
+	int provided;
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
       }
       MPI_Comm_rank(MPI_COMM_WORLD, &_rank);
       MPI_Comm_size(MPI_COMM_WORLD, &_size);
 
+      // Exchange hostnames up front so that nodes on the same host
+      // can be grouped without talking to them again.
       {
-	char buf[32];
-	gethostname(buf, sizeof(char) * 32);
+	const int length = 64;
+	char buf[length];
+	memset(buf, 0, sizeof(char) * length);
+	gethostname(buf, sizeof(char) * (length - 1));
 	_hostname = string(buf);
+
+	scoped_array<char> hostnames(new char[length * _size]);
+	MPI_Allgather(buf, length, MPI_CHAR, hostnames.get(), length, MPI_CHAR, MPI_COMM_WORLD);
+	_node_hostnames.clear();
+	for (int node = 0; node < _size; node++) {
+	  _node_hostnames.push_back(string(hostnames.get() + node * length));
+	}
+      }
+
+      // On its own, the master runs the jobs on local nodes instead.
+      if (_size == 1) {
+	_local_workers = FLAGS_cesium_local_workers;
+	if (_local_workers <= 0) {
+	  _local_workers = std::max((int) sysconf(_SC_NPROCESSORS_ONLN), 1);
+	}
+	LOG(INFO) << "No other processes; running jobs on " << _local_workers << " local nodes";
+	if (FLAGS_cesium_index_timeout > 0.0) {
+	  LOG(WARNING) << "Local nodes do not send heartbeats; ignoring cesium_index_timeout";
+	  FLAGS_cesium_index_timeout = -1.0;
+	}
+	for (int node = 1; node <= _local_workers; node++) {
+	  _node_hostnames.push_back(_hostname);
+	}
+	_size = _local_workers + 1;
       }
       LOG(INFO) << "Joining the job as processor: " << _rank << " (" << _hostname << ")";
+      SetupTopology();
+      JobNode::SetMaxMessageBytes(FLAGS_cesium_max_message_bytes);
+      JobNode::SetCompressionThreshold(FLAGS_cesium_compression_threshold);
+
+      if (FLAGS_cesium_trace_file != "") {
+	string process_name = "master";
+	if (_rank != MPI_ROOT_NODE) {
+	  process_name = StringUtils::StringPrintf("%s %d (%s)", _node_workers[_rank] > 0 ? "sub-master" : "node",
+						   _rank, _hostname.c_str());
+	}
+	Tracer::Enable(_rank, process_name);
+      }
       
       Cesium::_started = true;
 
       if (_rank == MPI_ROOT_NODE) {	
 	Directory::CreateIfNotExists(FLAGS_cesium_temporary_directory);
 	return CesiumMasterNode;
+      } else if (_node_workers[_rank] > 0) {
+	SubMasterLoop();
+	return CesiumComputeNode;
       } else {
 	ComputeNodeLoop();
 	return CesiumComputeNode;
       }
     }
+
+    void Cesium::SetupTopology() {
+      _node_parents.assign(_size, MPI_ROOT_NODE);
+      _node_workers.assign(_size, 0);
+      if (FLAGS_cesium_submaster_group_size > 1 && _local_workers == 0) {
+	const map<string, vector<int> > hostname_nodes = GetHostnameNodes();
+	for (map<string, vector<int> >::const_iterator iter = hostname_nodes.begin();
+	     iter != hostname_nodes.end(); iter++) {
+	  vector<int> nodes;
+	  for (int i = 0; i < (int) iter->second.size(); i++) {
+	    if (iter->second[i] != MPI_ROOT_NODE) {
+	      nodes.push_back(iter->second[i]);
+	    }
+	  }
+
+	  // The first node of each group is its sub-master.
+	  for (int first = 0; first < (int) nodes.size(); first += FLAGS_cesium_submaster_group_size) {
+	    const int last = std::min(first + FLAGS_cesium_submaster_group_size, (int) nodes.size());
+	    for (int i = first + 1; i < last; i++) {
+	      _node_parents[nodes[i]] = nodes[first];
+	      _node_workers[nodes[first]]++;
+	    }
+	  }
+	}
+      }
+    }
+
+    int Cesium::GetNumberOfWorkers(const int& node) const {
+      return _node_workers[node] > 0 ? _node_workers[node] : 1;
+    }
     
     void Cesium::Finish() {
       if (_rank != MPI_ROOT_NODE) {
@@ -247,19 +573,42 @@ namespace slib {
 	return;
       }
 
+      // Don't leave any nodes in the middle of a batch.
+      while (_running_instances.size() > 0) {
+	LOG(WARNING) << "Finishing while job " << _running_instances.begin()->first << " is still running";
+	WaitForJob(_running_instances.begin()->first);
+      }
+      DrainProcessors();
+      // Local nodes stop with their controller.
+      if (_local_workers > 0) {
+	_controller.reset();
+      }
       JobController controller;
       
       JobDescription finish;
       finish.command = CESIUM_FINISH_JOB_STRING;
-      for (int node = 1; node < _size; node++) {
-	if (_dead_processors.find(node) == _dead_processors.end()) {
+      for (int node = 1; node < _size && _local_workers == 0; node++) {
+	if (_node_parents[node] == MPI_ROOT_NODE && _dead_processors.find(node) == _dead_processors.end()) {
 	  VLOG(1) << "Sending finish request to node: " << node;
 	  controller.StartJobOnNode(finish, node);
 	  JobNode::WaitForString(node);
 	  VLOG(1) << "Node finished cleanly: " << node;
+	  // Followed by its trace, which includes that of its group.
+	  if (Tracer::IsEnabled()) {
+	    Tracer::AddEvents(JobNode::WaitForString(node));
+	  }
 	}
       }
 
+      AbandonBroadcastSends();
+      if (Tracer::IsEnabled() && Tracer::WriteToFile(FLAGS_cesium_trace_file)) {
+	LOG(INFO) << "Wrote the trace of all nodes to: " << FLAGS_cesium_trace_file;
+      }
+
+      // Finish writing the checkpoints.
+      _checkpoint_writer.reset();
+      _log_exporter.reset();
+
       google::FlushLogFiles(google::GLOG_INFO);
       MPI_Finalize();
     }
@@ -270,6 +619,11 @@ namespace slib {
       Cesium::GetInstance()->HandleJobCompleted(output, node);
     }
 
+    // Runs a batch on one of the local nodes (see cesium_local_workers).
+    void __RunLocalJobWrapper__(JobDescription* job, JobOutput* output) {
+      Cesium::GetInstance()->RunJob(job, output);
+    }
+
     void __HandleCommunicationErrorWrapper__(const int& error_code, const int& node) {
       VLOG(1) << "Communication Error: " << error_code << " (node: " << node << ")";
       int eclass;
@@ -280,418 +634,1642 @@ namespace slib {
     }
 
     void Cesium::HandleDeadNode(const int& node) {
+      if (_draining_processors.find(node) != _draining_processors.end()) {
+	LOG(WARNING) << "*** Node died while finishing a previous job: " << node;
+	_draining_processors.erase(node);
+      }
+      _node_cached_hashes.erase(node);
+
+      // On a sub-master, the worker's share of its batch is handed
+      // out again.
+      const map<int, pair<SubMasterBatch*, vector<int> > >::iterator worker_iter = _worker_batches.find(node);
+      if (worker_iter != _worker_batches.end()) {
+	worker_iter->second.first->indices.Requeue(worker_iter->second.second);
+	_worker_batches.erase(worker_iter);
+      }
+
+      _unhealthy_processors.erase(node);
+
+      if (_dead_processors.find(node) == _dead_processors.end()) {
+	LOG(WARNING) << "*** Removing dead node from processor pool: " << node;
+	// Add it to the list of dead processors.
+	_dead_processors[node] = true;
+	// Remove it from the list of available processors.
+	for (int i = 0; i < (int) _available_processors.size(); i++) {
+	  if (_available_processors[i] == node) {
+	    _available_processors.erase(_available_processors.begin() + i);
+	    break;
+	  }
+	}
+      }
+
+      const map<int, int>::iterator owner_iter = _node_owners.find(node);
+      if (owner_iter == _node_owners.end()) {
+	return;
+      }
+      const map<int, CesiumExecutionInstance*>::iterator iter = _running_instances.find(owner_iter->second);
+      _node_owners.erase(owner_iter);
+      if (iter == _running_instances.end()) {
+	return;
+      }
+      CesiumExecutionInstance* instance = iter->second;
+
       // Usually the mutex will be locked when we get here.
-      _instance->job_completion_mutex.unlock();
-
-      if (_instance.get() != NULL) {
-	_instance->job_completion_mutex.lock(); {
-	  if (_instance->dead_processors.find(node) == _instance->dead_processors.end()) {
-	    LOG(WARNING) << "*** Removing dead node from processor pool: " << node;
-	    // Add it to the list of dead processors.
-	    _instance->dead_processors[node] = true;
-	    // Remove it from the list of available processors.
-	    for (int i = 0; i < (int) _instance->available_processors.size(); i++) {
-	      if (_instance->available_processors[i] == node) {
-		_instance->available_processors.erase(_instance->available_processors.begin() + i);
-		break;
-	      }
-	    }
-	    // Requeue all of the indices that the node was processing.
-	    const vector<int>& indices = _instance->node_indices[node];
-	    for (int i = 0; i < (int) indices.size(); i++) {
-	      _instance->pending_indices.erase(indices[i]);
-	    }
-	    _instance->node_indices.erase(node);
+      instance->job_completion_mutex.unlock();
+
+      instance->job_completion_mutex.lock(); {
+	// Requeue all of the indices that the node was processing.
+	RequeueNodeBatches(instance, node);
+
+	// Let another node on the host publish the shared variables.
+	const map<string, int>::iterator publisher_iter 
+	  = instance->shared_variable_publishers.find(_node_hostnames[node]);
+	if (publisher_iter != instance->shared_variable_publishers.end() && publisher_iter->second == node) {
+	  instance->shared_variable_publishers.erase(publisher_iter);
+	}
+      }
+      instance->job_completion_mutex.unlock();
+    }
+
+    void Cesium::RequeueNodeBatches(CesiumExecutionInstance* instance, const int& node) {
+      // The failure is blamed on the indices the node said it was
+      // running, or on its whole batch if it never said.
+      vector<int> failed = instance->node_indices[node];
+      const map<int, map<int, double> >::iterator running_iter = _node_running_indices.find(node);
+      if (running_iter != _node_running_indices.end() && running_iter->second.size() > 0) {
+	failed.clear();
+	for (map<int, double>::const_iterator iter = running_iter->second.begin();
+	     iter != running_iter->second.end(); iter++) {
+	  failed.push_back(iter->first);
+	}
+      }
+      if (running_iter != _node_running_indices.end()) {
+	_node_running_indices.erase(running_iter);
+      }
+      _node_heartbeat_time.erase(node);
+
+      instance->indices.Requeue(instance->node_indices[node]);
+      instance->node_indices.erase(node);
+      instance->indices.Requeue(instance->node_prefetched_indices[node]);
+      instance->node_prefetched_indices.erase(node);
+      instance->node_dispatch_time.erase(node);
+      instance->speculated_nodes.erase(node);
+      instance->speculative_nodes.erase(node);
+
+      for (int i = 0; i < (int) failed.size(); i++) {
+	const int failures = ++instance->index_failures[failed[i]];
+	if (failures >= FLAGS_cesium_max_index_failures && instance->indices.MarkCompleted(failed[i])) {
+	  LOG(ERROR) << "*** Quarantining index " << failed[i] << " after " << failures << " failed attempts";
+	  instance->quarantined_indices.push_back(failed[i]);
+	}
+      }
+    }
+
+    void Cesium::CheckForHungNodes() {
+      int node;
+      vector<int> indices;
+      while (JobNode::ReceiveHeartbeat(&node, &indices)) {
+	const double now = MPI_Wtime();
+	const map<int, int>::const_iterator owner_iter = _node_owners.find(node);
+	if (owner_iter == _node_owners.end() || _running_instances.count(owner_iter->second) == 0) {
+	  continue;
+	}
+	_node_heartbeat_time[node] = now;
+
+	// Heartbeats sent before the node finished its previous batch
+	// may still list its indices.
+	const vector<int>& batch = _running_instances[owner_iter->second]->node_indices[node];
+	const set<int> batch_indices(batch.begin(), batch.end());
+	const map<int, double>& previous = _node_running_indices[node];
+	map<int, double> running;
+	for (int i = 0; i < (int) indices.size(); i++) {
+	  if (batch_indices.find(indices[i]) != batch_indices.end()) {
+	    const map<int, double>::const_iterator iter = previous.find(indices[i]);
+	    running[indices[i]] = (iter != previous.end()) ? iter->second : now;
+	  }
+	}
+	_node_running_indices[node].swap(running);
+      }
+
+      const double now = MPI_Wtime();
+      const map<int, int> owners = _node_owners;
+      for (map<int, int>::const_iterator owner_iter = owners.begin(); owner_iter != owners.end(); owner_iter++) {
+	const int node = owner_iter->first;
+	const map<int, CesiumExecutionInstance*>::iterator instance_iter 
+	  = _running_instances.find(owner_iter->second);
+	if (instance_iter == _running_instances.end()) {
+	  continue;
+	}
+	CesiumExecutionInstance* instance = instance_iter->second;
+
+	// The node has to send a heartbeat within the timeout of being
+	// handed its batch and of its previous heartbeat, and may not
+	// spend longer than that on any one index.
+	double last_seen = -1.0;
+	const map<int, double>::const_iterator dispatch_iter = instance->node_dispatch_time.find(node);
+	if (dispatch_iter != instance->node_dispatch_time.end()) {
+	  last_seen = dispatch_iter->second;
+	}
+	const map<int, double>::const_iterator heartbeat_iter = _node_heartbeat_time.find(node);
+	if (heartbeat_iter != _node_heartbeat_time.end() && heartbeat_iter->second > last_seen) {
+	  last_seen = heartbeat_iter->second;
+	}
+	bool hung = (last_seen >= 0.0 && now - last_seen > FLAGS_cesium_index_timeout);
+	const map<int, double>& running = _node_running_indices[node];
+	for (map<int, double>::const_iterator iter = running.begin(); iter != running.end(); iter++) {
+	  if (now - iter->second > FLAGS_cesium_index_timeout) {
+	    LOG(WARNING) << "Node " << node << " has been running index " << iter->first 
+			 << " for " << now - iter->second << " seconds";
+	    hung = true;
 	  }
 	}
-	_instance->job_completion_mutex.unlock();
+	if (!hung) {
+	  continue;
+	}
+
+	// Whatever the node sends back is dropped, after which it
+	// rejoins the pool.
+	LOG(WARNING) << "*** Node " << node << " missed its deadline; marking it unhealthy";
+	const int num_batches = 1 + instance->node_prefetched_indices.count(node);
+	instance->job_completion_mutex.lock(); {
+	  RequeueNodeBatches(instance, node);
+	}
+	instance->job_completion_mutex.unlock();
+	_node_owners.erase(node);
+	_draining_processors[node] = num_batches;
+	_unhealthy_processors[node] = true;
       }
     }
 
     void Cesium::InitializeInstance() {
       if (_instance.get() == NULL) {
 	_instance.reset(new CesiumExecutionInstance());
+	_instance->handle = -1;
+	_instance->output = NULL;
+	_instance->success = true;
 	_instance->total_indices = 0;
+	_instance->batch_size = -1;
+	_instance->checkpoint_interval = -1;
+	_instance->last_report_time = -1.0;
+	_instance->start_time = -1.0;
+	_instance->start_completed = 0;
 	_instance->partial_output_unique_int = 0;
 	_instance->process_all_indices_at_once = false;
 	_instance->use_intelligent_parameters = true;
       }
     }
 
-    void Cesium::LoadCheckpoint(const vector<string>& variables, vector<int>* all_indices) {
+    void Cesium::LoadCheckpoint(CesiumExecutionInstance* instance, const vector<string>& variables) {
       for (int i = 0; i < (int) variables.size(); i++) {
 	const string name = variables[i];
-	const MatlabMatrix checkpoint 
-	  = MatlabMatrix::LoadFromFile(FLAGS_cesium_temporary_directory + "/" + name + "_checkpoint.mat");
-	const MatlabMatrix indices_M 
-	  = MatlabMatrix::LoadFromFile(FLAGS_cesium_temporary_directory + "/" + name + "_checkpoint_indices.mat");
-	
-	if (checkpoint.GetMatrixType() == slib::util::MATLAB_NO_TYPE
-	    || indices_M.GetMatrixType() == slib::util::MATLAB_NO_TYPE) {
+	MatlabMatrix checkpoint;
+	vector<int> indices;
+	if (!GetCheckpointWriter()->Load(FLAGS_cesium_temporary_directory + "/" + name + "_checkpoint", 
+					 &checkpoint, &indices)) {
 	  LOG(WARNING) << "Could not load checkpointing information for variable: " << name;
-	  return;
+	  continue;
 	}
 	
-	_instance->final_outputs[name].Merge(checkpoint);
-	const FloatMatrix indices = indices_M.GetCopiedContents();
-	for (int i = 0; i < indices.rows(); i++) {
-	  const int index = (int) indices(i, 0); 
-	  _instance->completed_indices[index] = true;
-	  _instance->output_indices[name].push_back(index);
-	  for (int j = 0; j < all_indices->size(); j++) {
-	    if ((*all_indices)[j] == index) {
-	      all_indices->erase(all_indices->begin() + j);
-	      break;
-	    }
-	  }
+	instance->final_outputs[name].Merge(checkpoint);
+	for (int i = 0; i < (int) indices.size(); i++) {
+	  instance->indices.MarkCompleted(indices[i]);
 	}
+	// New checkpoints are appended to this one.
+	instance->checkpoint_started[name] = true;
 	
-	LOG(INFO) << "Found checkpoint for variable: " << name 
-		  << " (Indices: " << _instance->output_indices[name].size() << ")";
+	LOG(INFO) << "Found checkpoint for variable: " << name << " (Indices: " << indices.size() << ")";
+      }
+    }
+
+    CheckpointWriter* Cesium::GetCheckpointWriter() {
+      if (_checkpoint_writer.get() == NULL) {
+	_checkpoint_writer.reset(new CheckpointWriter(FLAGS_cesium_checkpoint_compaction_interval));
       }
+      return _checkpoint_writer.get();
     }
     
-    bool Cesium::ExecuteJob(const JobDescription& job, JobOutput* output) {
-      LOG(INFO) << "Total processors: " << _size - 1;
-      if (_size - 1 <= 0) {
-	LOG(ERROR) << "This job was started with no workers!";
+    // Copies the serialized matrix into a new shared memory
+    // segment. Fails if the segment already exists.
+    static bool PublishSharedVariable(const string& segment, const string& serialized) {
+      const int fd = shm_open(segment.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+      if (fd < 0) {
+	VLOG(1) << "Could not create shared memory segment " << segment << ": " << strerror(errno);
 	return false;
       }
 
-      JobDescription mutable_job = job;
+      bool success = (ftruncate(fd, serialized.length()) == 0);
+      if (success) {
+	void* data = mmap(NULL, serialized.length(), PROT_WRITE, MAP_SHARED, fd, 0);
+	success = (data != MAP_FAILED);
+	if (success) {
+	  memcpy(data, serialized.data(), serialized.length());
+	  munmap(data, serialized.length());
+	}
+      }
+      close(fd);
 
-      InitializeInstance();
+      if (!success) {
+	LOG(ERROR) << "Could not write shared memory segment " << segment << ": " << strerror(errno);
+	shm_unlink(segment.c_str());
+      }
+      return success;
+    }
 
-      if (_instance->process_all_indices_at_once) {
-	mutable_job.variables[CESIUM_CONFIG_ALL_INDICES_FIELD] = MatlabMatrix(true);
+    // Reads a matrix published by PublishSharedVariable.
+    static bool AttachSharedVariable(const string& segment, MatlabMatrix* matrix) {
+      const int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+      if (fd < 0) {
+	return false;
       }
 
-      // Determine the cached variables so we can indicate to the
-      // processors what they should cache.
-      vector<string> cached_variable_names;
-      for (map<string, VariableType>::const_iterator iter = _instance->input_variable_types.begin();
-	   iter != _instance->input_variable_types.end(); iter++) {
-	if ((*iter).second >> MPIJOB_CACHED_VARIABLE_BITMASK) {
-	  cached_variable_names.push_back((*iter).first);
+      struct stat info;
+      bool success = (fstat(fd, &info) == 0 && info.st_size > 0);
+      if (success) {
+	void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	success = (data != MAP_FAILED);
+	if (success) {
+	  matrix->Deserialize(static_cast<const char*>(data));
+	  munmap(data, info.st_size);
 	}
       }
-      mutable_job.variables[CESIUM_CACHED_VARIABLES_FIELD] = MatlabMatrix(cached_variable_names);
+      close(fd);
 
-      for (map<string, VariableType>::const_iterator iter = job.variable_types.begin(); 
-	   iter != job.variable_types.end(); iter++) {
-	const string name = (*iter).first;
-	const VariableType type = (*iter).second;
-	_instance->input_variable_types[name] = type;
+      return success;
+    }
+
+    void Cesium::SerializeJobVariables(CesiumExecutionInstance* instance) {
+      JobDescription& mutable_job = instance->job;
+      const double start_time = MPI_Wtime();
+      for (map<string, MatlabMatrix>::const_iterator iter = mutable_job.variables.begin();
+	   iter != mutable_job.variables.end(); iter++) {
+	if (instance->partial_variables.find(iter->first) == instance->partial_variables.end()) {
+	  mutable_job.serialized_variables[iter->first].reset(new string(iter->second.Serialize()));
+	}
       }
-      for (map<string, VariableType>::const_iterator iter = output->variable_types.begin(); 
-	   iter != output->variable_types.end(); iter++) {
-	const string name = (*iter).first;
-	const VariableType type = (*iter).second;
-	_instance->output_variable_types[name] = type;
+      JobNode::GetTransferStatistics().serialization_seconds += MPI_Wtime() - start_time;
+    }
+
+    const string& Cesium::GetSerializedVariable(CesiumExecutionInstance* instance, const string& name) {
+      JobDescription& mutable_job = instance->job;
+      boost::shared_ptr<const string>& serialized = mutable_job.serialized_variables[name];
+      if (serialized.get() == NULL) {
+	const double start_time = MPI_Wtime();
+	serialized.reset(new string(mutable_job.variables[name].Serialize()));
+	JobNode::GetTransferStatistics().serialization_seconds += MPI_Wtime() - start_time;
       }
-            
-      const int pid = getpid();
-      if (FLAGS_logtostderr) {
-	FLAGS_cesium_export_log = false;
-      }      
+      return *serialized;
+    }
 
-      vector<int> all_indices = mutable_job.indices;
-      mutable_job.indices.clear();      
-      _instance->total_indices = all_indices.size();
-#if 1
-      // Load the checkpointed variables.
-      if (FLAGS_cesium_checkpointed_variables != "") {
-	const vector<string> variables = StringUtils::Explode(",", FLAGS_cesium_checkpointed_variables);
-	LoadCheckpoint(variables, &all_indices);
+    void Cesium::SetupCachedVariables(CesiumExecutionInstance* instance) {
+      JobDescription& mutable_job = instance->job;
+
+      // When they are broadcast, the variables every node is sent in
+      // full are cached as well (except for the compressed ones,
+      // which are left to go out compressed with the batches).
+      vector<string> names;
+      for (map<string, MatlabMatrix>::const_iterator iter = mutable_job.variables.begin();
+	   iter != mutable_job.variables.end(); iter++) {
+	const string& name = (*iter).first;
+	const map<string, VariableType>::const_iterator type_iter = instance->input_variable_types.find(name);
+	const int type = type_iter == instance->input_variable_types.end() ? 0 : (*type_iter).second;
+	if (type >> MPIJOB_CACHED_VARIABLE_BITMASK
+	    || (FLAGS_cesium_broadcast_variables 
+		&& !(type & (PARTIAL_VARIABLE_ROWS | PARTIAL_VARIABLE_COLS | FEATURE_STRIPPED_ROW_VARIABLE))
+		&& instance->partial_variables.find(name) == instance->partial_variables.end()
+		&& instance->compressed_variables.find(name) == instance->compressed_variables.end())) {
+	  names.push_back(name);
+	}
       }
-#endif 
-      VLOG(1) << "Number of indices: " << all_indices.size();
-      
-      // This is the main execution loop. The master will loop through
-      // all of the indices that need to be computed and will spawn the
-      // corresponding jobs on each of the nodes.
-      JobController controller;
-      controller.SetCompletionHandler(&__HandleJobCompletedWrapper__);
-      controller.SetCommunicationErrorHandler(&__HandleCommunicationErrorWrapper__);
-
-      // Setup the available processors information. Do in reverse
-      // order in case the job size is less than the number of
-      // nodes. Note that a user can specify these directly via a call
-      // to SetExecutionNodes().
-      if (_instance->available_processors.size() == 0) {
-	for (int node = _size - 1; node >= 1; node--) {
-	  if (FLAGS_cesium_debug_mode) {
-	    if (node == FLAGS_cesium_debug_mode_node) {	  
-	      _instance->available_processors.push_back(node);
-	    }
-	  } else {
-	    _instance->available_processors.push_back(node);
-	  }
+      if (names.size() == 0) {
+	return;
+      }
+
+      MatlabMatrix hashes(slib::util::MATLAB_CELL_ARRAY, names.size(), 2);
+      for (int i = 0; i < (int) names.size(); i++) {
+	const string hash = VariableCache::HashSerialized(GetSerializedVariable(instance, names[i]));
+	VLOG(1) << "Cached variable " << names[i] << " has hash: " << hash;
+	instance->cached_variable_hashes[names[i]] = hash;
+	hashes.SetCell(i, 0, MatlabMatrix(names[i]));
+	hashes.SetCell(i, 1, MatlabMatrix(hash));
+      }
+      mutable_job.variables[CESIUM_CACHED_VARIABLES_FIELD] = hashes;
+    }
+
+    void Cesium::SetupSharedVariables(CesiumExecutionInstance* instance) {
+      JobDescription& mutable_job = instance->job;
+
+      vector<string> names;
+      for (map<string, VariableType>::const_iterator iter = instance->input_variable_types.begin();
+	   iter != instance->input_variable_types.end(); iter++) {
+	if (((*iter).second & SHARED_VARIABLE) && mutable_job.HasInput((*iter).first)) {
+	  names.push_back((*iter).first);
 	}
       }
-      VLOG(1) << "Available processors: " << _instance->available_processors.size();
+      if (names.size() == 0) {
+	return;
+      }
 
-      if (_instance->use_intelligent_parameters) {
-	SetParametersIntelligently();
+      // Segments are unique to this master and job so that stale
+      // copies are never picked up by mistake.
+      MatlabMatrix segments(slib::util::MATLAB_CELL_ARRAY, names.size(), 2);
+      for (int i = 0; i < (int) names.size(); i++) {
+	const string segment = StringUtils::StringPrintf("/cesium.%d.%d.%s", getpid(), instance->handle, 
+							 names[i].c_str());
+	instance->shared_variable_segments[names[i]] = segment;
+	segments.SetCell(i, 0, MatlabMatrix(names[i]));
+	segments.SetCell(i, 1, MatlabMatrix(segment));
       }
-      
-      const int last_node = _size - 1;
-      
-      LOG(INFO) << "***********************************************";
-      LOG(INFO) << "Entering Main Computation Loop [" << mutable_job.command << "]";
-      LOG(INFO) << "***********************************************";
-      
-      while ((int) _instance->completed_indices.size() < _instance->total_indices) {
-	// Synchronizes access with the job completion routine.
-	_instance->job_completion_mutex.lock(); {
-	  // For each node, set the indices and run the job.
-	  for (int i = (int) _instance->available_processors.size() - 1; i >= 0; i--) {
-	    const int node = _instance->available_processors.back();
-	    
-	    if (FLAGS_cesium_debug_mode) {
-	      if (node != FLAGS_cesium_debug_mode_node) {
-		continue;
-	      }
-	    }
-	    
-	    // Set up the JobDescription for this node.
-	    vector<int> indices;
-	    string indices_list = "[";
-	    
-	    if (FLAGS_cesium_debug_mode_process_single_index >= 0) {
-	      indices.push_back(FLAGS_cesium_debug_mode_process_single_index);
-	      indices_list = StringUtils::StringPrintf("%s %d", indices_list.c_str(), indices.back());
-	    }
-	    
-	    // Determine all of the indices that are not completed =
-	    // DIFF(all_indices, completed_indices + pending_indices);
-	    vector<int> incompleted_indices;
-	    for (int j = 0; j < (int) all_indices.size(); j++) {
-	      const int index = all_indices[j];
-	      if (_instance->completed_indices.find(index) == _instance->completed_indices.end()
-		  && _instance->pending_indices.find(index) == _instance->pending_indices.end()) {
-		incompleted_indices.push_back(index);
-	      }
-	    }
-	    VLOG(1) << "Number of incompleted indices: " << incompleted_indices.size();
-	    
-	    const int available_nodes = _instance->available_processors.size();
-	    for (int j = 0; j < (int) incompleted_indices.size(); j++) {
-	      if (j % available_nodes != (available_nodes - i - 1)) {//(node - 1 - (last_node - available_nodes))) {
-		continue;
-	      }
-	      const int node_index = j;
-	      const int index = incompleted_indices[node_index];
-	      indices.push_back(index);
-	      indices_list = StringUtils::StringPrintf("%s %d", indices_list.c_str(), indices.back());
-	      _instance->pending_indices[index] = true;
-
-	      if (_batch_size > 0 && indices.size() >= _batch_size) {
-		break;
-	      }
-	    }
-	    
-	    indices_list = StringUtils::StringPrintf("%s ]", indices_list.c_str());	  
-	    
-	    // In the case that the node is not assigned any indices,
-	    // push it to the bottom of the stack so the next node gets
-	    // a chance to run something.
-	    if (indices.size() == 0) {
-	      VLOG(1) << "No indices available for node: " << node;
-	      _instance->available_processors.pop_back();
-	      _instance->available_processors.insert(_instance->available_processors.begin(), node);
-	      
-	      continue;
-	    }
-	    
-	    mutable_job.indices = indices;
-	    _instance->node_indices[node] = indices;
-
-	    // Handle partial variables that were loaded via the
-	    // LoadInputVariable method.
-	    for (map<string, pair<MatlabMatrix, FILE*> >::const_iterator iter = _instance->partial_variables.begin();
-		 iter != _instance->partial_variables.end(); iter++) {
-	      const string name = (*iter).first;
-	      const map<string, VariableType>::const_iterator type_iter = _instance->input_variable_types.find(name);
-	      if (type_iter == _instance->input_variable_types.end()) {
-		LOG(ERROR) << "Special variable does not have a type defined: " << name;
-		continue;
-	      }
+      mutable_job.variables[CESIUM_SHARED_VARIABLES_FIELD] = segments;
 
-	      const VariableType type = (*type_iter).second;
+      const map<string, vector<int> > hostname_nodes = GetHostnameNodes();
+      const map<string, vector<int> >::const_iterator local_nodes = hostname_nodes.find(_hostname);
+      if (local_nodes == hostname_nodes.end() || local_nodes->second.size() <= 1) {
+	return;
+      }
+      for (int i = 0; i < (int) names.size(); i++) {
+	if (!PublishSharedVariable(instance->shared_variable_segments[names[i]], 
+				   GetSerializedVariable(instance, names[i]))) {
+	  return;
+	}
+      }
+      VLOG(1) << "Published " << names.size() << " shared variables on the master's host";
+      instance->shared_variable_hosts[_hostname] = true;
+    }
 
-	      if (FLAGS_v >= 1) {
-		Timer::Start();
-	      }
+    // The nodes of a broadcast form a binary tree in the order they
+    // are listed in, with the master at its root.
+    static vector<int> GetBroadcastChildren(const vector<int>& nodes, const int& position) {
+      vector<int> children;
+      for (int child = 2 * position + 1; child <= 2 * position + 2 && child < (int) nodes.size(); child++) {
+	children.push_back(nodes[child]);
+      }
+      return children;
+    }
 
-	      if (type == PARTIAL_VARIABLE_ROWS) {
-		const MatlabMatrix& variable = _instance->partial_variables[name].first;
-		const Pair<int> dimensions = variable.GetDimensions();
-		if (dimensions.x <= 1) {
-		  LOG(WARNING) << "You specfied variable [" << name << "] as a partial row variable "
-			       << "but it has <= 1 rows";
-		}
-
-		MatlabMatrix partial(variable.GetMatrixType(), dimensions);
-		for (int k = 0; k < (int) indices.size(); k++) {
-		  const int index = indices[k];
-		  for (int kk = 0; kk < dimensions.y; kk++) {
-		    partial.Set(index, kk, variable.Get(index, kk));
-		  }
-		}
-
-		mutable_job.variables[name] = partial;
-	      } else if (type == PARTIAL_VARIABLE_COLS) {
-		const MatlabMatrix& variable = _instance->partial_variables[name].first;
-		const Pair<int> dimensions = variable.GetDimensions();
-		if (dimensions.y <= 1) {
-		  LOG(WARNING) << "You specfied variable [" << name << "] as a partial column variable "
-			       << "but it has <= 1 columns";
-		}
-
-		MatlabMatrix partial(variable.GetMatrixType(), dimensions);
-		for (int k = 0; k < (int) indices.size(); k++) {
-		  const int index = indices[k];
-		  for (int kk = 0; kk < dimensions.x; kk++) {
-		    partial.Set(kk, index, variable.Get(kk, index));
-		  }
-		}
-
-		mutable_job.variables[name] = partial;
-	      } else if (type == FEATURE_STRIPPED_ROW_VARIABLE) {
-		const int32 feature_dimensions = _stripped_feature_dimensions;
-		if (feature_dimensions < 0) {
-		  LOG(ERROR) << "You specified a FEATURE_STRIPPED_* variable but did not call "
-			     << "SetStrippedFeatureDimensions(). You MUST call this function in order "
-			     << "to use this variable type.";
-		  continue;
-		}
-		scoped_array<float> data(new float[feature_dimensions]);
-		
-		mutable_job.variables[name] = _instance->partial_variables[name].first;
-		FILE* fid = _instance->partial_variables[name].second;
-		if (!fid) {
-		  LOG(ERROR) << "Attempted to load a partial variable from a bad file descriptor: " + name;
-		  continue;
-		}
-		fseek(fid, 0, SEEK_SET);
-		
-		long int seek = 0;	      
-		for (int k = 0; k < (int) indices.size(); k++) {
-		  const int row = indices[k];
-		  for (int col = 0; col < (int) mutable_job.variables[name].GetDimensions().y; col++) {
-		    MatlabMatrix cell;
-		    mutable_job.variables[name].GetMutableCell(row, col, &cell);
-		    for (int kk = 0; kk < cell.GetNumberOfElements(); kk++) {
-		      const long int feature_index = (long int) cell.GetStructField("features", kk).GetScalar();
-		      fseek(fid, (feature_index - seek) * sizeof(float) * feature_dimensions, SEEK_CUR);
-		      fread(data.get(), sizeof(float), feature_dimensions, fid);
-		      
-		      cell.SetStructField("features", kk, MatlabMatrix(data.get(), 1, feature_dimensions));
-		      seek = feature_index + 1;
-		    }
-		  }
-		}
-	      }
+    void Cesium::BroadcastJobVariables(CesiumExecutionInstance* instance) {
+      // Only the idle nodes take part, as the busy ones would hold
+      // up the rest (or be waiting on the master themselves). They
+      // are sent whatever they miss with their first batches instead.
+      vector<int> nodes(1, MPI_ROOT_NODE);
+      set<int> seen;
+      for (int i = 0; i < (int) _available_processors.size(); i++) {
+	const int node = _available_processors[i];
+	if (seen.insert(node).second && CanRunOnNode(instance, node) 
+	    && _controller->GetNumberOfJobsOnNode(node) == 0) {
+	  nodes.push_back(node);
+	}
+      }
+      // Shared variables are read from memory on the nodes' hosts, and
+      // anything the nodes cannot cache would be sent again anyway.
+      const long long int cache_bytes = ((long long int) FLAGS_cesium_variable_cache_megabytes) << 20;
+      vector<string> names;
+      for (map<string, string>::const_iterator iter = instance->cached_variable_hashes.begin();
+	   iter != instance->cached_variable_hashes.end(); iter++) {
+	if (instance->shared_variable_segments.find(iter->first) == instance->shared_variable_segments.end()
+	    && VariableCache::GetHashedBytes(iter->second) <= cache_bytes) {
+	  names.push_back(iter->first);
+	}
+      }
+      if (nodes.size() < 2 || names.size() == 0) {
+	return;
+      }
+      TraceSpan span("BroadcastJobVariables");
+      CompleteBroadcastSends();
+
+      JobDescription notice;
+      notice.command = CESIUM_BROADCAST_JOB_STRING;
+      notice.indices = nodes;
+      // The hashes also give the nodes the length of each variable.
+      MatlabMatrix hashes(slib::util::MATLAB_CELL_ARRAY, names.size(), 2);
+      vector<boost::shared_ptr<const string> > parts;
+      for (int i = 0; i < (int) names.size(); i++) {
+	hashes.SetCell(i, 0, MatlabMatrix(names[i]));
+	hashes.SetCell(i, 1, MatlabMatrix(instance->cached_variable_hashes[names[i]]));
+	GetSerializedVariable(instance, names[i]);
+	parts.push_back(instance->job.serialized_variables[names[i]]);
+      }
+      notice.variables[CESIUM_CACHED_VARIABLES_FIELD] = hashes;
+      for (int i = 1; i < (int) nodes.size(); i++) {
+	JobNode::SendJobDataToNode(notice, nodes[i]);
+      }
 
-	      VLOG(1) << "Elapsed time to load partial input [" << name << "]: " << Timer::Stop();
-	    }	  
-	    
-	    // Remove any cached variables that have already been
-	    // transfered once to this node.
-	    if (_instance->processors_completed_one.find(node) != _instance->processors_completed_one.end()) {
-	      for (map<string, VariableType>::const_iterator iter = _instance->input_variable_types.begin();
-		   iter != _instance->input_variable_types.end(); iter++) {
-		if ((*iter).second >> MPIJOB_CACHED_VARIABLE_BITMASK) {
-		  const string& name = (*iter).first;
-		  VLOG(1) << "Cache hit on master for variable: " << name;
-		  mutable_job.variables[name] = MatlabMatrix();
-		}
-	      }
-	    }
+      // The master only sends the variables to its children in the
+      // tree. Each node passes every piece on to its own children as
+      // soon as it has it (see ReceiveBroadcastVariables).
+      BroadcastSend* send = new BroadcastSend;
+      send->messages.AddBytes(parts, MPI_BROADCAST_TAG, FLAGS_cesium_max_message_bytes);
+      const vector<int> children = GetBroadcastChildren(nodes, 0);
+      for (int i = 0; i < (int) children.size(); i++) {
+	const int error = JobNode::SendJobMessagesToNode(send->messages, children[i], &send->requests);
+	if (error != MPI_SUCCESS) {
+	  LOG(ERROR) << "Could not broadcast variables to node: " << children[i];
+	}
+      }
+      broadcast_sends.push_back(send);
 
-	    // Run the job.
-	    LOG(INFO) << "Starting job " << mutable_job.command << " on node " << node << ": " << indices_list;
-	    _instance->available_processors.pop_back();
-	    controller.StartJobOnNode(mutable_job, node);
-	  }
-	  ShowProgress(mutable_job.command);
+      for (int i = 1; i < (int) nodes.size(); i++) {
+	set<string>& node_hashes = _node_cached_hashes[nodes[i]];
+	for (int j = 0; j < (int) names.size(); j++) {
+	  node_hashes.insert(instance->cached_variable_hashes[names[j]]);
 	}
-	_instance->job_completion_mutex.unlock();
-	
-	// Poll the nodes to see if they have completed.
-	// TODO(sean): Would be better to have an IRQ-like interface.
-	controller.CheckForCompletion();
-	
-	// Wait for a little while so we don't overload the output.
-	if (FLAGS_cesium_export_log) {
-	  ExportLog(pid);
+      }
+      LOG(INFO) << "Broadcast " << names.size() << " variables to " << nodes.size() - 1 << " nodes";
+    }
+
+    // Fills in the cached (and shared) variables of a job on a compute
+    // node. Variables that were sent along are added to the cache and,
+    // if the master picked this node to publish the shared variables
+    // for its host, copied to shared memory (replacing the segments
+    // this node last published them under, if any). Variables that
+    // were not sent along are taken from the cache or else read from
+    // their shared memory segments. Returns false if a variable could
+    // not be found.
+    static bool LoadCachedVariables(JobDescription* job, VariableCache* cache, 
+				    map<string, string>* published_segments) {
+      map<string, string> segments;
+      if (job->HasInput(CESIUM_SHARED_VARIABLES_FIELD)) {
+	const MatlabMatrix shared = job->GetInputByName(CESIUM_SHARED_VARIABLES_FIELD);
+	for (int i = 0; i < shared.GetDimensions().x; i++) {
+	  segments[shared.GetCell(i, 0).GetStringContents()] = shared.GetCell(i, 1).GetStringContents();
+	}
+      }
+      const bool publish = job->HasInput(CESIUM_PUBLISH_SHARED_VARIABLES_FIELD);
+
+      const MatlabMatrix cached = job->GetInputByName(CESIUM_CACHED_VARIABLES_FIELD);
+      set<string> hashes;
+      for (int i = 0; i < cached.GetDimensions().x; i++) {
+	hashes.insert(cached.GetCell(i, 1).GetStringContents());
+      }
+
+      for (int i = 0; i < cached.GetDimensions().x; i++) {
+	const string name = cached.GetCell(i, 0).GetStringContents();
+	const string hash = cached.GetCell(i, 1).GetStringContents();
+	const map<string, string>::const_iterator segment = segments.find(name);
+
+	if (job->HasInput(name)) {
+	  MatlabMatrix& variable = job->variables[name];
+	  if (publish && segment != segments.end()) {
+	    const map<string, string>::iterator iter = published_segments->find(name);
+	    if ((iter == published_segments->end() || iter->second != segment->second)
+		&& PublishSharedVariable(segment->second, variable.Serialize())) {
+	      VLOG(1) << "Published shared variable " << name << " as " << segment->second;
+	      if (iter != published_segments->end()) {
+		shm_unlink(iter->second.c_str());
+	      }
+	      (*published_segments)[name] = segment->second;
+	    }
+	  }
+	  cache->Insert(hash, &variable, hashes);
+	  continue;
+	}
+
+	MatlabMatrix& variable = job->variables[name];
+	if (cache->Lookup(hash, &variable)) {
+	  VLOG(1) << "Cache hit on node for variable: " << name;
+	  continue;
+	}
+	if (segment != segments.end() && AttachSharedVariable(segment->second, &variable)) {
+	  VLOG(1) << "Read shared variable " << name << " from " << segment->second;
+	  cache->Insert(hash, &variable, hashes);
+	  continue;
+	}
+
+	LOG(WARNING) << "Cache miss on node for variable: " << name << " (" << hash << ")";
+	job->variables.erase(name);
+	return false;
+      }
+
+      return true;
+    }
+
+    // The node's half of Cesium::BroadcastJobVariables: receives the
+    // pieces of the variables from its parent in the tree (the nodes
+    // are the indices of the notice), passes each one on to its own
+    // children and adds the variables to the cache. With
+    // cesium_index_timeout it gives up on a parent that does not send
+    // a piece in time, which only costs the node a cache miss later.
+    static void ReceiveBroadcastVariables(const JobDescription& notice, VariableCache* cache) {
+      TraceSpan span("ReceiveBroadcastVariables");
+      CompleteBroadcastSends();
+      const MatlabMatrix cached = notice.GetInputByName(CESIUM_CACHED_VARIABLES_FIELD);
+      vector<string> hashes;
+      long long int length = 0;
+      for (int i = 0; i < cached.GetDimensions().x; i++) {
+	hashes.push_back(cached.GetCell(i, 1).GetStringContents());
+	length += VariableCache::GetHashedBytes(hashes.back());
+      }
+
+      int rank;
+      MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+      const vector<int>& nodes = notice.indices;
+      const int position = std::find(nodes.begin(), nodes.end(), rank) - nodes.begin();
+      if (position == 0 || position >= (int) nodes.size() || length == 0) {
+	LOG(ERROR) << "Malformed broadcast notice";
+	return;
+      }
+      const int parent = nodes[(position - 1) / 2];
+      const vector<int> children = GetBroadcastChildren(nodes, position);
+
+      // The pieces are split exactly as the master split them, and
+      // each one is sent on from where it was received into.
+      boost::shared_ptr<string> bytes(new string(length, '\0'));
+      BroadcastSend* send = new BroadcastSend;
+      send->messages.AddBytes(vector<boost::shared_ptr<const string> >(1, bytes), MPI_BROADCAST_TAG, 
+			      FLAGS_cesium_max_message_bytes);
+      const double deadline = MPI_Wtime() + FLAGS_cesium_index_timeout;
+      bool received = true;
+      for (int i = 0; i < (int) send->messages.segments.size() && received; i++) {
+	char* piece = const_cast<char*>(send->messages.segments[i][0].first);
+	const int piece_length = send->messages.segments[i][0].second;
+	MPI_Request request;
+	int flag = 0;
+	int error = MPI_Irecv(piece, piece_length, MPI_CHAR, parent, MPI_BROADCAST_TAG, MPI_COMM_WORLD, &request);
+	while (error == MPI_SUCCESS && !flag) {
+	  error = MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+	  if (!flag && FLAGS_cesium_index_timeout > 0.0 && MPI_Wtime() > deadline) {
+	    LOG(WARNING) << "Gave up waiting for broadcast variables from node: " << parent;
+	    MPI_Cancel(&request);
+	    MPI_Wait(&request, MPI_STATUS_IGNORE);
+	    break;
+	  }
+	  if (!flag) {
+	    usleep(100);
+	  }
+	}
+	if (error != MPI_SUCCESS || !flag) {
+	  received = false;
+	  break;
+	}
+	JobNode::GetTransferStatistics().bytes_received[parent] += piece_length;
+
+	for (int j = 0; j < (int) children.size(); j++) {
+	  error = MPI_Isend(piece, piece_length, MPI_CHAR, children[j], MPI_BROADCAST_TAG, MPI_COMM_WORLD, &request);
+	  if (error != MPI_SUCCESS) {
+	    LOG(ERROR) << "Could not pass broadcast variables on to node: " << children[j];
+	    continue;
+	  }
+	  send->requests.push_back(request);
+	  JobNode::GetTransferStatistics().bytes_sent[children[j]] += piece_length;
+	}
+      }
+      broadcast_sends.push_back(send);
+      if (!received) {
+	return;
+      }
+
+      // A piece left over from a broadcast this node gave up on could
+      // have been taken for one of these, so each variable is checked
+      // against its hash before it goes into the cache.
+      const set<string> keep(hashes.begin(), hashes.end());
+      long long int offset = 0;
+      for (int i = 0; i < (int) hashes.size(); i++) {
+	const long long int variable_length = VariableCache::GetHashedBytes(hashes[i]);
+	const string serialized = bytes->substr(offset, variable_length);
+	offset += variable_length;
+	if (VariableCache::HashSerialized(serialized) != hashes[i]) {
+	  LOG(WARNING) << "Dropping a broadcast variable that does not match its hash: " << hashes[i];
+	  continue;
+	}
+	MatlabMatrix variable;
+	variable.Deserialize(serialized);
+	cache->Insert(hashes[i], &variable, keep);
+      }
+      VLOG(1) << "Received " << hashes.size() << " broadcast variables from node " << parent
+	      << " and passed them on to " << children.size() << " nodes";
+    }
+
+    bool Cesium::ExecuteJob(const JobDescription& job, JobOutput* output) {
+      const int handle = ExecuteJobAsync(job, output);
+      if (handle < 0) {
+	return false;
+      }
+      return WaitForJob(handle);
+    }
+
+    int Cesium::ExecuteJobAsync(const JobDescription& job, JobOutput* output) {
+      LOG(INFO) << "Total processors: " << _size - 1;
+      if (_size - 1 <= 0) {
+	LOG(ERROR) << "This job was started with no workers!";
+	return -1;
+      }
+
+      InitializeInstance();
+      // Take ownership of the current instance so that any
+      // modifications to an "instance" will effectively create a new
+      // one while this job runs.
+      CesiumExecutionInstance* instance = _instance.release();
+      instance->handle = _next_handle++;
+      instance->output = output;
+      instance->job = job;
+      instance->batch_size = _batch_size;
+      instance->checkpoint_interval = _checkpoint_interval;
+      _running_instances[instance->handle] = instance;
+
+      JobDescription& mutable_job = instance->job;
+
+      if (instance->process_all_indices_at_once) {
+	mutable_job.variables[CESIUM_CONFIG_ALL_INDICES_FIELD] = MatlabMatrix(true);
+      }
+
+      for (map<string, VariableType>::const_iterator iter = job.variable_types.begin(); 
+	   iter != job.variable_types.end(); iter++) {
+	const string name = (*iter).first;
+	const VariableType type = (VariableType) ((*iter).second & ~COMPRESSED_VARIABLE);
+	if ((*iter).second & COMPRESSED_VARIABLE) {
+	  instance->compressed_variables.insert(name);
+	}
+	if (type != 0) {
+	  instance->input_variable_types[name] = type;
+	}
+      }
+      // JobNode compresses the variables whose type in the job says
+      // so.
+      for (set<string>::const_iterator iter = instance->compressed_variables.begin(); 
+	   iter != instance->compressed_variables.end(); iter++) {
+	mutable_job.variable_types[*iter] = (VariableType) (mutable_job.GetVariableType(*iter) | COMPRESSED_VARIABLE);
+      }
+      for (map<string, VariableType>::const_iterator iter = output->variable_types.begin(); 
+	   iter != output->variable_types.end(); iter++) {
+	const string name = (*iter).first;
+	const VariableType type = (*iter).second;
+	instance->output_variable_types[name] = type;
+      }
+      // Local nodes are handed the variables in memory, so there is
+      // nothing to serialize or cache ahead of time.
+      if (_local_workers == 0) {
+	SerializeJobVariables(instance);
+	SetupCachedVariables(instance);
+	SetupSharedVariables(instance);
+      }
+
+            
+      if (FLAGS_logtostderr) {
+	FLAGS_cesium_export_log = false;
+	_log_exporter.reset();
+      }      
+
+      instance->indices.Reset(mutable_job.indices);
+      instance->total_indices = instance->indices.GetNumberOfIndices();
+      if (FLAGS_cesium_journal_jobs) {
+	StartJournal(instance);
+      }
+      mutable_job.indices.clear();      
+#if 1
+      // Load the checkpointed variables.
+      if (FLAGS_cesium_checkpointed_variables != "") {
+	const vector<string> variables = StringUtils::Explode(",", FLAGS_cesium_checkpointed_variables);
+	LoadCheckpoint(instance, variables);
+      }
+#endif 
+      VLOG(1) << "Number of indices: " << instance->indices.GetNumberOfReady();
+      
+      // The controller and the pool of nodes are shared by every job
+      // and outlive them so that nodes still running a batch when a
+      // job returns can be drained later. Setup the pool in reverse
+      // order in case the job size is less than the number of nodes.
+      if (_controller.get() == NULL) {
+	if (_local_workers > 0) {
+	  _controller.reset(new LocalJobController(_local_workers, &__RunLocalJobWrapper__));
+	} else {
+	  _controller.reset(new JobController);
+	}
+	_controller->SetCompletionHandler(&__HandleJobCompletedWrapper__);
+	_controller->SetCommunicationErrorHandler(&__HandleCommunicationErrorWrapper__);
+
+	for (int node = _size - 1; node >= 1; node--) {
+	  if (FLAGS_cesium_debug_mode && node != FLAGS_cesium_debug_mode_node) {
+	    continue;
+	  }
+	  // The other nodes of a group get their work from its sub-master.
+	  if (_node_parents[node] != MPI_ROOT_NODE) {
+	    continue;
+	  }
+	  if (_dead_processors.find(node) == _dead_processors.end()) {
+	    _available_processors.push_back(node);
+	  }
+	}
+      }
+      VLOG(1) << "Available processors: " << GetNumberOfIdleNodes(instance);
+      if (FLAGS_cesium_broadcast_variables && _local_workers == 0) {
+	BroadcastJobVariables(instance);
+      }
+
+      if (instance->use_intelligent_parameters) {
+	SetParametersIntelligently(instance);
+      }
+      
+      LOG(INFO) << "***********************************************";
+      LOG(INFO) << "Entering Main Computation Loop [" << mutable_job.command << "] (job " << instance->handle << ")";
+      LOG(INFO) << "***********************************************";
+
+      instance->start_time = MPI_Wtime();
+      instance->start_completed = instance->indices.GetNumberOfCompleted();
+
+      ScheduleJobs();
+
+      return instance->handle;
+    }
+
+    bool Cesium::WaitForJob(const int& handle) {
+      const map<int, CesiumExecutionInstance*>::iterator iter = _running_instances.find(handle);
+      if (iter == _running_instances.end()) {
+	LOG(ERROR) << "Not a running job: " << handle;
+	return false;
+      }
+      CesiumExecutionInstance* instance = iter->second;
+
+      while (!instance->indices.IsFinished() && instance->success) {
+	ScheduleJobs();
+
+	// Block until at least one node reports back. The completion
+	// handler will return the node to the pool of available
+	// processors so it gets new work on the next pass. With
+	// cesium_index_timeout, poll instead so hung nodes are noticed.
+	// Either way nothing was running if this comes out 0.
+	int num_responses;
+	if (FLAGS_cesium_index_timeout > 0.0) {
+	  num_responses = _controller->GetNumberOfPendingJobs();
+	  _controller->CheckForCompletion();
+	  usleep(1000);
+	} else {
+	  num_responses = _controller->WaitForCompletion();
+	}
+	if (num_responses == 0 && !instance->indices.IsFinished()) {
+	  LOG(ERROR) << "No jobs are running but " 
+		     << instance->total_indices - instance->indices.GetNumberOfCompleted()
+		     << " indices are incomplete. Are there any live processors left?";
+	  instance->success = false;
+	}
+      }
+
+      const bool success = instance->success;
+      FinishJob(instance);
+      return success;
+    }
+
+    bool Cesium::IsJobFinished(const int& handle) {
+      const map<int, CesiumExecutionInstance*>::const_iterator iter = _running_instances.find(handle);
+      if (iter == _running_instances.end()) {
+	return true;
+      }
+
+      _controller->CheckForCompletion();
+      ScheduleJobs();
+      return iter->second->indices.IsFinished() || !iter->second->success;
+    }
+
+    bool Cesium::CanRunOnNode(const CesiumExecutionInstance* instance, const int& node) const {
+      return (instance->execution_nodes.size() == 0 
+	      || instance->execution_nodes.find(node) != instance->execution_nodes.end());
+    }
+
+    int Cesium::GetNumberOfIdleNodes(const CesiumExecutionInstance* instance) const {
+      int idle = 0;
+      for (int i = 0; i < (int) _available_processors.size(); i++) {
+	if (CanRunOnNode(instance, _available_processors[i])) {
+	  idle++;
+	}
+      }
+      return idle;
+    }
+
+    void Cesium::ScheduleJobs() {
+      if (FLAGS_cesium_index_timeout > 0.0) {
+	CheckForHungNodes();
+      }
+      CompleteBroadcastSends();
+
+      // For each idle node, set the indices and run the job. The
+      // oldest job that may use the node and has work left gets it,
+      // so a job's tail overlaps with the start of the next one.
+      const vector<int> idle_processors = _available_processors;
+      for (int i = (int) idle_processors.size() - 1; i >= 0; i--) {
+	const int node = idle_processors[i];
+	if (_dead_processors.find(node) != _dead_processors.end()) {
+	  continue;
+	}
+
+	for (map<int, CesiumExecutionInstance*>::iterator iter = _running_instances.begin();
+	     iter != _running_instances.end(); iter++) {
+	  CesiumExecutionInstance* instance = iter->second;
+	  if (!instance->success || !CanRunOnNode(instance, node)) {
+	    continue;
+	  }
+
+	  // Nothing left to hand out until some node finishes or dies.
+	  if (instance->indices.GetNumberOfReady() == 0 
+	      && FLAGS_cesium_debug_mode_process_single_index < 0) {
+	    continue;
+	  }
+
+	  // Synchronizes access with the job completion routine.
+	  instance->job_completion_mutex.lock(); 
+	  // Set up the JobDescription for this node.
+	  vector<int> indices;
+	  if (FLAGS_cesium_debug_mode_process_single_index >= 0) {
+	    indices.push_back(FLAGS_cesium_debug_mode_process_single_index);
+	  }
+	    
+	  // Take the next batch of indices from the ready queue. With
+	  // no batch size, split the remaining indices evenly over the
+	  // available nodes.
+	  int max_indices = GetBatchSizeForNode(instance, node) - (int) indices.size();
+	  if (instance->batch_size <= 0) {
+	    const int available_nodes = GetNumberOfIdleNodes(instance);
+	    max_indices = (instance->indices.GetNumberOfReady() + available_nodes - 1) / available_nodes;
+	  }
+	  DispatchIndicesForNode(instance, node, max_indices, &indices);
+	  VLOG(1) << "Number of ready indices: " << instance->indices.GetNumberOfReady();
+	  instance->job_completion_mutex.unlock();
+
+	  // In the case that the node is not assigned any indices, give
+	  // the next job a chance to run something.
+	  if (indices.size() == 0) {
+	    VLOG(1) << "No indices available for node: " << node;
+	    continue;
+	  }
+
+	  StartBatchOnNode(instance, node, indices);
+	  break;
+	}
+      }
+
+      if (FLAGS_cesium_prefetch_batches) {
+	StartPrefetchBatches();
+      }
+
+      for (map<int, CesiumExecutionInstance*>::iterator iter = _running_instances.begin();
+	   iter != _running_instances.end(); iter++) {
+	CesiumExecutionInstance* instance = iter->second;
+	if (!instance->success || instance->indices.IsFinished()) {
+	  continue;
+	}
+
+	StartSpeculativeBatches(instance);
+
+	// Don't flood the log, but always report at least once.
+	if (instance->last_report_time < 0.0 
+	    || MPI_Wtime() - instance->last_report_time >= FLAGS_cesium_wait_interval) {
+	  ShowProgress(instance);
+	  if (FLAGS_cesium_export_log) {
+	    ExportLog();
+	  }
+	  instance->last_report_time = MPI_Wtime();
+	}
+      }
+
+      if (FLAGS_cesium_metrics_file != "" 
+	  && (_last_metrics_time < 0.0 || MPI_Wtime() - _last_metrics_time >= FLAGS_cesium_metrics_interval)) {
+	ExportMetrics();
+	_last_metrics_time = MPI_Wtime();
+      }
+    }
+
+    void Cesium::FinishJob(CesiumExecutionInstance* instance) {
+      _running_instances.erase(instance->handle);
+      if (FLAGS_cesium_metrics_file != "") {
+	ExportMetrics();
+	_last_metrics_time = MPI_Wtime();
+      }
+
+      // Any node still holding a batch at this point is running a
+      // copy whose indices were already completed elsewhere (or the
+      // job failed). Don't wait for it; its result is dropped when it
+      // reports back.
+      for (map<int, vector<int> >::const_iterator iter = instance->node_indices.begin();
+	   iter != instance->node_indices.end(); iter++) {
+	VLOG(1) << "Node " << iter->first << " is still running a batch for this job";
+	_draining_processors[iter->first] 
+	  = 1 + instance->node_prefetched_indices.count(iter->first);
+	_node_owners.erase(iter->first);
+      }
+
+      const string command = instance->job.command;
+      LOG(INFO) << "Scheduling latency [" << command << "]: " << instance->scheduling_latency.ToString();
+      _scheduling_latency = instance->scheduling_latency;
+      _quarantined_indices = instance->quarantined_indices;
+      if (_quarantined_indices.size() > 0) {
+	string quarantined_list = "[";
+	for (int i = 0; i < (int) _quarantined_indices.size(); i++) {
+	  quarantined_list = StringUtils::StringPrintf("%s %d", quarantined_list.c_str(), _quarantined_indices[i]);
+	}
+	LOG(ERROR) << "*** " << _quarantined_indices.size() << " indices of " << command 
+		   << " were quarantined and have no outputs: " << quarantined_list << " ]";
+      }
+      
+      instance->output->variables = instance->final_outputs;
+
+      // Save any partial variables that were not completed.
+      for (map<string, VariableType>::const_iterator iter = instance->output_variable_types.begin();
+	   iter != instance->output_variable_types.end(); iter++) {
+	const string name = (*iter).first;
+	const VariableType type = (*iter).second;
+
+	if (type == slib::cesium::PARTIAL_VARIABLE_ROWS || type == slib::cesium::PARTIAL_VARIABLE_COLS) {
+	  if (instance->partial_output_indices[name].size() > 0) {
+	    LOG(INFO) << "***********************************************";
+	    LOG(INFO) << "Saving chunk for partial variable: " << name;
+	    LOG(INFO) << "***********************************************";
+
+	    Directory::CreateIfNotExists(FLAGS_cesium_temporary_directory + "/" + name);
+	    SaveTemporaryOutput(StringUtils::StringPrintf("%s/%d", name.c_str(), 
+							  instance->partial_output_unique_int), 
+				instance->final_outputs[name]);
+
+	    instance->partial_output_indices[name].clear();
+	    instance->final_outputs[name] = MatlabMatrix();
+	    instance->partial_output_unique_int++;
+	  }
+	}
+      }
+
+      // Nodes only read the shared variables while the job runs. Any
+      // published on other hosts are removed by the nodes that
+      // published them.
+      for (map<string, string>::const_iterator iter = instance->shared_variable_segments.begin();
+	   iter != instance->shared_variable_segments.end(); iter++) {
+	shm_unlink(iter->second.c_str());
+      }
+
+      // Close the partial variables.
+      for (map<string, pair<MatlabMatrix, FILE*> >::const_iterator iter = instance->partial_variables.begin();
+	   iter != instance->partial_variables.end(); iter++) {
+	const string name = (*iter).first;
+	FILE* fid = instance->partial_variables[name].second;
+	if (fid != NULL) {
+	  fclose(fid);
+	}
+      }
+
+      // Close the output stores.
+      for (map<string, OutputStore*>::iterator iter = instance->output_stores.begin();
+	   iter != instance->output_stores.end(); iter++) {
+	LOG(INFO) << "Saved " << iter->second->GetNumberOfRecords() << " batches of " << iter->first 
+		  << " to: " << iter->second->GetFilename();
+	delete iter->second;
+      }
+      for (map<string, OutputReducer*>::iterator iter = instance->output_reducers.begin();
+	   iter != instance->output_reducers.end(); iter++) {
+	delete iter->second;
+      }
+
+      delete instance;
+
+      LOG(INFO) << "***********************************************";
+      LOG(INFO) << "Exiting Main Computation Loop [" << command << "]";
+      LOG(INFO) << "***********************************************";
+    }
+    
+    void Cesium::StartBatchOnNode(CesiumExecutionInstance* instance, const int& node, 
+				  const vector<int>& indices, const bool& prefetch) {
+      string indices_list = "[";
+      for (int i = 0; i < (int) indices.size(); i++) {
+	indices_list = StringUtils::StringPrintf("%s %d", indices_list.c_str(), indices[i]);
+      }
+      indices_list = StringUtils::StringPrintf("%s ]", indices_list.c_str());	  
+
+      JobDescription* job = &instance->job;
+      job->indices = indices;
+      if (instance->journal.get() != NULL) {
+	instance->journal->RecordDispatched(node, indices);
+      }
+      if (prefetch) {
+	instance->node_prefetched_indices[node] = indices;
+      } else {
+	instance->node_indices[node] = indices;
+      }
+
+      // Handle partial variables that were loaded via the
+      // LoadInputVariable method.
+      for (map<string, pair<MatlabMatrix, FILE*> >::const_iterator iter = instance->partial_variables.begin();
+	   iter != instance->partial_variables.end(); iter++) {
+	const string name = (*iter).first;
+	const map<string, VariableType>::const_iterator type_iter = instance->input_variable_types.find(name);
+	if (type_iter == instance->input_variable_types.end()) {
+	  LOG(ERROR) << "Special variable does not have a type defined: " << name;
+	  continue;
+	}
+
+	const VariableType type = (*type_iter).second;
+
+	if (FLAGS_v >= 1) {
+	  Timer::Start();
+	}
+
+	if (type == PARTIAL_VARIABLE_ROWS) {
+	  const MatlabMatrix& variable = instance->partial_variables[name].first;
+	  const Pair<int> dimensions = variable.GetDimensions();
+	  if (dimensions.x <= 1) {
+	    LOG(WARNING) << "You specfied variable [" << name << "] as a partial row variable "
+			 << "but it has <= 1 rows";
+	  }
+
+	  // Only the batch is sent. The node expands it back to the
+	  // full dimensions.
+	  job->variables[name] = JobNode::SliceVariable(variable, type, indices);
+	} else if (type == PARTIAL_VARIABLE_COLS) {
+	  const MatlabMatrix& variable = instance->partial_variables[name].first;
+	  const Pair<int> dimensions = variable.GetDimensions();
+	  if (dimensions.y <= 1) {
+	    LOG(WARNING) << "You specfied variable [" << name << "] as a partial column variable "
+			 << "but it has <= 1 columns";
+	  }
+
+	  // Only the batch is sent. The node expands it back to the
+	  // full dimensions.
+	  job->variables[name] = JobNode::SliceVariable(variable, type, indices);
+	} else if (type == FEATURE_STRIPPED_ROW_VARIABLE) {
+	  const int32 feature_dimensions = _stripped_feature_dimensions;
+	  if (feature_dimensions < 0) {
+	    LOG(ERROR) << "You specified a FEATURE_STRIPPED_* variable but did not call "
+		       << "SetStrippedFeatureDimensions(). You MUST call this function in order "
+		       << "to use this variable type.";
+	    continue;
+	  }
+	  FILE* fid = instance->partial_variables[name].second;
+	  if (!fid) {
+	    LOG(ERROR) << "Attempted to load a partial variable from a bad file descriptor: " + name;
+	    continue;
+	  }
+
+	  // Only the rows of the batch are sent, like any other partial
+	  // row variable, and only their features are read. The features
+	  // are read in file order so the file is only ever read forward.
+	  MatlabMatrix sliced = JobNode::SliceVariable(instance->partial_variables[name].first, 
+						       PARTIAL_VARIABLE_ROWS, indices);
+	  MatlabMatrix slice = sliced.GetCopiedStructField(MPIJOB_SLICED_VARIABLE_FIELD, 0);
+	  const Pair<int> dimensions = slice.GetDimensions();
+
+	  vector<MatlabMatrix> cells(dimensions.x * dimensions.y);
+	  vector<pair<long int, pair<int, int> > > features;
+	  for (int row = 0; row < dimensions.x; row++) {
+	    for (int col = 0; col < dimensions.y; col++) {
+	      slice.GetMutableCell(row, col, &cells[row * dimensions.y + col]);
+	    }
+	  }
+	  for (int k = 0; k < (int) cells.size(); k++) {
+	    for (int kk = 0; kk < cells[k].GetNumberOfElements(); kk++) {
+	      const long int feature_index = (long int) cells[k].GetStructField("features", kk).GetScalar();
+	      features.push_back(make_pair(feature_index, make_pair(k, kk)));
+	    }
+	  }
+	  std::sort(features.begin(), features.end());
+
+	  scoped_array<float> data(new float[feature_dimensions]);
+	  fseek(fid, 0, SEEK_SET);
+	  long int seek = 0;
+	  for (int k = 0; k < (int) features.size(); k++) {
+	    const long int feature_index = features[k].first;
+	    if (feature_index != seek) {
+	      fseek(fid, (feature_index - seek) * sizeof(float) * feature_dimensions, SEEK_CUR);
+	    }
+	    fread(data.get(), sizeof(float), feature_dimensions, fid);
+	    cells[features[k].second.first].SetStructField("features", features[k].second.second, 
+							   MatlabMatrix(data.get(), 1, feature_dimensions));
+	    seek = feature_index + 1;
+	  }
+
+	  sliced.SetStructField(MPIJOB_SLICED_VARIABLE_FIELD, slice);
+	  job->variables[name] = sliced;
+	}
+
+	VLOG(1) << "Elapsed time to load partial input [" << name << "]: " << Timer::Stop();
+      }	  
+	    
+      // Withhold any cached variables that the node already holds, and
+      // any shared variables that have been published on its host.
+      // They are taken out of the job (not copied) and put back once
+      // it has been sent. Either way the node holds them afterwards,
+      // unless it is sent more than it can cache.
+      map<string, MatlabMatrix> withheld;
+      set<string>& node_hashes = _node_cached_hashes[node];
+      for (map<string, string>::const_iterator iter = instance->cached_variable_hashes.begin();
+	   iter != instance->cached_variable_hashes.end(); iter++) {
+	if (node_hashes.find(iter->second) != node_hashes.end()) {
+	  VLOG(1) << "Cache hit on master for variable: " << iter->first;
+	  withheld[iter->first].Swap(job->variables[iter->first]);
+	}
+      }
+      if (instance->shared_variable_segments.size() > 0) {
+	const string& hostname = _node_hostnames[node];
+	if (instance->shared_variable_hosts.find(hostname) != instance->shared_variable_hosts.end()) {
+	  for (map<string, string>::const_iterator iter = instance->shared_variable_segments.begin();
+	       iter != instance->shared_variable_segments.end(); iter++) {
+	    if (withheld.find(iter->first) == withheld.end()) {
+	      VLOG(1) << "Host hit on master for variable: " << iter->first;
+	      withheld[iter->first].Swap(job->variables[iter->first]);
+	    }
+	  }
+	} else if (instance->shared_variable_publishers.find(hostname) == instance->shared_variable_publishers.end()) {
+	  VLOG(1) << "Node " << node << " will publish the shared variables on host: " << hostname;
+	  instance->shared_variable_publishers[hostname] = node;
+	  job->variables[CESIUM_PUBLISH_SHARED_VARIABLES_FIELD] = MatlabMatrix(true);
+	}
+      }
+      const long long int cache_bytes = ((long long int) FLAGS_cesium_variable_cache_megabytes) << 20;
+      for (map<string, string>::const_iterator iter = instance->cached_variable_hashes.begin();
+	   iter != instance->cached_variable_hashes.end(); iter++) {
+	if (VariableCache::GetHashedBytes(iter->second) <= cache_bytes) {
+	  node_hashes.insert(iter->second);
+	}
+      }
+      for (map<string, MatlabMatrix>::const_iterator iter = withheld.begin(); iter != withheld.end(); iter++) {
+	job->variables.erase(iter->first);
+      }
+
+      // Run the job. A prefetched batch is queued behind the one the
+      // node is already running, so the node stays busy.
+      if (prefetch) {
+	LOG(INFO) << "Prefetching job " << job->command << " on node " << node << ": " << indices_list;
+	_controller->StartJobOnNode(*job, node);
+	for (map<string, MatlabMatrix>::iterator iter = withheld.begin(); iter != withheld.end(); iter++) {
+	  job->variables[iter->first].Swap(iter->second);
+	}
+	job->variables.erase(CESIUM_PUBLISH_SHARED_VARIABLES_FIELD);
+	return;
+      }
+      LOG(INFO) << "Starting job " << job->command << " on node " << node << ": " << indices_list;
+      for (int i = 0; i < (int) _available_processors.size(); i++) {
+	if (_available_processors[i] == node) {
+	  _available_processors.erase(_available_processors.begin() + i);
+	  break;
+	}
+      }
+      {
+	const map<int, double>::iterator idle_iter = _node_idle_since.find(node);
+	if (idle_iter != _node_idle_since.end()) {
+	  instance->scheduling_latency.AddSample(MPI_Wtime() - idle_iter->second);
+	  _node_idle_since.erase(idle_iter);
+	}
+      }
+      instance->node_dispatch_time[node] = MPI_Wtime();
+      _node_owners[node] = instance->handle;
+      _controller->StartJobOnNode(*job, node);
+      for (map<string, MatlabMatrix>::iterator iter = withheld.begin(); iter != withheld.end(); iter++) {
+	job->variables[iter->first].Swap(iter->second);
+      }
+      job->variables.erase(CESIUM_PUBLISH_SHARED_VARIABLES_FIELD);
+    }
+
+    void Cesium::StartSpeculativeBatches(CesiumExecutionInstance* instance) {
+      if (FLAGS_cesium_speculative_execution_fraction <= 0.0 || instance->total_indices <= 0
+	  || instance->indices.GetNumberOfReady() > 0) {
+	return;
+      }
+      const double completed_fraction 
+	= ((double) instance->indices.GetNumberOfCompleted()) / ((double) instance->total_indices);
+      if (completed_fraction < FLAGS_cesium_speculative_execution_fraction) {
+	return;
+      }
+
+      while (GetNumberOfIdleNodes(instance) > 0) {
+	// Find the node expected to finish last. Nodes that are
+	// already being copied (or are themselves copies) are skipped
+	// so each batch runs at most twice.
+	int straggler = -1;
+	double latest_finish = 0.0;
+	vector<int> outstanding;
+	vector<int> outstanding_prefetched;
+	for (map<int, vector<int> >::const_iterator iter = instance->node_indices.begin();
+	     iter != instance->node_indices.end(); iter++) {
+	  const int node = iter->first;
+	  if (instance->speculated_nodes.find(node) != instance->speculated_nodes.end()
+	      || instance->speculative_nodes.find(node) != instance->speculative_nodes.end()) {
+	    continue;
+	  }
+
+	  // The node's batch and the one prefetched for it are copied
+	  // as separate batches, so that each result of the copy covers
+	  // the same indices as one of the node's.
+	  vector<int> remaining;
+	  for (int i = 0; i < (int) iter->second.size(); i++) {
+	    if (!instance->indices.IsCompleted(iter->second[i])) {
+	      remaining.push_back(iter->second[i]);
+	    }
+	  }
+	  vector<int> remaining_prefetched;
+	  const map<int, vector<int> >::const_iterator prefetched_iter = instance->node_prefetched_indices.find(node);
+	  if (prefetched_iter != instance->node_prefetched_indices.end()) {
+	    for (int i = 0; i < (int) prefetched_iter->second.size(); i++) {
+	      if (!instance->indices.IsCompleted(prefetched_iter->second[i])) {
+		remaining_prefetched.push_back(prefetched_iter->second[i]);
+	      }
+	    }
+	  }
+	  if (remaining.size() == 0) {
+	    remaining.swap(remaining_prefetched);
+	  }
+	  if (remaining.size() == 0) {
+	    continue;
+	  }
+
+	  // A batch is assumed to need at least as long again as it has
+	  // already been running, so overdue nodes (and nodes that have
+	  // never reported back) are copied first.
+	  const double now = MPI_Wtime();
+	  double dispatch_time = now;
+	  const map<int, double>::const_iterator dispatch_iter = instance->node_dispatch_time.find(node);
+	  if (dispatch_iter != instance->node_dispatch_time.end()) {
+	    dispatch_time = dispatch_iter->second;
+	  }
+	  double expected_finish = now + (now - dispatch_time);
+	  const double seconds_per_index = GetSecondsPerIndex(instance, node);
+	  if (seconds_per_index > 0.0) {
+	    expected_finish = std::max(expected_finish, dispatch_time + seconds_per_index 
+				       * ((double) (remaining.size() + remaining_prefetched.size())));
+	  }
+
+	  if (straggler < 0 || expected_finish > latest_finish) {
+	    straggler = node;
+	    latest_finish = expected_finish;
+	    outstanding = remaining;
+	    outstanding_prefetched = remaining_prefetched;
+	  }
+	}
+	if (straggler < 0) {
+	  return;
+	}
+
+	int node = -1;
+	for (int i = (int) _available_processors.size() - 1; i >= 0 && node < 0; i--) {
+	  if (CanRunOnNode(instance, _available_processors[i])) {
+	    node = _available_processors[i];
+	  }
+	}
+	LOG(INFO) << "Speculatively re-running the batch of node " << straggler << " on node " << node
+		  << " (" << outstanding.size() + outstanding_prefetched.size() << " indices)";
+	instance->speculated_nodes[straggler] = true;
+	instance->speculative_nodes[node] = straggler;
+	StartBatchOnNode(instance, node, outstanding);
+	if (outstanding_prefetched.size() > 0) {
+	  StartBatchOnNode(instance, node, outstanding_prefetched, true);
+	}
+      }
+    }
+
+    void Cesium::StartPrefetchBatches() {
+      if (FLAGS_cesium_debug_mode_process_single_index >= 0) {
+	return;
+      }
+
+      for (map<int, CesiumExecutionInstance*>::iterator iter = _running_instances.begin();
+	   iter != _running_instances.end(); iter++) {
+	CesiumExecutionInstance* instance = iter->second;
+	if (!instance->success || instance->process_all_indices_at_once) {
+	  continue;
+	}
+
+	for (map<int, vector<int> >::const_iterator node_iter = instance->node_indices.begin();
+	     node_iter != instance->node_indices.end(); node_iter++) {
+	  const int node = node_iter->first;
+	  if (instance->node_prefetched_indices.find(node) != instance->node_prefetched_indices.end()) {
+	    continue;
+	  }
+
+	  // Only prefetch while there is more left than there are busy
+	  // nodes; otherwise the tail of the job would sit in the queue
+	  // of a node that may be slow while others go idle.
+	  vector<int> indices;
+	  instance->job_completion_mutex.lock();
+	  if (instance->indices.GetNumberOfReady() > (int) instance->node_indices.size()) {
+	    DispatchIndicesForNode(instance, node, GetBatchSizeForNode(instance, node), &indices);
+	  }
+	  instance->job_completion_mutex.unlock();
+
+	  if (indices.size() == 0) {
+	    break;
+	  }
+	  StartBatchOnNode(instance, node, indices, true);
+	}
+      }
+    }
+
+    void Cesium::DrainProcessors() const {
+      while (_draining_processors.size() > 0 && _controller.get() != NULL) {
+	VLOG(1) << "Waiting for " << _draining_processors.size() << " nodes to finish a previous job";
+	if (_unhealthy_processors.size() > 0) {
+	  LOG(WARNING) << "Waiting for " << _unhealthy_processors.size() << " unhealthy nodes to report back";
+	}
+	if (_controller->WaitForCompletion() == 0) {
+	  break;
+	}
+      }
+    }
+
+#if 0
+    void Cesium::ExecuteKernel(const Kernel& kernel, const JobDescription& job, JobOutput* output) {
+    }
+    
+    void Cesium::ExecuteFunction(const Function& function, const JobDescription& job, JobOutput* output) {
+    }
+#endif
+    
+    // The indices the threads of a compute node are running right now,
+    // which its heartbeats report (see cesium_index_timeout).
+    static set<int> running_indices;
+    static boost::signals2::mutex running_indices_mutex;
+
+    static void SetIndexRunning(const int& index, const bool& running) {
+      running_indices_mutex.lock(); {
+	if (running) {
+	  running_indices.insert(index);
+	} else {
+	  running_indices.erase(index);
+	}
+      }
+      running_indices_mutex.unlock();
+    }
+
+    static vector<int> GetRunningIndices() {
+      vector<int> indices;
+      running_indices_mutex.lock(); {
+	indices.assign(running_indices.begin(), running_indices.end());
+      }
+      running_indices_mutex.unlock();
+      return indices;
+    }
+
+    // The threads a compute node runs the indices of its batches on
+    // (see cesium_compute_threads). They are started once, when the
+    // node enters its loop, and wait for the next batch in between.
+    struct ComputeThreadPool {
+      vector<pthread_t> threads;
+      // The batch being run. Bumped for each batch so a waiting
+      // thread can tell a new one from the one it just finished.
+      int batch;
+      Function function;
+      const JobDescription* job;
+      // The next entry of job->indices to hand out.
+      int next_index;
+      JobOutput* output;
+      // The threads that have not yet finished the current batch.
+      int num_running;
+      bool stopping;
+      // Guards everything above but threads.
+      pthread_mutex_t mutex;
+      // Signalled when a batch is started or the threads should stop.
+      pthread_cond_t started;
+      // Signalled when the last thread finishes a batch.
+      pthread_cond_t finished;
+
+      ComputeThreadPool() 
+	: batch(0), function(NULL), job(NULL), next_index(0)
+	, output(NULL), num_running(0), stopping(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&started, NULL);
+	pthread_cond_init(&finished, NULL);
+      }
+    };
+    static ComputeThreadPool compute_thread_pool;
+
+    // Runs indices of the pool's current batch until there are none
+    // left, then merges what they output.
+    static void RunComputeThreadBatch(ComputeThreadPool* pool) {
+      // Each thread gets its own view of the inputs (no copies are
+      // made) and its own output. The MatlabMatrix calls they make
+      // serialize themselves on the Matlab API.
+      JobDescription job;
+      job.command = pool->job->command;
+      job.variable_types = pool->job->variable_types;
+      for (map<string, MatlabMatrix>::const_iterator iter = pool->job->variables.begin();
+	   iter != pool->job->variables.end(); iter++) {
+	job.variables[iter->first].Share(iter->second);
+      }
+      JobOutput output;
+      output.command = job.command;
+
+      while (1) {
+	int index;
+	pthread_mutex_lock(&pool->mutex); {
+	  index = pool->next_index < (int) pool->job->indices.size() ? pool->job->indices[pool->next_index++] : -1;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	if (index < 0) {
+	  break;
 	}
-	// TODO(sean): Horrible. Fix this sleep.
-	sleep(FLAGS_cesium_wait_interval);
+
+	job.indices.clear();
+	job.indices.push_back(index);
+
+	VLOG(1) << "Running job at index: " << index;
+	SetIndexRunning(index, true);
+	TraceSpan span(job.command.c_str(), index);
+	(*pool->function)(job, &output);
+	SetIndexRunning(index, false);
+	google::FlushLogFiles(google::GLOG_INFO);
       }
-      
-      output->variables = _instance->final_outputs;
 
-      // Save any partial variables that were not completed.
-      for (map<string, VariableType>::const_iterator iter = _instance->output_variable_types.begin();
-	   iter != _instance->output_variable_types.end(); iter++) {
-	const string name = (*iter).first;
-	const VariableType type = (*iter).second;
+      pthread_mutex_lock(&pool->mutex); {
+	for (map<string, MatlabMatrix>::const_iterator iter = output.variables.begin();
+	     iter != output.variables.end(); iter++) {
+	  pool->output->variables[iter->first].Merge(iter->second);
+	}
+	pool->output->variable_types.insert(output.variable_types.begin(), output.variable_types.end());
+	pool->output->indices.insert(pool->output->indices.end(), 
+				     output.indices.begin(), output.indices.end());
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
 
-	if (type == slib::cesium::PARTIAL_VARIABLE_ROWS || type == slib::cesium::PARTIAL_VARIABLE_COLS) {
-	  if (_instance->partial_output_indices[name].size() > 0) {
-	    LOG(INFO) << "***********************************************";
-	    LOG(INFO) << "Saving chunk for partial variable: " << name;
-	    LOG(INFO) << "***********************************************";
+    void* __ComputeThread__(void* data) {
+      ComputeThreadPool* pool = static_cast<ComputeThreadPool*>(data);
+      int batch = 0;
+      pthread_mutex_lock(&pool->mutex);
+      while (1) {
+	while (pool->batch == batch && !pool->stopping) {
+	  pthread_cond_wait(&pool->started, &pool->mutex);
+	}
+	if (pool->stopping) {
+	  break;
+	}
+	batch = pool->batch;
+	pthread_mutex_unlock(&pool->mutex);
 
-	    Directory::CreateIfNotExists(FLAGS_cesium_temporary_directory + "/" + name);
-	    SaveTemporaryOutput(StringUtils::StringPrintf("%s/%d", name.c_str(), 
-							  _instance->partial_output_unique_int), 
-				_instance->final_outputs[name]);
+	RunComputeThreadBatch(pool);
 
-	    _instance->partial_output_indices[name].clear();
-	    _instance->final_outputs[name] = MatlabMatrix();
-	    _instance->partial_output_unique_int++;
-	  }
+	pthread_mutex_lock(&pool->mutex);
+	pool->num_running--;
+	if (pool->num_running == 0) {
+	  pthread_cond_signal(&pool->finished);
 	}
       }
+      pthread_mutex_unlock(&pool->mutex);
 
-      // Close the partial variables.
-      for (map<string, pair<MatlabMatrix, FILE*> >::const_iterator iter = _instance->partial_variables.begin();
-	   iter != _instance->partial_variables.end(); iter++) {
-	const string name = (*iter).first;
-	FILE* fid = _instance->partial_variables[name].second;
-	if (fid != NULL) {
-	  fclose(fid);
+      return NULL;
+    }
+
+    static void StartComputeThreads(const int& num_threads) {
+      ComputeThreadPool* pool = &compute_thread_pool;
+      pool->stopping = false;
+      for (int i = 0; i < num_threads; i++) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, &__ComputeThread__, pool) != 0) {
+	  LOG(ERROR) << "Could not create compute thread " << i;
+	  continue;
 	}
+	pool->threads.push_back(thread);
       }
+      VLOG(1) << "Started " << pool->threads.size() << " compute threads";
+    }
 
-      // Before we kill the instance, save all of the nodes that died 
-      // so that we can finish jobs correctly.
-      _dead_processors.insert(_instance->dead_processors.begin(), _instance->dead_processors.end());
+    static void StopComputeThreads() {
+      ComputeThreadPool* pool = &compute_thread_pool;
+      pthread_mutex_lock(&pool->mutex); {
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->started);
+      }
+      pthread_mutex_unlock(&pool->mutex);
+      for (int i = 0; i < (int) pool->threads.size(); i++) {
+	pthread_join(pool->threads[i], NULL);
+      }
+      pool->threads.clear();
+    }
 
-      // This kills the current instance so that any modifications to
-      // an "instance" will effectively create a new one.
-      _instance.reset(NULL);
+    // Hands the job to the compute threads and waits until they have
+    // run all of its indices.
+    static void RunOnComputeThreads(const Function& function, const JobDescription* job, JobOutput* output) {
+      ComputeThreadPool* pool = &compute_thread_pool;
+      pthread_mutex_lock(&pool->mutex); {
+	pool->function = function;
+	pool->job = job;
+	pool->next_index = 0;
+	pool->output = output;
+	pool->num_running = pool->threads.size();
+	pool->batch++;
+	pthread_cond_broadcast(&pool->started);
+	while (pool->num_running > 0) {
+	  pthread_cond_wait(&pool->finished, &pool->mutex);
+	}
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
 
-      LOG(INFO) << "***********************************************";
-      LOG(INFO) << "Exiting Main Computation Loop [" << mutable_job.command << "]";
-      LOG(INFO) << "***********************************************";
+    void Cesium::RunJob(JobDescription* job, JobOutput* output) const {
+      // Determine the function.
+      if (GetAvailableCommands().find(job->command) == GetAvailableCommands().end()) {
+	LOG(ERROR) << "Attempted to execute unknown command: " << job->command;
+	return;
+      }
+      const Function& function = GetAvailableCommands()[job->command];
+	  
+      if (job->variables.find(CESIUM_CONFIG_ALL_INDICES_FIELD) != job->variables.end()) {
+	VLOG(1) << "Running all indices at once";
+	for (int i = 0; i < (int) job->indices.size(); i++) {
+	  SetIndexRunning(job->indices[i], true);
+	}
+	TraceSpan span(job->command.c_str(), job->indices);
+	(*function)(*job, output);
+	for (int i = 0; i < (int) job->indices.size(); i++) {
+	  SetIndexRunning(job->indices[i], false);
+	}
+	google::FlushLogFiles(google::GLOG_INFO);
+      } else if (compute_thread_pool.threads.size() > 1 && job->indices.size() > 1) {
+	VLOG(1) << "Running " << job->indices.size() << " indices on " 
+		<< compute_thread_pool.threads.size() << " threads";
+	RunOnComputeThreads(function, job, output);
+      } else {
+	const vector<int> job_indices = job->indices;
+	for (uint32 i = 0; i < job_indices.size(); i++) {
+	  job->indices.clear();
+	  job->indices.push_back(job_indices[i]);
+
+	  VLOG(1) << "Running job at index: " << job_indices[i];
+	  SetIndexRunning(job_indices[i], true);
+	  TraceSpan span(job->command.c_str(), job_indices[i]);
+	  (*function)(*job, output);
+	  SetIndexRunning(job_indices[i], false);
+	  google::FlushLogFiles(google::GLOG_INFO);
+	}
+      }
+    }
 
-      return true;
+    // The state shared by a compute node's main thread and the thread
+    // running its current job when batches are prefetched.
+    struct RunJobThreadState {
+      const Cesium* cesium;
+      JobDescription* job;
+      JobOutput* output;
+      bool done;
+      // Guards done.
+      boost::signals2::mutex mutex;
+    };
+
+    void* __RunJobThread__(void* data) {
+      RunJobThreadState* state = static_cast<RunJobThreadState*>(data);
+      state->cesium->RunJob(state->job, state->output);
+      state->mutex.lock(); {
+	state->done = true;
+      }
+      state->mutex.unlock();
+      return NULL;
     }
-    
-#if 0
-    void Cesium::ExecuteKernel(const Kernel& kernel, const JobDescription& job, JobOutput* output) {
+
+    // Swaps the contents of two jobs without copying any of the
+    // variables.
+    static void SwapJobs(JobDescription* a, JobDescription* b) {
+      a->command.swap(b->command);
+      a->indices.swap(b->indices);
+      a->variables.swap(b->variables);
+      a->variable_types.swap(b->variable_types);
     }
-    
-    void Cesium::ExecuteFunction(const Function& function, const JobDescription& job, JobOutput* output) {
+
+    bool Cesium::RunJobWhileReceiving(JobDescription* job, JobOutput* output, JobDescription* next_job) const {
+      RunJobThreadState state;
+      state.cesium = this;
+      state.job = job;
+      state.output = output;
+      state.done = false;
+
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, &__RunJobThread__, &state) != 0) {
+	LOG(ERROR) << "Could not create a thread to run the job; not prefetching";
+	RunJob(job, output);
+	return false;
+      }
+
+      // All MPI calls stay on this thread.
+      bool received = false;
+      double last_heartbeat = MPI_Wtime();
+      while (1) {
+	bool done;
+	state.mutex.lock(); {
+	  done = state.done;
+	}
+	state.mutex.unlock();
+	if (done) {
+	  break;
+	}
+
+	if (FLAGS_cesium_index_timeout > 0.0 && MPI_Wtime() - last_heartbeat >= FLAGS_cesium_heartbeat_interval) {
+	  JobNode::SendHeartbeat(GetRunningIndices(), _node_parents[_rank]);
+	  last_heartbeat = MPI_Wtime();
+	}
+
+	if (!received && FLAGS_cesium_prefetch_batches) {
+	  int flag = 0;
+	  MPI_Iprobe(_node_parents[_rank], MPI_JOB_HEADER_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+	  if (flag) {
+	    VLOG(1) << "Receiving the next job while computing";
+	    JobDescription next = JobNode::WaitForJobData(_node_parents[_rank]);
+	    SwapJobs(&next, next_job);
+	    received = true;
+	    continue;
+	  }
+	}
+	usleep(1000);
+      }
+      pthread_join(thread, NULL);
+
+      return received;
     }
-#endif
-    
+
     void Cesium::ComputeNodeLoop() {
-      map<string, MatlabMatrix> cached_variables;
+      // The master, or the sub-master of this node's group.
+      const int parent = _node_parents[_rank];
+      VariableCache cache(((long long int) FLAGS_cesium_variable_cache_megabytes) << 20);
+      // The shared memory segment each shared variable was last
+      // loaded from and published under (by this node).
+      map<string, string> published_segments;
 
       if (FLAGS_v >= 1) {
 	for (map<string, Function>::const_iterator iter = GetAvailableCommands().begin();
@@ -700,92 +2278,473 @@ namespace slib {
 	  VLOG(1) << "Available Command: " << (*iter).first;
 	}
       }
+      if (FLAGS_cesium_compute_threads > 1) {
+	StartComputeThreads(FLAGS_cesium_compute_threads);
+      }
+      JobDescription job;
+      bool have_next_job = false;
       while (1) {
-	VLOG(1) << "Waiting for a new job...";
-	JobDescription job = JobNode::WaitForJobData();
+	if (!have_next_job) {
+	  VLOG(1) << "Waiting for a new job...";
+	  JobDescription next = JobNode::WaitForJobData(parent);
+	  SwapJobs(&next, &job);
+	}
+	have_next_job = false;
+	CompleteBroadcastSends();
+	if (job.command == CESIUM_BROADCAST_JOB_STRING) {
+	  ReceiveBroadcastVariables(job, &cache);
+	  continue;
+	}
 	if (job.command == CESIUM_FINISH_JOB_STRING) {
 	  LOG(INFO) << "Node " << _rank << " finishing";
-	  JobNode::SendStringToNode(job.command, MPI_ROOT_NODE);
+	  StopComputeThreads();
+	  AbandonBroadcastSends();
+	  for (map<string, string>::const_iterator iter = published_segments.begin();
+	       iter != published_segments.end(); iter++) {
+	    shm_unlink(iter->second.c_str());
+	  }
+	  JobNode::SendStringToNode(job.command, parent);
+	  if (Tracer::IsEnabled()) {
+	    JobNode::SendStringToNode(Tracer::GetEvents(), parent);
+	  }
 	  break;
 	}
 
-	if (job.command == CESIUM_IDENTIFY_HOSTNAME_JOB_STRING) {
-	  JobNode::SendStringToNode(_hostname, MPI_ROOT_NODE);
-	  continue;
-	}
-
 	VLOG(1) << "Received new job: " << job.command;
 
 	// Update or retreive from the cache as necessary.
+	bool cached_variables_loaded = true;
 	if (job.HasInput(CESIUM_CACHED_VARIABLES_FIELD)) {
-	  MatlabMatrix cached_variable_names = job.GetInputByName(CESIUM_CACHED_VARIABLES_FIELD);
-	  for (int i = 0; i < cached_variable_names.GetNumberOfElements(); i++) {
-	    const string& name = cached_variable_names.GetCell(i).GetStringContents();
-	    if (cached_variables.find(name) == cached_variables.end()) {
-	      cached_variables[name] = job.GetInputByName(name);
-	    } else {
-	      VLOG(1) << "Cache hit on node for variable: " << name;
-	      job.variables[name] = cached_variables[name];
-	    }
-	  }
+	  cached_variables_loaded = LoadCachedVariables(&job, &cache, &published_segments);
 	}
 
-	// Run the appropriate command.
+	// Run the appropriate command. With prefetching the master may
+	// send the next batch while this one runs.
 	JobOutput output;
 	output.command = job.command;
-	// Determine the function.
-	if (GetAvailableCommands().find(job.command) == GetAvailableCommands().end()) {
-	  LOG(ERROR) << "Attempted to execute unknown command: " << job.command;
+	JobDescription next_job;
+	if (!cached_variables_loaded) {
+	  // None of the indices are run; the master will requeue them
+	  // and send the variables along next time.
+	  output.variables[CESIUM_CACHE_MISS_FIELD] = MatlabMatrix(true);
+	} else if (FLAGS_cesium_prefetch_batches || FLAGS_cesium_index_timeout > 0.0) {
+	  have_next_job = RunJobWhileReceiving(&job, &output, &next_job);
 	} else {
-	  const Function& function = GetAvailableCommands()[job.command];
-	  
-	  if (job.variables.find(CESIUM_CONFIG_ALL_INDICES_FIELD) != job.variables.end()) {
-	    VLOG(1) << "Running all indices at once";
-	    (*function)(job, &output);
-	    google::FlushLogFiles(google::GLOG_INFO);
-	  } else {
-	    const vector<int> job_indices = job.indices;
-	    for (uint32 i = 0; i < job_indices.size(); i++) {
-	      job.indices.clear();
-	      job.indices.push_back(job_indices[i]);
-
-	      VLOG(1) << "Running job at index: " << job_indices[i];
-	      (*function)(job, &output);
-	      google::FlushLogFiles(google::GLOG_INFO);
-	    }
-	  }
+	  RunJob(&job, &output);
 	}
 	
 	VLOG(1) << "Sending completion message";
-	JobNode::SendCompletionMessage(MPI_ROOT_NODE);
+	JobNode::SendCompletionMessage(parent);
 	VLOG(1) << "Waiting for completion response";
-	JobNode::WaitForCompletionResponse(MPI_ROOT_NODE);
+	JobNode::WaitForCompletionResponse(parent);
 	VLOG(1) << "Send job output to root";
-	JobNode::SendJobDataToNode(output, MPI_ROOT_NODE);
+	JobNode::SendJobDataToNode(output, parent);
+
+	if (have_next_job) {
+	  SwapJobs(&next_job, &job);
+	}
+      }
+    }
+
+    // This is just a wrapper to avoid passing a pointer to a member
+    // function to the sub-master's JobController.
+    void __HandleWorkerCompletedWrapper__(const JobOutput& output, const int& node) {
+      Cesium::GetInstance()->HandleWorkerCompleted(output, node);
+    }
+
+    void Cesium::SubMasterLoop() {
+      const int parent = _node_parents[_rank];
+      VariableCache cache(((long long int) FLAGS_cesium_variable_cache_megabytes) << 20);
+      map<string, string> published_segments;
+
+      _controller.reset(new JobController);
+      _controller->SetCompletionHandler(&__HandleWorkerCompletedWrapper__);
+      _controller->SetCommunicationErrorHandler(&__HandleCommunicationErrorWrapper__);
+      for (int node = _size - 1; node >= 1; node--) {
+	if (_node_parents[node] == _rank) {
+	  _available_processors.push_back(node);
+	}
+      }
+      LOG(INFO) << "Node " << _rank << " is the sub-master of " << _available_processors.size() << " nodes";
+
+      // The indices each worker last reported running. They are
+      // passed on to the master in this node's own heartbeats.
+      map<int, vector<int> > worker_running_indices;
+      double last_heartbeat = MPI_Wtime();
+      while (1) {
+	// Take the next batch as soon as the master sends it, even
+	// while the workers are busy with the previous ones.
+	int flag = 0;
+	MPI_Iprobe(parent, MPI_JOB_HEADER_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+	if (flag) {
+	  SubMasterBatch* batch = new SubMasterBatch();
+	  JobDescription next = JobNode::WaitForJobData(parent);
+	  SwapJobs(&next, &batch->job);
+	  if (batch->job.command == CESIUM_FINISH_JOB_STRING) {
+	    AbandonBroadcastSends();
+	    delete batch;
+	    break;
+	  }
+	  if (batch->job.command == CESIUM_BROADCAST_JOB_STRING) {
+	    ReceiveBroadcastVariables(batch->job, &cache);
+	    delete batch;
+	    continue;
+	  }
+	  VLOG(1) << "Received new batch: " << batch->job.command;
+
+	  JobDescription& job = batch->job;
+	  batch->output.command = job.command;
+	  if (job.HasInput(CESIUM_CACHED_VARIABLES_FIELD) 
+	      && !LoadCachedVariables(&job, &cache, &published_segments)) {
+	    // Like a compute node, nothing is run and the master sends
+	    // everything along next time.
+	    batch->output.variables[CESIUM_CACHE_MISS_FIELD] = MatlabMatrix(true);
+	    job.indices.clear();
+	  }
+	  // The shared variables have been published for this host by
+	  // now if they are going to be.
+	  job.variables.erase(CESIUM_PUBLISH_SHARED_VARIABLES_FIELD);
+	  // Only the partial variables differ between the workers.
+	  for (map<string, MatlabMatrix>::const_iterator iter = job.variables.begin();
+	       iter != job.variables.end(); iter++) {
+	    const VariableType type = job.GetVariableType(iter->first);
+	    if (!(type & (PARTIAL_VARIABLE_ROWS | PARTIAL_VARIABLE_COLS))) {
+	      job.serialized_variables[iter->first].reset(new string(iter->second.Serialize()));
+	    }
+	  }
+	  batch->indices.Reset(job.indices);
+	  _submaster_batches.push_back(batch);
+	}
+
+	StartWorkerBatches();
+
+	// If every worker has died, run what is left here.
+	if (_available_processors.size() == 0 && _worker_batches.size() == 0 
+	    && _submaster_batches.size() > 0) {
+	  SubMasterBatch* batch = _submaster_batches.front();
+	  vector<int> indices;
+	  batch->indices.Dispatch(batch->indices.GetNumberOfReady(), &indices);
+	  if (indices.size() > 0) {
+	    LOG(WARNING) << "Sub-master " << _rank << " has no workers left; running " 
+			 << indices.size() << " indices itself";
+	    batch->job.indices = indices;
+	    const int first_output = batch->output.indices.size();
+	    RunJob(&batch->job, &batch->output);
+	    for (int i = first_output; i < (int) batch->output.indices.size(); i++) {
+	      batch->indices.MarkCompleted(batch->output.indices[i]);
+	    }
+	    batch->indices.Requeue(indices);
+	  }
+	}
+
+	// The master expects the outputs in the order it sent the
+	// batches.
+	while (_submaster_batches.size() > 0 && _submaster_batches.front()->indices.IsFinished()) {
+	  SubMasterBatch* batch = _submaster_batches.front();
+	  _submaster_batches.pop_front();
+	  VLOG(1) << "Sending completion message";
+	  JobNode::SendCompletionMessage(parent);
+	  VLOG(1) << "Waiting for completion response";
+	  JobNode::WaitForCompletionResponse(parent);
+	  VLOG(1) << "Send merged output to root";
+	  JobNode::SendJobDataToNode(batch->output, parent);
+	  delete batch;
+	}
+
+	_controller->CheckForCompletion();
+
+	if (FLAGS_cesium_index_timeout > 0.0) {
+	  int node;
+	  vector<int> indices;
+	  while (JobNode::ReceiveHeartbeat(&node, &indices)) {
+	    worker_running_indices[node].swap(indices);
+	  }
+	  if (_worker_batches.size() > 0 && MPI_Wtime() - last_heartbeat >= FLAGS_cesium_heartbeat_interval) {
+	    vector<int> running;
+	    for (map<int, pair<SubMasterBatch*, vector<int> > >::const_iterator iter = _worker_batches.begin();
+		 iter != _worker_batches.end(); iter++) {
+	      const vector<int>& worker_indices = worker_running_indices[iter->first];
+	      running.insert(running.end(), worker_indices.begin(), worker_indices.end());
+	    }
+	    JobNode::SendHeartbeat(running, parent);
+	    last_heartbeat = MPI_Wtime();
+	  }
+	}
+
+	if (!flag) {
+	  usleep(1000);
+	}
+      }
+
+      // Pass the finish request on to the group.
+      LOG(INFO) << "Sub-master " << _rank << " finishing";
+      JobDescription finish;
+      finish.command = CESIUM_FINISH_JOB_STRING;
+      for (int node = 1; node < _size; node++) {
+	if (_node_parents[node] == _rank && _dead_processors.find(node) == _dead_processors.end()) {
+	  VLOG(1) << "Sending finish request to node: " << node;
+	  _controller->StartJobOnNode(finish, node);
+	  JobNode::WaitForString(node);
+	  if (Tracer::IsEnabled()) {
+	    Tracer::AddEvents(JobNode::WaitForString(node));
+	  }
+	}
+      }
+      _controller.reset();
+      for (map<string, string>::const_iterator iter = published_segments.begin();
+	   iter != published_segments.end(); iter++) {
+	shm_unlink(iter->second.c_str());
+      }
+      JobNode::SendStringToNode(finish.command, parent);
+      if (Tracer::IsEnabled()) {
+	JobNode::SendStringToNode(Tracer::GetEvents(), parent);
+      }
+    }
+
+    void Cesium::StartWorkerBatches() {
+      const int num_workers = GetNumberOfWorkers(_rank);
+      while (_available_processors.size() > 0) {
+	SubMasterBatch* batch = NULL;
+	for (list<SubMasterBatch*>::iterator iter = _submaster_batches.begin(); 
+	     iter != _submaster_batches.end(); iter++) {
+	  if ((*iter)->indices.GetNumberOfReady() > 0) {
+	    batch = *iter;
+	    break;
+	  }
+	}
+	if (batch == NULL) {
+	  return;
+	}
+
+	const int node = _available_processors.back();
+	_available_processors.pop_back();
+	vector<int> indices;
+	batch->indices.Dispatch((batch->indices.GetNumberOfIndices() + num_workers - 1) / num_workers, &indices);
+
+	// Withhold the cached variables the worker already holds, as
+	// the master does.
+	JobDescription& job = batch->job;
+	job.indices = indices;
+	map<string, MatlabMatrix> withheld;
+	set<string>& node_hashes = _node_cached_hashes[node];
+	const MatlabMatrix& cached = job.GetInputByName(CESIUM_CACHED_VARIABLES_FIELD);
+	for (int i = 0; i < cached.GetDimensions().x; i++) {
+	  const string name = cached.GetCell(i, 0).GetStringContents();
+	  if (node_hashes.find(cached.GetCell(i, 1).GetStringContents()) != node_hashes.end()
+	      && job.HasInput(name)) {
+	    withheld[name].Swap(job.variables[name]);
+	    job.variables.erase(name);
+	  }
+	}
+
+	VLOG(1) << "Starting " << indices.size() << " indices on worker " << node;
+	_worker_batches[node] = make_pair(batch, indices);
+	_controller->StartJobOnNode(job, node, job.variable_types);
+	for (map<string, MatlabMatrix>::iterator iter = withheld.begin(); iter != withheld.end(); iter++) {
+	  job.variables[iter->first].Swap(iter->second);
+	}
+
+	const long long int cache_bytes = ((long long int) FLAGS_cesium_variable_cache_megabytes) << 20;
+	for (int i = 0; i < cached.GetDimensions().x; i++) {
+	  const string hash = cached.GetCell(i, 1).GetStringContents();
+	  if (VariableCache::GetHashedBytes(hash) <= cache_bytes) {
+	    node_hashes.insert(hash);
+	  }
+	}
+      }
+    }
+
+    void Cesium::HandleWorkerCompleted(const JobOutput& output, const int& node) {
+      if (output.command == CESIUM_NODE_DIED_JOB_STRING) {
+	HandleDeadNode(node);
+	return;
+      }
+
+      const map<int, pair<SubMasterBatch*, vector<int> > >::iterator iter = _worker_batches.find(node);
+      if (iter == _worker_batches.end()) {
+	ReleaseNode(node);
+	return;
+      }
+      SubMasterBatch* batch = iter->second.first;
+
+      if (output.HasInput(CESIUM_CACHE_MISS_FIELD)) {
+	LOG(WARNING) << "Worker " << node << " is missing cached variables";
+	_node_cached_hashes.erase(node);
+      } else {
+	// Pre-merge the outputs so the master only sees one per batch.
+	for (map<string, MatlabMatrix>::const_iterator it = output.variables.begin(); 
+	     it != output.variables.end(); it++) {
+	  if (batch->output.HasInput(it->first)) {
+	    batch->output.variables[it->first].Merge(it->second);
+	  } else {
+	    batch->output.variables[it->first] = it->second;
+	  }
+	}
+	// The types say which outputs are compressed on the way back.
+	batch->output.variable_types.insert(output.variable_types.begin(), output.variable_types.end());
+	for (int i = 0; i < (int) output.indices.size(); i++) {
+	  batch->indices.MarkCompleted(output.indices[i]);
+	}
+	batch->output.indices.insert(batch->output.indices.end(), output.indices.begin(), output.indices.end());
       }
+
+      // Anything the worker did not complete is handed out again.
+      batch->indices.Requeue(iter->second.second);
+      _worker_batches.erase(iter);
+      ReleaseNode(node);
     }
 
-    void Cesium::ExportLog(const int& pid) const {
+    void Cesium::ExportLog() {
+      // Started again if the working directory changed.
       const string filename = FLAGS_cesium_working_directory + "/master.log";
+      if (_log_exporter.get() == NULL || _log_exporter->GetFilename() != filename) {
+	_log_exporter.reset();
+	_log_exporter.reset(new LogExporter(filename));
+      }
+      _log_exporter->Flush();
+    }
+
+    void Cesium::ExportMetrics() const {
+      const double now = MPI_Wtime();
+      string metrics;
+
+      metrics += "# HELP cesium_indices The indices of each running job by state.\n";
+      metrics += "# TYPE cesium_indices gauge\n";
+      for (map<int, CesiumExecutionInstance*>::const_iterator iter = _running_instances.begin();
+	   iter != _running_instances.end(); iter++) {
+	const CesiumExecutionInstance* instance = iter->second;
+	const string& command = instance->job.command;
+	const int handle = instance->handle;
+	metrics += StringUtils::StringPrintf("cesium_indices{command=\"%s\",job=\"%d\",state=\"ready\"} %d\n",
+					     command.c_str(), handle, instance->indices.GetNumberOfReady());
+	metrics += StringUtils::StringPrintf("cesium_indices{command=\"%s\",job=\"%d\",state=\"pending\"} %d\n",
+					     command.c_str(), handle, instance->indices.GetNumberOfPending());
+	metrics += StringUtils::StringPrintf("cesium_indices{command=\"%s\",job=\"%d\",state=\"completed\"} %d\n",
+					     command.c_str(), handle, instance->indices.GetNumberOfCompleted());
+      }
+
+      metrics += "# HELP cesium_job_eta_seconds The estimated seconds until each running job finishes.\n";
+      metrics += "# TYPE cesium_job_eta_seconds gauge\n";
+      for (map<int, CesiumExecutionInstance*>::const_iterator iter = _running_instances.begin();
+	   iter != _running_instances.end(); iter++) {
+	const CesiumExecutionInstance* instance = iter->second;
+	const int completed = instance->indices.GetNumberOfCompleted() - instance->start_completed;
+	if (instance->start_time < 0.0 || completed <= 0) {
+	  continue;
+	}
+	const int remaining = instance->indices.GetNumberOfIndices() - instance->indices.GetNumberOfCompleted();
+	metrics += StringUtils::StringPrintf("cesium_job_eta_seconds{command=\"%s\",job=\"%d\"} %f\n",
+					     instance->job.command.c_str(), instance->handle,
+					     remaining * (now - instance->start_time) / completed);
+      }
+
+      metrics += "# HELP cesium_node_indices_per_second The measured throughput of each node.\n";
+      metrics += "# TYPE cesium_node_indices_per_second gauge\n";
+      for (map<int, CesiumExecutionInstance*>::const_iterator iter = _running_instances.begin();
+	   iter != _running_instances.end(); iter++) {
+	const CesiumExecutionInstance* instance = iter->second;
+	for (map<int, double>::const_iterator node_iter = instance->node_seconds_per_index.begin();
+	     node_iter != instance->node_seconds_per_index.end(); node_iter++) {
+	  if (node_iter->second <= 0.0) {
+	    continue;
+	  }
+	  metrics += StringUtils::StringPrintf("cesium_node_indices_per_second{job=\"%d\",node=\"%d\"} %f\n",
+					       instance->handle, node_iter->first, 1.0 / node_iter->second);
+	}
+      }
+
+      metrics += "# HELP cesium_node_busy Whether each node is running a batch.\n";
+      metrics += "# TYPE cesium_node_busy gauge\n";
+      for (int node = 1; node < _size; node++) {
+	if (_node_parents[node] != MPI_ROOT_NODE || _dead_processors.find(node) != _dead_processors.end()) {
+	  continue;
+	}
+	const bool idle = std::find(_available_processors.begin(), _available_processors.end(), node)
+	  != _available_processors.end();
+	metrics += StringUtils::StringPrintf("cesium_node_busy{node=\"%d\"} %d\n", node, idle ? 0 : 1);
+      }
+
+      const TransferStatistics& statistics = JobNode::GetTransferStatistics();
+      metrics += "# HELP cesium_bytes_sent_total The bytes of job data sent to each node.\n";
+      metrics += "# TYPE cesium_bytes_sent_total counter\n";
+      for (map<int, long long>::const_iterator iter = statistics.bytes_sent.begin();
+	   iter != statistics.bytes_sent.end(); iter++) {
+	metrics += StringUtils::StringPrintf("cesium_bytes_sent_total{node=\"%d\"} %lld\n", 
+					     iter->first, iter->second);
+      }
+      metrics += "# HELP cesium_bytes_received_total The bytes of job outputs received from each node.\n";
+      metrics += "# TYPE cesium_bytes_received_total counter\n";
+      for (map<int, long long>::const_iterator iter = statistics.bytes_received.begin();
+	   iter != statistics.bytes_received.end(); iter++) {
+	metrics += StringUtils::StringPrintf("cesium_bytes_received_total{node=\"%d\"} %lld\n", 
+					     iter->first, iter->second);
+      }
+      metrics += "# HELP cesium_serialization_seconds_total The time spent serializing variables.\n";
+      metrics += "# TYPE cesium_serialization_seconds_total counter\n";
+      metrics += StringUtils::StringPrintf("cesium_serialization_seconds_total %f\n", 
+					   statistics.serialization_seconds);
+      metrics += "# HELP cesium_deserialization_seconds_total The time spent deserializing outputs.\n";
+      metrics += "# TYPE cesium_deserialization_seconds_total counter\n";
+      metrics += StringUtils::StringPrintf("cesium_deserialization_seconds_total %f\n", 
+					   statistics.deserialization_seconds);
+      metrics += "# HELP cesium_compression_ratio How many times smaller the compressed variables were on the wire.\n";
+      metrics += "# TYPE cesium_compression_ratio gauge\n";
+      metrics += StringUtils::StringPrintf("cesium_compression_ratio %f\n", statistics.GetCompressionRatio());
+      metrics += "# HELP cesium_compression_seconds_total The time spent compressing variables.\n";
+      metrics += "# TYPE cesium_compression_seconds_total counter\n";
+      metrics += StringUtils::StringPrintf("cesium_compression_seconds_total %f\n", 
+					   statistics.compression_seconds);
+      metrics += "# HELP cesium_decompression_seconds_total The time spent decompressing outputs.\n";
+      metrics += "# TYPE cesium_decompression_seconds_total counter\n";
+      metrics += StringUtils::StringPrintf("cesium_decompression_seconds_total %f\n", 
+					   statistics.decompression_seconds);
+
+      if (_checkpoint_writer.get() != NULL) {
+	metrics += "# HELP cesium_checkpoint_seconds_total The time spent writing checkpoints (in the background).\n";
+	metrics += "# TYPE cesium_checkpoint_seconds_total counter\n";
+	metrics += StringUtils::StringPrintf("cesium_checkpoint_seconds_total %f\n", 
+					     _checkpoint_writer->GetWriteSeconds());
+	metrics += "# HELP cesium_checkpoints_total The number of checkpoint appends written.\n";
+	metrics += "# TYPE cesium_checkpoints_total counter\n";
+	metrics += StringUtils::StringPrintf("cesium_checkpoints_total %d\n", 
+					     _checkpoint_writer->GetNumberOfWrites());
+      }
 
-      const string cmd 
-	= StringUtils::StringPrintf("rsync -t %s/*INFO*.%d %s", FLAGS_log_dir.c_str(), pid, filename.c_str());
-      System::ExecuteSystemCommand(cmd);
+      // Written next to the file and renamed into place so that
+      // readers never see a partial file.
+      const string filename = FLAGS_cesium_metrics_file;
+      const string temporary = filename + ".tmp";
+      FILE* fid = fopen(temporary.c_str(), "w");
+      if (fid == NULL) {
+	LOG(ERROR) << "Could not write the metrics file: " << temporary;
+	return;
+      }
+      const bool written = (fwrite(metrics.data(), 1, metrics.length(), fid) == metrics.length());
+      if (fclose(fid) != 0 || !written || rename(temporary.c_str(), filename.c_str()) != 0) {
+	LOG(ERROR) << "Could not write the metrics file: " << filename;
+	unlink(temporary.c_str());
+      }
     }
 
     void Cesium::SetWorkingDirectory(const string& directory) {
       FLAGS_cesium_working_directory = directory;
     }
 
-    void Cesium::ShowProgress(const string& command) const {
-      const int alive = _size - 1 - (int) _instance->dead_processors.size();
-      const int running = alive - (int) _instance->available_processors.size();
-      const int total_indices = _instance->total_indices;
-
-      LOG(INFO) << "\nRunning Command: " << command 
-		<< "\n\tNumber Pending: " << _instance->pending_indices.size()
-		<< "\n\tNumber Completed: " << _instance->completed_indices.size() << " of " << total_indices
-		<< "\n\tAvailable Processors: " << _instance->available_processors.size() << " of " << alive
+    void Cesium::ShowProgress(const CesiumExecutionInstance* instance) const {
+      int alive = 0;
+      for (int node = 1; node < _size; node++) {
+	if (CanRunOnNode(instance, node) && _dead_processors.find(node) == _dead_processors.end()) {
+	  alive++;
+	}
+      }
+      const int available = GetNumberOfIdleNodes(instance);
+      const int running = instance->node_indices.size();
+      const int total_indices = instance->total_indices;
+
+      LOG(INFO) << "\nRunning Command: " << instance->job.command << " (job " << instance->handle << ")"
+		<< "\n\tNumber Pending: " << instance->indices.GetNumberOfPending()
+		<< "\n\tNumber Completed: " << instance->indices.GetNumberOfCompleted() << " of " << total_indices
+		<< "\n\tAvailable Processors: " << available << " of " << alive
 		<< "\n\tRunning Processors: " << running << " of " << alive;
       google::FlushLogFiles(google::GLOG_INFO);
     }
@@ -800,12 +2759,14 @@ namespace slib {
       }
     }
 
-    VariableType Cesium::GetInputVariableType(const string& variable_name) const {
-      return GetVariableType(_instance->input_variable_types, variable_name);
+    VariableType Cesium::GetInputVariableType(const CesiumExecutionInstance* instance, 
+					      const string& variable_name) const {
+      return GetVariableType(instance->input_variable_types, variable_name);
     }
 
-    VariableType Cesium::GetOutputVariableType(const string& variable_name) const {
-      return GetVariableType(_instance->output_variable_types, variable_name);
+    VariableType Cesium::GetOutputVariableType(const CesiumExecutionInstance* instance, 
+					       const string& variable_name) const {
+      return GetVariableType(instance->output_variable_types, variable_name);
     }
 
     void Cesium::SaveTemporaryOutput(const string& name, const MatlabMatrix& matrix) const {
@@ -815,47 +2776,49 @@ namespace slib {
       }
     }
 
-    void Cesium::CheckpointOutputFiles(const JobOutput& output) {
-      if (_checkpoint_interval < 0) {
+    void Cesium::CheckpointOutputFiles(CesiumExecutionInstance* instance, const JobOutput& output) {
+      TraceSpan span("CheckpointOutputFiles", output.indices);
+      if (instance->checkpoint_interval < 0) {
 	return;
       }
 
-      for (map<string, MatlabMatrix>::iterator iter = _instance->final_outputs.begin();
-	   iter != _instance->final_outputs.end(); iter++) {
+      // Only the outputs that were merged into final_outputs are
+      // checkpointed. The others are already on disk.
+      for (map<string, MatlabMatrix>::const_iterator iter = output.variables.begin();
+	   iter != output.variables.end(); iter++) {
 	const string& name = (*iter).first;
-	const VariableType type = GetOutputVariableType(name);
-	
-	if (type == PARTIAL_VARIABLE_ROWS || type == PARTIAL_VARIABLE_COLS) {
-	  return;
-	}
+	const VariableType type = GetOutputVariableType(instance, name);
 	
-	if (_instance->output_counts.find(name) == _instance->output_counts.end()) {
-	  _instance->output_counts[name] = output.indices.size();
-	} else {
-	  _instance->output_counts[name] = _instance->output_counts[name] + output.indices.size();
+	if (instance->final_outputs.find(name) == instance->final_outputs.end()
+	    || type == PARTIAL_VARIABLE_ROWS || type == PARTIAL_VARIABLE_COLS || type == STREAMED_VARIABLE) {
+	  continue;
 	}
 	
-	if (_instance->output_indices.find(name) == _instance->output_indices.end()) {
-	  _instance->output_indices[name] = output.indices;
-	} else {
-	  _instance->output_indices[name].insert(_instance->output_indices[name].end(), 
-						 output.indices.begin(), 
-						 output.indices.end());
-	}
+	instance->checkpoint_deltas[name].Merge((*iter).second);
+	instance->output_counts[name] += output.indices.size();
+	instance->output_indices[name].insert(instance->output_indices[name].end(), 
+					       output.indices.begin(), 
+					       output.indices.end());
 	
-	if (_instance->output_counts[name] >= _checkpoint_interval) {
+	if (instance->output_counts[name] >= instance->checkpoint_interval) {
 	  LOG(INFO) << "***********************************************";
 	  LOG(INFO) << "Checkpointing output variable: " << name;
 	  LOG(INFO) << "***********************************************";
-	  
-	  SaveTemporaryOutput(name + "_checkpoint", (*iter).second);
-	  SaveTemporaryOutput(name + "_checkpoint_indices", MatlabMatrix(_instance->output_indices[name]));
-	  _instance->output_counts[name] = 0;
+
+	  // The first checkpoint of a job replaces any left over from
+	  // an earlier one.
+	  const bool reset = !instance->checkpoint_started[name];
+	  instance->checkpoint_started[name] = true;
+	  GetCheckpointWriter()->Append(FLAGS_cesium_temporary_directory + "/" + name + "_checkpoint",
+					&instance->checkpoint_deltas[name], instance->output_indices[name], reset);
+	  instance->output_indices[name].clear();
+	  instance->output_counts[name] = 0;
 	}
       }
     }
 
     void Cesium::HandleJobCompleted(const JobOutput& output, const int& node) {
+      TraceSpan span("HandleJobCompleted", output.indices);
       if (output.command == CESIUM_NODE_DIED_JOB_STRING) {
 	HandleDeadNode(node);
 	return;
@@ -863,70 +2826,232 @@ namespace slib {
 
       LOG(INFO) << "Job completed on node: " << node;
 
+      // The node was still running a batch when its job returned, so
+      // there is nothing to merge it into.
+      const map<int, int>::iterator draining_iter = _draining_processors.find(node);
+      if (draining_iter != _draining_processors.end()) {
+	LOG(INFO) << "Dropping the result of a previous job from node: " << node;
+	if (--draining_iter->second <= 0) {
+	  _draining_processors.erase(draining_iter);
+	  if (_unhealthy_processors.erase(node) > 0) {
+	    LOG(WARNING) << "*** Unhealthy node " << node << " reported back; returning it to the pool";
+	  }
+	  ReleaseNode(node);
+	}
+	return;
+      }
+      const map<int, int>::iterator owner_iter = _node_owners.find(node);
+      if (owner_iter == _node_owners.end()) {
+	LOG(INFO) << "Dropping the result of a previous job from node: " << node;
+	ReleaseNode(node);
+	return;
+      }
+      CesiumExecutionInstance* instance = _running_instances[owner_iter->second];
+      bool promoted_prefetch = false;
+      _node_running_indices.erase(node);
+      _node_heartbeat_time.erase(node);
+
       // Synchronized access with the accessor routines in the main loop
       // below.
-      _instance->job_completion_mutex.lock(); {
+      instance->job_completion_mutex.lock(); {
+	// If some of the indices were run twice (see
+	// StartSpeculativeBatches) and the other copy already finished
+	// them, this result is a duplicate and is dropped. The outputs
+	// cannot be split up by index, so that goes for a result that is
+	// only partly a duplicate as well; its other indices are
+	// requeued below and run again.
 	string output_indices_list = "[";
+	int num_completed = 0;
 	for (uint32 i = 0; i < output.indices.size(); i++) {
 	  output_indices_list = StringUtils::StringPrintf("%s %d", output_indices_list.c_str(), output.indices[i]);
-	  _instance->completed_indices[output.indices[i]] = true;
+	  if (instance->indices.IsCompleted(output.indices[i])) {
+	    num_completed++;
+	  }
+	}
+	const bool is_duplicate = (num_completed > 0);
+	if (!is_duplicate) {
+	  for (uint32 i = 0; i < output.indices.size(); i++) {
+	    instance->indices.MarkCompleted(output.indices[i]);
+	  }
+	}
+
+	// Update the throughput estimate for the node.
+	const map<int, double>::iterator dispatch_iter = instance->node_dispatch_time.find(node);
+	const int num_indices = instance->node_indices[node].size();
+	if (dispatch_iter != instance->node_dispatch_time.end() && num_indices > 0) {
+	  const double seconds_per_index = (MPI_Wtime() - dispatch_iter->second) / ((double) num_indices);
+	  const map<int, double>::iterator spi_iter = instance->node_seconds_per_index.find(node);
+	  if (spi_iter == instance->node_seconds_per_index.end()) {
+	    instance->node_seconds_per_index[node] = seconds_per_index;
+	  } else {
+	    spi_iter->second = 0.5 * spi_iter->second + 0.5 * seconds_per_index;
+	  }
+	  VLOG(1) << "Node " << node << " seconds per index: " << instance->node_seconds_per_index[node];
+	}
+	if (dispatch_iter != instance->node_dispatch_time.end()) {
+	  instance->node_dispatch_time.erase(dispatch_iter);
 	}
 
 	// Dequeue all of the indices that the node was
 	// processing. Note that this doesn't necessarily mean that
 	// the node completed them, just that it indicated it finished
-	// so we are dequeing everything it was supposed to have
-	// completed.
-	const vector<int>& indices = _instance->node_indices[node];
-	for (int i = 0; i < (int) indices.size(); i++) {
-	  _instance->pending_indices.erase(indices[i]);
+	// so anything it did not complete goes back in the queue.
+	instance->indices.Requeue(instance->node_indices[node]);
+	instance->node_indices.erase(node);
+
+	// The node has already moved on to its prefetched batch, if it
+	// has one. A copy of a straggler covers that batch too, so both
+	// stay marked until they are done with both.
+	const map<int, vector<int> >::iterator prefetched_iter = instance->node_prefetched_indices.find(node);
+	if (prefetched_iter != instance->node_prefetched_indices.end()) {
+	  instance->node_indices[node] = prefetched_iter->second;
+	  instance->node_prefetched_indices.erase(prefetched_iter);
+	  instance->node_dispatch_time[node] = MPI_Wtime();
+	  promoted_prefetch = true;
+	} else {
+	  instance->speculated_nodes.erase(node);
+	  instance->speculative_nodes.erase(node);
 	}
-	_instance->node_indices.erase(node);
 	
 	LOG(INFO) << "Node " << node << " output indices: " << output_indices_list << " ]";
-	for (map<string, MatlabMatrix>::const_iterator it = output.variables.begin(); 
-	     it != output.variables.end(); 
-	     it++) {
-	  const string name = (*it).first;
-	  const MatlabMatrix matrix = (*it).second;
-	  const Pair<int> dimensions = matrix.GetDimensions();
-	  VLOG(1) << "Found output: " << name << " (" << dimensions.x << " x " << dimensions.y << ")";
+	if (is_duplicate && num_completed < (int) output.indices.size()) {
+	  LOG(INFO) << "Dropping partly duplicate result from node: " << node << " (" 
+		    << output.indices.size() - num_completed << " indices will be run again)";
+	} else if (is_duplicate) {
+	  LOG(INFO) << "Dropping duplicate result from node: " << node;
+	}
+	if (!is_duplicate) {
+	  MergeJobOutput(instance, output);
+	}
 
-	  if (!HandleSpecialVariable(output, matrix, name, GetOutputVariableType(name))) {
-	    _instance->final_outputs[name].Merge(matrix);
+	// The node that was sent its host's copy of the shared variables
+	// has published them by now. If a node could not find one of its
+	// cached or shared variables, everything is sent to it (and its
+	// host) again next time; its indices were requeued above.
+	const string& hostname = _node_hostnames[node];
+	if (output.HasInput(CESIUM_CACHE_MISS_FIELD)) {
+	  LOG(WARNING) << "Node " << node << " is missing cached variables (host " << hostname << ")";
+	  _node_cached_hashes.erase(node);
+	  instance->shared_variable_hosts.erase(hostname);
+	} else {
+	  const map<string, int>::iterator publisher_iter = instance->shared_variable_publishers.find(hostname);
+	  if (publisher_iter != instance->shared_variable_publishers.end() && publisher_iter->second == node) {
+	    instance->shared_variable_hosts[hostname] = true;
+	    instance->shared_variable_publishers.erase(publisher_iter);
 	  }
 	}
-	_instance->available_processors.push_back(node);
-	_instance->processors_completed_one[node] = true;
 
-	CheckpointOutputFiles(output);
+	if (!is_duplicate) {
+	  CheckpointOutputFiles(instance, output);
+	  if (instance->journal.get() != NULL && !output.HasInput(CESIUM_CACHE_MISS_FIELD)) {
+	    instance->journal->RecordCompleted(node, output);
+	  }
+	}
       } 
-      _instance->job_completion_mutex.unlock();
+      instance->job_completion_mutex.unlock();
+
+      if (!promoted_prefetch) {
+	_node_owners.erase(node);
+	ReleaseNode(node);
+      }
+    }
+
+    void Cesium::MergeJobOutput(CesiumExecutionInstance* instance, const JobOutput& output) {
+      TraceSpan span("MergeJobOutput", output.indices);
+      for (map<string, MatlabMatrix>::const_iterator it = output.variables.begin(); 
+	   it != output.variables.end(); it++) {
+	const string name = (*it).first;
+	if (name == CESIUM_CACHE_MISS_FIELD) {
+	  continue;
+	}
+	const MatlabMatrix& matrix = (*it).second;
+	const Pair<int> dimensions = matrix.GetDimensions();
+	VLOG(1) << "Found output: " << name << " (" << dimensions.x << " x " << dimensions.y << ")";
+
+	if (!HandleSpecialVariable(instance, output, matrix, name, GetOutputVariableType(instance, name))) {
+	  instance->final_outputs[name].Merge(matrix);
+	}
+      }
+    }
+
+    void Cesium::StartJournal(CesiumExecutionInstance* instance) {
+      const JobDescription& job = instance->job;
+      const string prefix = StringUtils::StringPrintf("%s/journal_%d_%s", FLAGS_cesium_temporary_directory.c_str(),
+						      instance->handle, job.command.c_str());
+      instance->journal.reset(new JobJournal(prefix));
+
+      if (FLAGS_cesium_resume_jobs && instance->journal->Resume(job.command, job.indices)) {
+	// Merge the outputs exactly as they were merged when the
+	// batches first completed.
+	const int num_batches = instance->journal->GetNumberOfCompletedBatches();
+	int num_resumed = 0;
+	for (int batch = 0; batch < num_batches; batch++) {
+	  JobOutput output;
+	  if (!instance->journal->ReadCompletedBatch(batch, &output)) {
+	    break;
+	  }
+	  bool is_duplicate = true;
+	  for (int i = 0; i < (int) output.indices.size(); i++) {
+	    if (instance->indices.MarkCompleted(output.indices[i])) {
+	      is_duplicate = false;
+	      num_resumed++;
+	    }
+	  }
+	  if (!is_duplicate) {
+	    MergeJobOutput(instance, output);
+	  }
+	}
+	LOG(INFO) << "Resumed " << num_resumed << " of " << instance->total_indices << " indices from journal: " 
+		  << prefix << " (" << instance->journal->GetNumberOfInFlightIndices() << " were in flight)";
+      } else if (!instance->journal->Create(job.command, job.indices)) {
+	LOG(ERROR) << "Running job " << instance->handle << " without a journal";
+	instance->journal.reset();
+      }
+    }
+
+    void Cesium::ReleaseNode(const int& node) {
+      _available_processors.push_back(node);
+      _node_idle_since[node] = MPI_Wtime();
     }
 
-    bool Cesium::HandleSpecialVariable(const JobOutput& output, const MatlabMatrix& matrix,
+    bool Cesium::HandleSpecialVariable(CesiumExecutionInstance* instance, 
+				       const JobOutput& output, const MatlabMatrix& matrix,
 				       const string& name, const VariableType& type) {
       const Pair<int> dimensions = matrix.GetDimensions();
 
-      if (type == slib::cesium::PARTIAL_VARIABLE_ROWS || type == slib::cesium::PARTIAL_VARIABLE_COLS) {
+      if (type == slib::cesium::STREAMED_VARIABLE) {
+	OutputStore*& store = instance->output_stores[name];
+	if (store == NULL) {
+	  store = new OutputStore(GetOutputStoreFilename(name), true);
+	}
+	if (!store->Append(output.indices, matrix)) {
+	  LOG(ERROR) << "Could not save output " << name << " to: " << store->GetFilename();
+	}
+
+	const map<string, OutputReducer*>::iterator reducer_iter = instance->output_reducers.find(name);
+	if (reducer_iter != instance->output_reducers.end()) {
+	  reducer_iter->second->Reduce(output.indices, matrix, &instance->final_outputs[name]);
+	}
+	return true;
+      } else if (type == slib::cesium::PARTIAL_VARIABLE_ROWS || type == slib::cesium::PARTIAL_VARIABLE_COLS) {
 	// Save current outputs and output indices.
-	_instance->final_outputs[name].Merge(matrix);
-	_instance->partial_output_indices[name].insert(_instance->partial_output_indices[name].end(), 
+	instance->final_outputs[name].Merge(matrix);
+	instance->partial_output_indices[name].insert(instance->partial_output_indices[name].end(), 
 						       output.indices.begin(), output.indices.end());
 
 	// Check to see if the current size of the matrix is above the chunk size.
-	if (_instance->partial_output_indices[name].size() >= FLAGS_cesium_partial_variable_chunk_size) {
+	if (instance->partial_output_indices[name].size() >= FLAGS_cesium_partial_variable_chunk_size) {
 	  LOG(INFO) << "***********************************************";
 	  LOG(INFO) << "Saving chunk for partial variable: " << name;
 	  LOG(INFO) << "***********************************************";
 
 	  Directory::CreateIfNotExists(FLAGS_cesium_temporary_directory + "/" + name);
-	  SaveTemporaryOutput(StringUtils::StringPrintf("%s/%d", name.c_str(), _instance->partial_output_unique_int),
-			      _instance->final_outputs[name]);
+	  SaveTemporaryOutput(StringUtils::StringPrintf("%s/%d", name.c_str(), instance->partial_output_unique_int),
+			      instance->final_outputs[name]);
 
-	  _instance->partial_output_indices[name].clear();
-	  _instance->final_outputs[name] = MatlabMatrix();
-	  _instance->partial_output_unique_int++;
+	  instance->partial_output_indices[name].clear();
+	  instance->final_outputs[name] = MatlabMatrix();
+	  instance->partial_output_unique_int++;
 	}
 	return true;
       } else if (type == slib::cesium::DSWORK_COLUMN) {
@@ -1011,6 +3136,15 @@ namespace slib {
 				 const VariableType& type) {
       InitializeInstance();
 
+      if (type & COMPRESSED_VARIABLE) {
+	_instance->compressed_variables.insert(variable_name);
+	const VariableType remaining = (VariableType) (type & ~COMPRESSED_VARIABLE);
+	if (remaining != 0) {
+	  SetVariableType(variable_name, input, remaining);
+	}
+	return;
+      }
+
       if (type == slib::cesium::PARTIAL_VARIABLE_ROWS || type == slib::cesium::PARTIAL_VARIABLE_COLS) {
 	_instance->partial_variables[variable_name] = make_pair(input, (FILE*) NULL);
 	_instance->input_variable_types[variable_name] = type;
@@ -6,10 +6,21 @@
  */
 
 #include <boost/signals2/mutex.hpp>
+#include <cesium/checkpoint_writer.h>
+#include <cesium/index_tracker.h>
+#include <cesium/job_journal.h>
+#include <cesium/latency_histogram.h>
+#include <cesium/local_job_controller.h>
+#include <cesium/log_exporter.h>
+#include <cesium/mpijob.h>
+#include <cesium/output_store.h>
+#include <cesium/variable_cache.h>
 #include <common/scoped_ptr.h>
+#include <deque>
 #include <gflags/gflags.h>
+#include <list>
 #include <map>
-#include <cesium/mpijob.h>
+#include <set>
 #include <string>
 #include <util/matlab.h>
 #include <vector>
@@ -20,18 +31,42 @@
 
 #define CESIUM_FINISH_JOB_STRING "__CESIUM_FINISH_JOB__"
 #define CESIUM_NODE_DIED_JOB_STRING "__CESIUM_NODE_DIED__"
-#define CESIUM_IDENTIFY_HOSTNAME_JOB_STRING "__CESIUM_IDENTIFY_HOSTNAME_JOB_STRING__"
+#define CESIUM_BROADCAST_JOB_STRING "__CESIUM_BROADCAST__"
 
 #define CESIUM_CACHED_VARIABLES_FIELD "__CESIUM_CACHED_VARIABLES__"
+#define CESIUM_SHARED_VARIABLES_FIELD "__CESIUM_SHARED_VARIABLES__"
+#define CESIUM_PUBLISH_SHARED_VARIABLES_FIELD "__CESIUM_PUBLISH_SHARED_VARIABLES__"
+#define CESIUM_CACHE_MISS_FIELD "__CESIUM_CACHE_MISS__"
 
 #define CESIUM_CONFIG_ALL_INDICES_FIELD "__CESIUM_ALL_INDICES__"
 
 DECLARE_string(cesium_working_directory);
 DECLARE_string(cesium_temporary_directory);
 DECLARE_bool(cesium_export_log);
+DECLARE_string(cesium_metrics_file);
+DECLARE_double(cesium_metrics_interval);
+DECLARE_string(cesium_trace_file);
 DECLARE_int32(cesium_wait_interval);
+DECLARE_bool(cesium_adaptive_batch_size);
+DECLARE_double(cesium_target_batch_seconds);
+DECLARE_double(cesium_speculative_execution_fraction);
+DECLARE_int32(cesium_compute_threads);
+DECLARE_int32(cesium_local_workers);
+DECLARE_bool(cesium_prefetch_batches);
+DECLARE_bool(cesium_locality_aware_scheduling);
+DECLARE_int32(cesium_max_message_bytes);
+DECLARE_int32(cesium_compression_threshold);
+DECLARE_int32(cesium_variable_cache_megabytes);
+DECLARE_bool(cesium_broadcast_variables);
 DECLARE_bool(cesium_checkpoint_variables);
+DECLARE_bool(cesium_journal_jobs);
+DECLARE_bool(cesium_resume_jobs);
+DECLARE_int32(cesium_checkpoint_compaction_interval);
 DECLARE_int32(cesium_partial_variable_chunk_size);
+DECLARE_double(cesium_index_timeout);
+DECLARE_double(cesium_heartbeat_interval);
+DECLARE_int32(cesium_max_index_failures);
+DECLARE_int32(cesium_submaster_group_size);
 DECLARE_bool(cesium_debug_mode);
 DECLARE_int32(cesium_debug_mode_node);
 DECLARE_int32(cesium_debug_mode_process_single_index);
@@ -60,32 +95,97 @@ namespace slib {
     // TODO(sean): ?Convert this to a ProtocolBuffer implementation for
     // ease of extending?
     struct CesiumExecutionInstance {
+      // The handle returned by Cesium::ExecuteJobAsync.
+      int handle;
+      // The job being run. The indices are moved into the tracker
+      // below when the job is launched.
+      JobDescription job;
+      // Where the outputs are stored once the job finishes. Owned by
+      // the caller of Cesium::ExecuteJobAsync.
+      JobOutput* output;
+      // Whether the job has run into an unrecoverable error.
+      bool success;
+
       int total_indices;
+      int batch_size;
+      int checkpoint_interval;
 
-      // A list of available node ids.
-      std::vector<int> available_processors;
-      // A list of nodes that have died.
-      std::map<int, bool> dead_processors;
-      // A list of indices that have been completed.
-      std::map<int, bool> completed_indices;
-      // A list of indices that are currently being processed.
-      std::map<int, bool> pending_indices;
+      // Tracks which indices are ready, currently being processed
+      // (pending) or completed.
+      IndexTracker indices;
       // A mapping from node to currently processing indices.
       std::map<int, std::vector<int> > node_indices;
+      // A mapping from node to the indices of the batch queued behind
+      // the one it is processing (see cesium_prefetch_batches).
+      std::map<int, std::vector<int> > node_prefetched_indices;
       // A list of outputs that will be saved.
       std::map<std::string, slib::util::MatlabMatrix> final_outputs;
       
-      // A list of processors that have completed at least one job.
-      std::map<int, bool> processors_completed_one;
+      // The content hash (see VariableCache::Hash) of each cached
+      // variable, by variable name.
+      std::map<std::string, std::string> cached_variable_hashes;
+      // The shared memory segment each SHARED_VARIABLE is published
+      // under, by variable name.
+      std::map<std::string, std::string> shared_variable_segments;
+      // The hosts on which the shared variables have been published,
+      // and the node that was sent the copy for each host that is
+      // still waiting on it.
+      std::map<std::string, bool> shared_variable_hosts;
+      std::map<std::string, int> shared_variable_publishers;
+      // The time (MPI_Wtime) at which each busy node was sent its
+      // current batch.
+      std::map<int, double> node_dispatch_time;
+      // The last index of the batch each node was most recently sent
+      // for this job, so its next batch can pick up right after it
+      // (see cesium_locality_aware_scheduling).
+      std::map<int, int> node_last_indices;
+      // A running (exponentially weighted) estimate of the number of
+      // seconds each node needs per index, measured from dispatch to
+      // completion. Used to size batches adaptively.
+      std::map<int, double> node_seconds_per_index;
+      // Nodes whose outstanding batch has been copied to another node
+      // near the end of the job (speculative execution).
+      std::map<int, bool> speculated_nodes;
+      // A mapping from each node running a speculative copy to the
+      // node whose batch it is copying.
+      std::map<int, int> speculative_nodes;
+      // The nodes this instance may run on. Empty means any node,
+      // i.e. the pool is shared with every other running job. Set
+      // via Cesium::SetExecutionNodes().
+      std::map<int, bool> execution_nodes;
+      // The time between a node becoming idle and this job handing
+      // it a batch.
+      LatencyHistogram scheduling_latency;
+      // The last time (MPI_Wtime) progress was reported.
+      double last_report_time;
+      // When (MPI_Wtime) the job started handing out work, and how many
+      // indices had completed by then (e.g. from a journal). Used to
+      // estimate when it will finish.
+      double start_time;
+      int start_completed;
       
       int partial_output_unique_int;
       // Keeps track of partial outputs.
       std::map<std::string, std::vector<int> > partial_output_indices;
       
-      // Keeps track of the number of indices saved for each output (for checkpointing).
+      // The outputs (and their indices) that completed since each
+      // variable was last checkpointed, and how many indices that
+      // is. Handed to the CheckpointWriter once there are enough.
+      std::map<std::string, slib::util::MatlabMatrix> checkpoint_deltas;
       std::map<std::string, int> output_counts;
-      // Keeps track of checkpoints.
       std::map<std::string, std::vector<int> > output_indices;
+      // Whether each variable has been checkpointed (or loaded from a
+      // checkpoint) during this job.
+      std::map<std::string, bool> checkpoint_started;
+      
+      // The number of times each index was running on a node that
+      // died or hung, and the indices that were quarantined (given up
+      // on) once that reached cesium_max_index_failures.
+      std::map<int, int> index_failures;
+      std::vector<int> quarantined_indices;
+      
+      // The journal of the job when cesium_journal_jobs is set.
+      scoped_ptr<JobJournal> journal;
       
       // Synchronizes access to the above resources.
       boost::signals2::mutex job_completion_mutex;
@@ -93,7 +193,18 @@ namespace slib {
       // Holds the variable types.
       std::map<std::string, VariableType> input_variable_types;
       std::map<std::string, VariableType> output_variable_types;
+      // The inputs that were given the COMPRESSED_VARIABLE type. The
+      // bit is kept out of input_variable_types and only set in the
+      // types of the job itself.
+      std::set<std::string> compressed_variables;
       
+      // The on-disk stores of the STREAMED_VARIABLE outputs, opened
+      // as their first batch arrives, and the reducers registered
+      // for them via Cesium::SetOutputReducer. Both are owned by the
+      // instance.
+      std::map<std::string, OutputStore*> output_stores;
+      std::map<std::string, OutputReducer*> output_reducers;
+
       // For input partial variables. This map allows us to postpone
       // loading each part of the partial variable until we execute
       // the job.
@@ -109,6 +220,18 @@ namespace slib {
       bool use_intelligent_parameters;
     };  // struct CesiumExecutionInstance
 
+    // A batch the master sent to a sub-master (see
+    // cesium_submaster_group_size). The sub-master splits it over the
+    // nodes of its group and merges their outputs into one, which is
+    // sent back to the master once every index has completed.
+    struct SubMasterBatch {
+      JobDescription job;
+      JobOutput output;
+      // Tracks which indices of the batch have been handed to the
+      // workers and which have completed.
+      IndexTracker indices;
+    };  // struct SubMasterBatch
+
     class Cesium {
     public:
       virtual ~Cesium();
@@ -174,13 +297,23 @@ namespace slib {
       // resource requirements and need to be processed by a smaller
       // number of nodes than normal. This will only modify the
       // current CesiumInstance; it is not a permanant change.
+      //
+      // Jobs that run concurrently (see ExecuteJobAsync) share all of
+      // the nodes by default, with the oldest job getting first pick
+      // of each idle node. Give each job a disjoint set of nodes
+      // here to partition the nodes between them instead.
+      //
+      // With sub-masters (see cesium_submaster_group_size) only the
+      // nodes that report to the master directly can be listed; the
+      // rest of each group follows its sub-master.
       void SetExecutionNodes(const std::vector<int>& nodes);
 
       // This is a method that assists in determining reasonable
       // inputs to the method above. It will return a map where the
       // keys are the hostnames of all the machines involved in the
       // computation and the value is a list of node ids that belong
-      // to each hostname.
+      // to each hostname. The hostnames are exchanged once in Start()
+      // so this can be called at any time.
       std::map<std::string, std::vector<int> > GetHostnameNodes() const;
       // Same as above but a list of hostnames, one for each node (the inverse).
       std::vector<std::string> GetNodeHostnames() const;
@@ -218,6 +351,16 @@ namespace slib {
       void SetVariableType(const std::string& variable_name, const slib::util::MatlabMatrix& matrix, 
 			   const VariableType& type);
 
+      // Marks the output variable as a STREAMED_VARIABLE and folds
+      // each batch of it into a running result with the reducer (see
+      // SumReducer, ConcatRowsReducer and TopRowsReducer), which is
+      // what ends up in the JobOutput. Every batch is still kept in
+      // the variable's OutputStore. Takes ownership of the reducer.
+      void SetOutputReducer(const std::string& variable_name, OutputReducer* reducer);
+      // Where the batches of a STREAMED_VARIABLE are stored. Open it
+      // with OutputStore to read them back once the job is done.
+      std::string GetOutputStoreFilename(const std::string& variable_name) const;
+
       // This is kind of an odd method that you should not use at all
       // unless you understand the FEATURE_STRIPPED_ROW_VARIABLE
       // variable type. If you use that variable type, you MUST call
@@ -238,7 +381,43 @@ namespace slib {
 	return Cesium::_started;
       }
 
+      // Runs the job to completion. Equivalent to
+      // WaitForJob(ExecuteJobAsync(job, output)).
       bool ExecuteJob(const JobDescription& job, JobOutput* output);
+
+      // Launches the job using the current instance settings (batch
+      // size, execution nodes, variable types, etc) and returns
+      // immediately with a handle for it, or -1 on error. The next
+      // call to any of the instance setters starts configuring a new
+      // instance, so several jobs can be in flight at once.
+      //
+      // Work is only handed out while the master is inside one of
+      // the methods below (or another call to ExecuteJobAsync), so
+      // call them regularly. The output is not filled in until
+      // WaitForJob is called and must stay valid until then.
+      int ExecuteJobAsync(const JobDescription& job, JobOutput* output);
+      // Blocks until the job has completed, fills in its output and
+      // releases it. Jobs launched after it keep running while this
+      // waits. Returns false if the job failed or the handle is not a
+      // running job.
+      bool WaitForJob(const int& handle);
+      // Non-blocking. Handles any completed batches, hands out more
+      // work and returns whether the job has completed. You still
+      // need to call WaitForJob to get the output.
+      bool IsJobFinished(const int& handle);
+
+      // The time between a node reporting that it finished a batch
+      // and the master sending it a new one, accumulated over the
+      // most recently finished job.
+      inline const LatencyHistogram& GetSchedulingLatencyHistogram() const {
+	return _scheduling_latency;
+      }
+      // The indices of the most recently finished job that kept
+      // failing (see cesium_max_index_failures) and were skipped. They
+      // have no outputs.
+      inline const std::vector<int>& GetQuarantinedIndices() const {
+	return _quarantined_indices;
+      }
 #if 0
       void ExecuteKernel(const Kernel& kernel, const JobDescription& job, JobOutput* output);
       void ExecuteFunction(const Function& function, const JobDescription& job, JobOutput* output);
@@ -250,65 +429,274 @@ namespace slib {
       // This is the function the compute nodes enter once Start() has
       // been executed.
       void ComputeNodeLoop();
+      // Runs the registered command for each index of the job (or all
+      // of them at once), merging the results into output. With
+      // cesium_compute_threads > 1 a compute node spreads the indices
+      // over the threads it started when it entered ComputeNodeLoop,
+      // each of which shares the inputs and keeps its own output
+      // until the batch is done.
+      void RunJob(JobDescription* job, JobOutput* output) const;
+      friend void __RunLocalJobWrapper__(JobDescription* job, JobOutput* output);
+      // The loop a sub-master enters once Start() has been executed
+      // instead of ComputeNodeLoop. It takes batches from the master
+      // (even while its workers are busy), hands each idle worker an
+      // even share of the oldest unfinished batch and sends the merged
+      // outputs back in the order the batches arrived.
+      void SubMasterLoop();
+      // Starts a share of the oldest batch with indices left on each
+      // idle worker of this sub-master.
+      void StartWorkerBatches();
+      // Merges the output of a worker into its batch. The indices it
+      // did not complete are handed out again.
+      void HandleWorkerCompleted(const JobOutput& output, const int& node);
+      friend void __HandleWorkerCompletedWrapper__(const JobOutput& output, const int& node);
+      // Works out which node each node reports to (see
+      // cesium_submaster_group_size). Every node computes the same
+      // tree from the hostnames.
+      void SetupTopology();
+      // The number of nodes that run the batches sent to the node:
+      // the size of its group for a sub-master, 1 otherwise.
+      int GetNumberOfWorkers(const int& node) const;
+      // Runs the job on a separate thread while receiving the next
+      // job (if the master sends one) on this thread. Returns true if
+      // next_job was received. Used with cesium_prefetch_batches, and
+      // with cesium_index_timeout to send heartbeats while the job
+      // runs.
+      bool RunJobWhileReceiving(JobDescription* job, JobOutput* output, JobDescription* next_job) const;
+      friend void* __RunJobThread__(void* data);
 
       // This allows us to disable nodes that have died. It is called
       // via the __HandleCommunicationErrorWrapper__ method which is
       // set as the error handler for MPI errors via
       // JobController::SetCommunicationErrorHandler.
       void HandleDeadNode(const int& node);
+      // Puts the batches of the node (including a prefetched one) back
+      // in the ready queue. The indices it was running count as
+      // failed; see cesium_max_index_failures.
+      void RequeueNodeBatches(CesiumExecutionInstance* instance, const int& node);
+      // Receives the heartbeats of the nodes and takes the batches
+      // away from any node that missed its deadline (see
+      // cesium_index_timeout). Such a node is unhealthy, and gets no
+      // more work until it reports back.
+      void CheckForHungNodes();
       friend void __HandleCommunicationErrorWrapper__(const int& error_code, const int& node);
 
       // This is a very important function. It handles all of the
       // merging, etc of job outputs as they complete. This function
-      // is handed to the JobController that is created each time you
-      // call Cesium::ExecuteJob.
+      // is handed to the JobController that is created when the
+      // master calls Cesium::Start.
       void HandleJobCompleted(const JobOutput& output, const int& node);
       friend void __HandleJobCompletedWrapper__(const JobOutput& output, const int& node);
 
       // Logging/Output functions.
-      void ExportLog(const int& pid) const;
-      void ShowProgress(const std::string& command) const;
+      // Flushes the copy of the master's log in the working
+      // directory, starting it on the first call.
+      void ExportLog();
+      void ShowProgress(const CesiumExecutionInstance* instance) const;
+      // Writes the metrics of the running jobs to cesium_metrics_file.
+      void ExportMetrics() const;
+
+      // One pass of the scheduler over every running job: hands
+      // batches to idle nodes, starts speculative copies and reports
+      // progress.
+      void ScheduleJobs();
+      // Saves the outputs of a job that is no longer running, hands
+      // any nodes still running its batches over to the draining set
+      // and destroys the instance.
+      void FinishJob(CesiumExecutionInstance* instance);
+      // Whether the node may run batches for the job, and the number
+      // of idle nodes that could.
+      bool CanRunOnNode(const CesiumExecutionInstance* instance, const int& node) const;
+      int GetNumberOfIdleNodes(const CesiumExecutionInstance* instance) const;
 
       // Sets the batch size and the checkpoint interval automatically.
-      void SetParametersIntelligently();
-
-      // Checks the variable types that were specified for the current
-      // job via the field variable_types in JobDescription and
-      // JobOutput passed to Execute*.
-      VariableType GetInputVariableType(const std::string& variable_name) const;
-      VariableType GetOutputVariableType(const std::string& variable_name) const;
+      void SetParametersIntelligently(CesiumExecutionInstance* instance);
+      // Determines how many indices the node should be sent next. When
+      // intelligent parameters and adaptive batching are enabled, the
+      // batch is sized so the node finishes it in roughly
+      // cesium_target_batch_seconds based on its measured throughput,
+      // and is capped so no node takes more than its share of the
+      // remaining indices (guided self-scheduling). Otherwise this is
+      // simply the batch size.
+      int GetBatchSizeForNode(const CesiumExecutionInstance* instance, const int& node) const;
+      // The measured seconds per index for the node, falling back to
+      // the average over all measured nodes. Returns a negative value
+      // if nothing has been measured yet.
+      double GetSecondsPerIndex(const CesiumExecutionInstance* instance, const int& node) const;
+      // Moves up to max_indices ready indices of the job to pending for
+      // the node and appends them to indices. With
+      // cesium_locality_aware_scheduling, the indices in the ranges the
+      // node was sent before come first, then those right after its
+      // previous batch of this job. Either way the batch is cut short
+      // rather than topped up with indices another node may have been
+      // sent before. Only a node with nothing of its own left is given
+      // the front of the ready queue. The caller holds the
+      // job_completion_mutex.
+      int DispatchIndicesForNode(CesiumExecutionInstance* instance, const int& node, 
+				 const int& max_indices, std::vector<int>* indices);
+
+      // Fills in the partial and cached variables of the job for the
+      // given indices and starts it on the node, removing the node
+      // from the pool of available processors. A prefetched batch is
+      // instead queued behind the node's current batch.
+      void StartBatchOnNode(CesiumExecutionInstance* instance, const int& node, 
+			    const std::vector<int>& indices, const bool& prefetch = false);
+      // Serializes every variable of the job that is sent unchanged
+      // with each batch (i.e. all but the partial variables) once, so
+      // that dispatching a batch only has to serialize the indices
+      // and the partial variables.
+      void SerializeJobVariables(CesiumExecutionInstance* instance);
+      // The serialized bytes of a variable of the job, serializing it
+      // if that has not happened yet.
+      const std::string& GetSerializedVariable(CesiumExecutionInstance* instance, const std::string& name);
+      // Hashes the cached variables of the job and lists them (with
+      // their hashes) in the job so the nodes know what to cache.
+      void SetupCachedVariables(CesiumExecutionInstance* instance);
+      // Names a shared memory segment for each SHARED_VARIABLE of the
+      // job and lists them in the job so the nodes can find them. If
+      // other nodes run on the master's host, the master publishes
+      // the variables for them itself.
+      void SetupSharedVariables(CesiumExecutionInstance* instance);
+      // Broadcasts the cached variables of the job that are not
+      // shared through memory to the idle nodes, so that their first
+      // batches do not have to carry them. Each node is first sent a
+      // job that lists the nodes taking part and the variables. The
+      // variables then go down a binary tree of those nodes, sent
+      // without waiting, so a node that never takes them holds up
+      // neither the master nor its other jobs.
+      void BroadcastJobVariables(CesiumExecutionInstance* instance);
+      // Returns the node to the pool of available processors.
+      void ReleaseNode(const int& node);
+      // Queues a second batch on every busy node that does not
+      // already have one, while the ready queue can spare it.
+      void StartPrefetchBatches();
+      // Once the fraction of completed indices passes
+      // cesium_speculative_execution_fraction and nothing is left to
+      // hand out, copies the outstanding batches of the nodes
+      // expected to finish last onto idle nodes. Whichever copy
+      // finishes first is kept (see HandleJobCompleted).
+      void StartSpeculativeBatches(CesiumExecutionInstance* instance);
+      // Blocks until every node that is still working on a job that
+      // has already returned (e.g. the losing copy of a speculative
+      // batch) reports back. Its results are dropped.
+      void DrainProcessors() const;
+
+      // Checks the variable types that were specified for the job via
+      // the field variable_types in JobDescription and JobOutput
+      // passed to Execute*.
+      VariableType GetInputVariableType(const CesiumExecutionInstance* instance, 
+					const std::string& variable_name) const;
+      VariableType GetOutputVariableType(const CesiumExecutionInstance* instance, 
+					 const std::string& variable_name) const;
 
       // Helper function to save a matrix to a temporary file.
       void SaveTemporaryOutput(const std::string& name, const slib::util::MatlabMatrix& matrix) const;
-      // Checkpoints variables if checkpointing is enabled.
-      void CheckpointOutputFiles(const JobOutput& output);
+      // Checkpoints variables if checkpointing is enabled. Every
+      // checkpoint_interval indices the outputs that completed since
+      // the last checkpoint are handed to the CheckpointWriter.
+      void CheckpointOutputFiles(CesiumExecutionInstance* instance, const JobOutput& output);
       // Handles the loading of checkpointed variables passed in via the 
       // flag cesium_checkpointed_variables.
-      void LoadCheckpoint(const std::vector<std::string>& variables, std::vector<int>* all_indices);
+      void LoadCheckpoint(CesiumExecutionInstance* instance, const std::vector<std::string>& variables);
+      // Opens the journal of the job. With cesium_resume_jobs, a
+      // journal left by an earlier run of the same job is replayed
+      // first: its completed indices are marked completed and their
+      // outputs merged.
+      void StartJournal(CesiumExecutionInstance* instance);
+      // Merges the outputs of a completed batch into the job's
+      // outputs (or hands them to HandleSpecialVariable).
+      void MergeJobOutput(CesiumExecutionInstance* instance, const JobOutput& output);
+      // Starts the checkpoint writer thread the first time it is needed.
+      CheckpointWriter* GetCheckpointWriter();
 
       // This function handles a non-COMPLETE_VARIABLE
       // VariableType. It returns a boolean indicating whether it was
       // able to handle the variable. If this function returns false,
       // you should save/merge the variable as you normally would.
-      bool HandleSpecialVariable(const JobOutput& output, const slib::util::MatlabMatrix& matrix,
+      bool HandleSpecialVariable(CesiumExecutionInstance* instance, 
+				 const JobOutput& output, const slib::util::MatlabMatrix& matrix,
 				 const std::string& name, const VariableType& type);
 
       // This function checks to see if there is an existing instance
-      // and if not it creates one. Currently there will only ever be
-      // a single instance in use at a time so really the instance
-      // member variable should be a singleton but it isn't.
+      // and if not it creates one. This is the instance being
+      // configured for the next Execute* call; launched jobs move to
+      // _running_instances.
       void InitializeInstance();
 
       int _rank;
       int _size;
+      // The number of nodes that are threads of this process when it
+      // runs on its own (see cesium_local_workers), otherwise 0. They
+      // are nodes 1 through _size - 1.
+      int _local_workers;
       std::string _hostname;
+      // The hostname of every node, indexed by rank.
+      std::vector<std::string> _node_hostnames;
+      // The node every node reports to (the master or the sub-master
+      // of its group) and the number of nodes reporting to each,
+      // indexed by rank.
+      std::vector<int> _node_parents;
+      std::vector<int> _node_workers;
       scoped_ptr<CesiumExecutionInstance> _instance;
+      // Jobs launched via ExecuteJobAsync that have not been waited
+      // on yet, keyed by handle. Owned.
+      std::map<int, CesiumExecutionInstance*> _running_instances;
+      int _next_handle;
+      // The job each busy node is running a batch for.
+      std::map<int, int> _node_owners;
+      // The hashes of the cached variables each node has been sent.
+      // Kept across jobs; a node that has since evicted one reports a
+      // cache miss and the entry is cleared. On a sub-master, those
+      // of its workers.
+      std::map<int, std::set<std::string> > _node_cached_hashes;
+      // The pool of idle node ids, shared by all running jobs. On a
+      // sub-master, the idle workers of its group.
+      std::vector<int> _available_processors;
+      // The time (MPI_Wtime) at which each idle node reported its
+      // last completion. Used to measure scheduling latency.
+      std::map<int, double> _node_idle_since;
+      // The ranges [first, last] of the most recent batches each node
+      // was sent, newest last. Kept across jobs so that a node gets the
+      // same part of the data again (see
+      // cesium_locality_aware_scheduling).
+      std::map<int, std::deque<std::pair<int, int> > > _node_index_ranges;
+      // Outlives individual calls to ExecuteJob so that nodes still
+      // running a batch when a job returns can be drained later.
+      scoped_ptr<JobController> _controller;
+      // Nodes that are still running batches for a job that has
+      // already returned, and the number of results still to come
+      // from each.
+      std::map<int, int> _draining_processors;
+      // The time (MPI_Wtime) of the last heartbeat of each busy node,
+      // and the indices it reported running with the time each was
+      // first reported.
+      std::map<int, double> _node_heartbeat_time;
+      std::map<int, std::map<int, double> > _node_running_indices;
+      // Nodes that missed their deadline and have not reported back
+      // since. They are also draining.
+      std::map<int, bool> _unhealthy_processors;
+
+      // The batches a sub-master has taken from the master, oldest
+      // first, and the batch and indices each busy worker is running.
+      std::list<SubMasterBatch*> _submaster_batches;
+      std::map<int, std::pair<SubMasterBatch*, std::vector<int> > > _worker_batches;
+
+      // Writes the checkpoints of every job in the background.
+      scoped_ptr<CheckpointWriter> _checkpoint_writer;
+      // Mirrors the master's log into the working directory (see
+      // cesium_export_log).
+      scoped_ptr<LogExporter> _log_exporter;
+      // The last time (MPI_Wtime) the metrics were written.
+      double _last_metrics_time;
 
       int _batch_size;
       int _checkpoint_interval;
 
       int _stripped_feature_dimensions;
 
+      LatencyHistogram _scheduling_latency;
+      std::vector<int> _quarantined_indices;
+
       static scoped_ptr<Cesium> _singleton;
       static std::map<int, bool> _dead_processors;
       static bool _started;
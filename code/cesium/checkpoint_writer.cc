@@ -0,0 +1,232 @@
+#include "checkpoint_writer.h"
+
+#include <cesium/trace.h>
+#include <common/types.h>
+#include <glog/logging.h>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <sys/time.h>
+#include <unistd.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::util::MatlabMatrix;
+using std::list;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    void* __CheckpointWriterThread__(void* data) {
+      static_cast<CheckpointWriter*>(data)->Run();
+      return NULL;
+    }
+
+    CheckpointWriter::CheckpointWriter(const int& compaction_interval) 
+      : _compaction_interval(compaction_interval)
+      , _running(false)
+      , _writing(false)
+      , _stopping(false)
+      , _num_writes(0)
+      , _write_seconds(0.0) {
+      pthread_mutex_init(&_mutex, NULL);
+      pthread_cond_init(&_queued, NULL);
+      pthread_cond_init(&_written, NULL);
+      if (pthread_create(&_thread, NULL, &__CheckpointWriterThread__, this) == 0) {
+	_running = true;
+      } else {
+	LOG(ERROR) << "Could not start the checkpoint writer. Checkpoints will be written synchronously.";
+      }
+    }
+
+    CheckpointWriter::~CheckpointWriter() {
+      if (_running) {
+	pthread_mutex_lock(&_mutex);
+	_stopping = true;
+	pthread_cond_signal(&_queued);
+	pthread_mutex_unlock(&_mutex);
+	pthread_join(_thread, NULL);
+      }
+      for (map<string, OutputStore*>::iterator iter = _deltas.begin(); iter != _deltas.end(); iter++) {
+	delete iter->second;
+      }
+      pthread_cond_destroy(&_written);
+      pthread_cond_destroy(&_queued);
+      pthread_mutex_destroy(&_mutex);
+    }
+
+    void CheckpointWriter::Append(const string& prefix, MatlabMatrix* delta, 
+				  const vector<int>& indices, const bool& reset) {
+      Delta* queued = new Delta;
+      queued->prefix = prefix;
+      queued->matrix.Swap(*delta);
+      queued->indices = indices;
+      queued->reset = reset;
+
+      if (!_running) {
+	Write(queued);
+	return;
+      }
+
+      pthread_mutex_lock(&_mutex);
+      _queue.push_back(queued);
+      pthread_cond_signal(&_queued);
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    int CheckpointWriter::GetNumberOfWrites() {
+      pthread_mutex_lock(&_mutex);
+      const int num_writes = _num_writes;
+      pthread_mutex_unlock(&_mutex);
+      return num_writes;
+    }
+
+    double CheckpointWriter::GetWriteSeconds() {
+      pthread_mutex_lock(&_mutex);
+      const double write_seconds = _write_seconds;
+      pthread_mutex_unlock(&_mutex);
+      return write_seconds;
+    }
+
+    void CheckpointWriter::Flush() {
+      pthread_mutex_lock(&_mutex);
+      while (_queue.size() > 0 || _writing) {
+	pthread_cond_wait(&_written, &_mutex);
+      }
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    void CheckpointWriter::Run() {
+      pthread_mutex_lock(&_mutex);
+      while (true) {
+	while (_queue.size() == 0 && !_stopping) {
+	  pthread_cond_wait(&_queued, &_mutex);
+	}
+	if (_queue.size() == 0) {
+	  break;
+	}
+
+	Delta* delta = _queue.front();
+	_queue.pop_front();
+	_writing = true;
+	pthread_mutex_unlock(&_mutex);
+
+	Write(delta);
+
+	pthread_mutex_lock(&_mutex);
+	_writing = false;
+	if (_queue.size() == 0) {
+	  pthread_cond_broadcast(&_written);
+	}
+      }
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    OutputStore* CheckpointWriter::GetDeltas(const string& prefix, const bool& truncate) {
+      OutputStore*& deltas = _deltas[prefix];
+      if (truncate && deltas != NULL) {
+	delete deltas;
+	deltas = NULL;
+      }
+      if (deltas == NULL) {
+	deltas = new OutputStore(prefix + ".deltas", truncate);
+      }
+      return deltas;
+    }
+
+    void CheckpointWriter::Write(Delta* delta) {
+      TraceSpan span("WriteCheckpoint", delta->indices);
+      // Timer is not thread-safe.
+      struct timeval start;
+      gettimeofday(&start, NULL);
+
+      const string& prefix = delta->prefix;
+      if (delta->reset) {
+	unlink((prefix + ".mat").c_str());
+	unlink((prefix + "_indices.mat").c_str());
+	GetDeltas(prefix, true);
+	_num_deltas[prefix] = 0;
+      }
+
+      VLOG(1) << "Appending " << delta->indices.size() << " indices to checkpoint: " << prefix;
+      if (!GetDeltas(prefix, false)->Append(delta->indices, delta->matrix)) {
+	LOG(ERROR) << "Could not append to checkpoint: " << prefix;
+      } else if (++_num_deltas[prefix] >= _compaction_interval) {
+	Compact(prefix);
+      }
+
+      delete delta;
+
+      struct timeval end;
+      gettimeofday(&end, NULL);
+      pthread_mutex_lock(&_mutex);
+      _num_writes++;
+      _write_seconds += (end.tv_sec - start.tv_sec) + 1e-6 * (end.tv_usec - start.tv_usec);
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    void CheckpointWriter::Compact(const string& prefix) {
+      LOG(INFO) << "Compacting checkpoint: " << prefix;
+
+      MatlabMatrix matrix;
+      vector<int> indices;
+      Load(prefix, &matrix, &indices);
+
+      // Written next to the old files first so that a crash leaves
+      // either the old or the new checkpoint (the deltas are only
+      // dropped afterwards and merging them twice is harmless).
+      if (!matrix.SaveToFile(prefix + ".tmp.mat") 
+	  || !MatlabMatrix(indices).SaveToFile(prefix + "_indices.tmp.mat")
+	  || rename((prefix + ".tmp.mat").c_str(), (prefix + ".mat").c_str()) != 0
+	  || rename((prefix + "_indices.tmp.mat").c_str(), (prefix + "_indices.mat").c_str()) != 0) {
+	LOG(ERROR) << "Could not compact checkpoint: " << prefix;
+	return;
+      }
+
+      GetDeltas(prefix, true);
+      _num_deltas[prefix] = 0;
+    }
+
+    bool CheckpointWriter::Load(const string& prefix, MatlabMatrix* matrix, vector<int>* indices) {
+      bool found = false;
+
+      // Nothing else touches the files while the queue is empty.
+      if (_running && !pthread_equal(pthread_self(), _thread)) {
+	Flush();
+      }
+
+      if (access((prefix + ".mat").c_str(), R_OK) == 0) {
+	const MatlabMatrix compacted = MatlabMatrix::LoadFromFile(prefix + ".mat");
+	const MatlabMatrix compacted_indices = MatlabMatrix::LoadFromFile(prefix + "_indices.mat");
+	if (compacted.GetMatrixType() != slib::util::MATLAB_NO_TYPE
+	    && compacted_indices.GetMatrixType() != slib::util::MATLAB_NO_TYPE) {
+	  matrix->Merge(compacted);
+	  for (int i = 0; i < compacted_indices.GetNumberOfElements(); i++) {
+	    indices->push_back((int) compacted_indices.GetMatrixEntry(i));
+	  }
+	  found = true;
+	}
+      }
+
+      OutputStore deltas(prefix + ".deltas");
+      const vector<vector<int> > records = deltas.GetRecords();
+      for (int i = 0; i < (int) records.size(); i++) {
+	MatlabMatrix delta;
+	if (records[i].size() == 0 || !deltas.Read(records[i][0], &delta)) {
+	  continue;
+	}
+	matrix->Merge(delta);
+	indices->insert(indices->end(), records[i].begin(), records[i].end());
+	found = true;
+      }
+
+      return found;
+    }
+
+  }  // namespace cesium
+}  // namespace slib
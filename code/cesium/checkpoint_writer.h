@@ -0,0 +1,93 @@
+#ifndef __SLIB_CESIUM_CHECKPOINT_WRITER_H__
+#define __SLIB_CESIUM_CHECKPOINT_WRITER_H__
+
+#include <cesium/output_store.h>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <util/matlab.h>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // Writes checkpoints on a background thread so that the master
+    // never waits on the disk while handing out work. A checkpoint
+    // is identified by the prefix of its files:
+    //
+    //   <prefix>.mat          The compacted outputs.
+    //   <prefix>_indices.mat  The indices they cover.
+    //   <prefix>.deltas       The outputs appended since the last
+    //                         compaction (see OutputStore).
+    //
+    // Each checkpoint only appends the outputs that arrived since the
+    // previous one. Every compaction_interval deltas they are merged
+    // into the .mat files, which happens on the background thread
+    // from what is on disk, so the outputs held by the master are
+    // never touched.
+    class CheckpointWriter {
+    public:
+      explicit CheckpointWriter(const int& compaction_interval);
+      // Finishes writing everything that has been queued.
+      virtual ~CheckpointWriter();
+
+      // Queues the outputs of the given indices to be appended to the
+      // checkpoint. Takes over the contents of delta, which is left
+      // empty, so nothing is copied. With reset, whatever the
+      // checkpoint held before is discarded first.
+      void Append(const std::string& prefix, slib::util::MatlabMatrix* delta, 
+		  const std::vector<int>& indices, const bool& reset);
+      // Blocks until everything queued so far has been written.
+      void Flush();
+      // Reads back the compacted outputs merged with any deltas, and
+      // the indices they cover. Returns false if there is no
+      // checkpoint.
+      bool Load(const std::string& prefix, slib::util::MatlabMatrix* matrix, std::vector<int>* indices);
+
+      // The number of deltas written so far and the (wall clock)
+      // seconds spent writing them, including any compactions.
+      int GetNumberOfWrites();
+      double GetWriteSeconds();
+
+    private:
+      struct Delta {
+	std::string prefix;
+	slib::util::MatlabMatrix matrix;
+	std::vector<int> indices;
+	bool reset;
+      };
+
+      void Run();
+      friend void* __CheckpointWriterThread__(void* data);
+      void Write(Delta* delta);
+      void Compact(const std::string& prefix);
+      OutputStore* GetDeltas(const std::string& prefix, const bool& truncate);
+
+      int _compaction_interval;
+      pthread_t _thread;
+      bool _running;
+
+      // Guards the members below.
+      pthread_mutex_t _mutex;
+      // Signalled when a delta is queued or the writer is stopped.
+      pthread_cond_t _queued;
+      // Signalled when the queue has been emptied.
+      pthread_cond_t _written;
+      std::list<Delta*> _queue;
+      // Whether the thread is writing a delta it has taken off the
+      // queue.
+      bool _writing;
+      bool _stopping;
+      int _num_writes;
+      double _write_seconds;
+
+      // Only touched by the background thread (or while it is idle).
+      std::map<std::string, OutputStore*> _deltas;
+      std::map<std::string, int> _num_deltas;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
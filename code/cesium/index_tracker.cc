@@ -0,0 +1,163 @@
+#include "index_tracker.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+using std::deque;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    IndexTracker::IndexTracker() 
+      : _min_index(0)
+      , _num_indices(0)
+      , _num_completed(0)
+      , _num_pending(0) {}
+
+    void IndexTracker::Reset(const vector<int>& indices) {
+      _num_indices = 0;
+      _num_completed = 0;
+      _num_pending = 0;
+      _ready.clear();
+
+      if (indices.size() == 0) {
+	_min_index = 0;
+	_tracked.clear();
+	_completed.clear();
+	_pending.clear();
+	return;
+      }
+
+      int min_index = indices[0];
+      int max_index = indices[0];
+      for (int i = 1; i < (int) indices.size(); i++) {
+	if (indices[i] < min_index) {
+	  min_index = indices[i];
+	}
+	if (indices[i] > max_index) {
+	  max_index = indices[i];
+	}
+      }
+      _min_index = min_index;
+
+      const int range = max_index - min_index + 1;
+      _tracked.assign(range, false);
+      _completed.assign(range, false);
+      _pending.assign(range, false);
+
+      for (int i = 0; i < (int) indices.size(); i++) {
+	const int slot = indices[i] - _min_index;
+	if (!_tracked[slot]) {
+	  _tracked[slot] = true;
+	  _ready.push_back(indices[i]);
+	  _num_indices++;
+	}
+      }
+    }
+
+    int IndexTracker::GetSlot(const int& index) const {
+      const int slot = index - _min_index;
+      if (slot < 0 || slot >= (int) _tracked.size() || !_tracked[slot]) {
+	return -1;
+      }
+      return slot;
+    }
+
+    int IndexTracker::Dispatch(const int& max_indices, vector<int>* indices) {
+      int added = 0;
+      while (added < max_indices && _ready.size() > 0) {
+	const int index = _ready.front();
+	_ready.pop_front();
+
+	const int slot = index - _min_index;
+	if (_completed[slot] || _pending[slot]) {
+	  continue;
+	}
+	_pending[slot] = true;
+	_num_pending++;
+	indices->push_back(index);
+	added++;
+      }
+      return added;
+    }
+
+    int IndexTracker::DispatchRange(const int& first, const int& max_indices, vector<int>* indices) {
+      int added = 0;
+      for (int slot = std::max(first - _min_index, 0); 
+	   slot < (int) _tracked.size() && added < max_indices; slot++) {
+	if (!_tracked[slot]) {
+	  continue;
+	}
+	if (_completed[slot] || _pending[slot]) {
+	  break;
+	}
+	// The index stays in _ready and is skipped once it comes up.
+	_pending[slot] = true;
+	_num_pending++;
+	indices->push_back(slot + _min_index);
+	added++;
+      }
+      return added;
+    }
+
+    int IndexTracker::FindReady(const int& first, const int& last) const {
+      const int end = std::min(last - _min_index, (int) _tracked.size() - 1);
+      for (int slot = std::max(first - _min_index, 0); slot <= end; slot++) {
+	if (_tracked[slot] && !_completed[slot] && !_pending[slot]) {
+	  return slot + _min_index;
+	}
+      }
+      return -1;
+    }
+
+    bool IndexTracker::MarkCompleted(const int& index) {
+      const int slot = GetSlot(index);
+      if (slot < 0 || _completed[slot]) {
+	return false;
+      }
+      if (_pending[slot]) {
+	_pending[slot] = false;
+	_num_pending--;
+      }
+      _completed[slot] = true;
+      _num_completed++;
+      return true;
+    }
+
+    void IndexTracker::Requeue(const vector<int>& indices) {
+      // Requeued indices go to the front of the queue (in their
+      // original order) so that they are retried first.
+      for (int i = (int) indices.size() - 1; i >= 0; i--) {
+	const int slot = GetSlot(indices[i]);
+	if (slot < 0 || _completed[slot] || !_pending[slot]) {
+	  continue;
+	}
+	_pending[slot] = false;
+	_num_pending--;
+	_ready.push_front(indices[i]);
+      }
+    }
+
+    bool IndexTracker::IsTracked(const int& index) const {
+      return GetSlot(index) >= 0;
+    }
+
+    bool IndexTracker::IsCompleted(const int& index) const {
+      const int slot = GetSlot(index);
+      return slot >= 0 && _completed[slot];
+    }
+
+    bool IndexTracker::IsPending(const int& index) const {
+      const int slot = GetSlot(index);
+      return slot >= 0 && _pending[slot];
+    }
+
+    bool IndexTracker::IsReady(const int& index) const {
+      const int slot = GetSlot(index);
+      return slot >= 0 && !_completed[slot] && !_pending[slot];
+    }
+
+  }  // namespace cesium
+}  // namespace slib
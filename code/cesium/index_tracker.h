@@ -0,0 +1,89 @@
+#ifndef __SLIB_CESIUM_INDEX_TRACKER_H__
+#define __SLIB_CESIUM_INDEX_TRACKER_H__
+
+#include <deque>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // Keeps track of which indices of a job are ready to be sent to a
+    // node, which are pending (sent but not finished) and which are
+    // completed. The states are stored in dense bitsets that span the
+    // range [min index, max index] of the job, so every operation is
+    // O(1) per index. Indices that are ready to be dispatched are kept
+    // in a FIFO queue in the order they were given to Reset.
+    class IndexTracker {
+    public:
+      IndexTracker();
+
+      // Starts tracking the given indices. All of them are initially
+      // ready. Duplicate indices are only tracked once.
+      void Reset(const std::vector<int>& indices);
+
+      // Moves up to max_indices ready indices to the pending state and
+      // appends them to indices. Returns the number of indices added.
+      int Dispatch(const int& max_indices, std::vector<int>* indices);
+
+      // Like Dispatch, but takes the ready indices that follow first
+      // (inclusive) in index order, stopping at the first index that
+      // is not ready. Returns the number of indices added.
+      int DispatchRange(const int& first, const int& max_indices, std::vector<int>* indices);
+
+      // Returns the smallest ready index in [first, last], or -1 if
+      // there is none.
+      int FindReady(const int& first, const int& last) const;
+
+      // Marks an index as completed. Returns false if the index is not
+      // part of the job or was already completed.
+      bool MarkCompleted(const int& index);
+
+      // Moves any of the indices that are pending back to the front of
+      // the ready queue. Completed (or unknown) indices are ignored. Use this
+      // when a node finished or died without completing its indices.
+      void Requeue(const std::vector<int>& indices);
+
+      bool IsTracked(const int& index) const;
+      bool IsCompleted(const int& index) const;
+      bool IsPending(const int& index) const;
+      bool IsReady(const int& index) const;
+
+      inline int GetNumberOfIndices() const {
+	return _num_indices;
+      }
+      inline int GetNumberOfCompleted() const {
+	return _num_completed;
+      }
+      inline int GetNumberOfPending() const {
+	return _num_pending;
+      }
+      inline int GetNumberOfReady() const {
+	return _num_indices - _num_completed - _num_pending;
+      }
+      inline bool IsFinished() const {
+	return _num_completed >= _num_indices;
+      }
+
+    private:
+      int _min_index;
+      int _num_indices;
+      int _num_completed;
+      int _num_pending;
+
+      std::vector<bool> _tracked;
+      std::vector<bool> _completed;
+      std::vector<bool> _pending;
+      // May contain indices that have since been completed or
+      // dispatched by DispatchRange; those are skipped lazily by
+      // Dispatch.
+      std::deque<int> _ready;
+
+      // Returns the position of the index in the bitsets or -1 if it
+      // is not part of the job.
+      int GetSlot(const int& index) const;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
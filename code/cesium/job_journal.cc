@@ -0,0 +1,313 @@
+#include "job_journal.h"
+
+#include <boost/crc.hpp>
+#include <glog/logging.h>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::util::MatlabMatrix;
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    // Helpers for the fixed-width fields of a record.
+    template <typename T>
+    static void AppendValue(const T& value, string* payload) {
+      payload->append((const char*) &value, sizeof(T));
+    }
+
+    template <typename T>
+    static bool ReadValue(const string& payload, size_t* position, T* value) {
+      if (*position + sizeof(T) > payload.length()) {
+	return false;
+      }
+      *value = *((const T*) (payload.data() + *position));
+      *position += sizeof(T);
+      return true;
+    }
+
+    static void AppendIndices(const vector<int>& indices, string* payload) {
+      AppendValue((int) indices.size(), payload);
+      if (indices.size() > 0) {
+	payload->append((const char*) &indices[0], indices.size() * sizeof(int));
+      }
+    }
+
+    static bool ReadIndices(const string& payload, size_t* position, vector<int>* indices) {
+      int num_indices;
+      if (!ReadValue(payload, position, &num_indices) || num_indices < 0) {
+	return false;
+      }
+      for (int i = 0; i < num_indices; i++) {
+	int index;
+	if (!ReadValue(payload, position, &index)) {
+	  return false;
+	}
+	indices->push_back(index);
+      }
+      return true;
+    }
+
+    static unsigned int Checksum(const string& bytes) {
+      boost::crc_32_type crc;
+      crc.process_bytes(bytes.data(), bytes.length());
+      return crc.checksum();
+    }
+
+    // Identifies the job a journal belongs to.
+    static string MakeHeader(const string& command, const vector<int>& indices) {
+      string indices_bytes;
+      AppendIndices(indices, &indices_bytes);
+
+      string payload = "H";
+      AppendValue((int) command.length(), &payload);
+      payload.append(command);
+      AppendValue(Checksum(indices_bytes), &payload);
+      return payload;
+    }
+
+    // Reads the next record, returning false at the end of the file
+    // or at a record that was not completely written.
+    static bool ReadRecord(FILE* file, string* payload) {
+      unsigned int length, checksum;
+      if (fread(&length, sizeof(unsigned int), 1, file) != 1) {
+	return false;
+      }
+      // The length of a torn record can be anything, so it is checked
+      // against what is left of the file before anything is
+      // allocated for it.
+      struct stat file_stat;
+      if (fstat(fileno(file), &file_stat) != 0) {
+	return false;
+      }
+      const long long int remaining = (long long int) file_stat.st_size - ftell(file);
+      if ((long long int) length + (long long int) sizeof(unsigned int) > remaining) {
+	return false;
+      }
+      payload->resize(length);
+      if ((length > 0 && fread(&(*payload)[0], 1, length, file) != length)
+	  || fread(&checksum, sizeof(unsigned int), 1, file) != 1) {
+	return false;
+      }
+      return (length > 0 && checksum == Checksum(*payload));
+    }
+
+    JobJournal::JobJournal(const string& prefix) 
+      : _prefix(prefix)
+      , _journal(NULL)
+      , _outputs(NULL)
+      , _num_in_flight(0) {}
+
+    JobJournal::~JobJournal() {
+      Close();
+    }
+
+    void JobJournal::Close() {
+      if (_journal != NULL) {
+	fclose(_journal);
+	_journal = NULL;
+      }
+      if (_outputs != NULL) {
+	fclose(_outputs);
+	_outputs = NULL;
+      }
+    }
+
+    bool JobJournal::AppendRecord(FILE* file, const string& payload) {
+      const unsigned int length = payload.length();
+      const unsigned int checksum = Checksum(payload);
+      if (fwrite(&length, sizeof(unsigned int), 1, file) != 1
+	  || fwrite(payload.data(), 1, length, file) != length
+	  || fwrite(&checksum, sizeof(unsigned int), 1, file) != 1) {
+	LOG(ERROR) << "Could not write to the journal: " << _prefix;
+	return false;
+      }
+      fflush(file);
+      return true;
+    }
+
+    bool JobJournal::Create(const string& command, const vector<int>& indices) {
+      Close();
+      _completed.clear();
+      _num_in_flight = 0;
+
+      const string journal_filename = _prefix + ".journal";
+      const string temporary_filename = journal_filename + ".tmp";
+
+      _outputs = fopen((_prefix + ".outputs").c_str(), "w+b");
+      FILE* journal = fopen(temporary_filename.c_str(), "wb");
+      if (_outputs == NULL || journal == NULL) {
+	LOG(ERROR) << "Could not create the journal: " << _prefix;
+	if (journal != NULL) {
+	  fclose(journal);
+	}
+	Close();
+	return false;
+      }
+      const bool written = AppendRecord(journal, MakeHeader(command, indices)) && fsync(fileno(journal)) == 0;
+      fclose(journal);
+      if (!written || rename(temporary_filename.c_str(), journal_filename.c_str()) != 0) {
+	LOG(ERROR) << "Could not create the journal: " << _prefix;
+	Close();
+	return false;
+      }
+
+      _journal = fopen(journal_filename.c_str(), "ab");
+      return (_journal != NULL);
+    }
+
+    bool JobJournal::Resume(const string& command, const vector<int>& indices) {
+      Close();
+      _completed.clear();
+      _num_in_flight = 0;
+
+      const string journal_filename = _prefix + ".journal";
+      const string outputs_filename = _prefix + ".outputs";
+      FILE* journal = fopen(journal_filename.c_str(), "rb");
+      if (journal == NULL) {
+	return false;
+      }
+
+      string payload;
+      if (!ReadRecord(journal, &payload) || payload != MakeHeader(command, indices)) {
+	LOG(WARNING) << "The journal " << _prefix << " belongs to a different job";
+	fclose(journal);
+	return false;
+      }
+      long int valid_bytes = ftell(journal);
+
+      struct stat outputs_stat;
+      const long long int outputs_bytes 
+	= (stat(outputs_filename.c_str(), &outputs_stat) == 0) ? outputs_stat.st_size : 0;
+
+      set<int> in_flight;
+      while (ReadRecord(journal, &payload)) {
+	size_t position = 1;
+	int node;
+	vector<int> batch_indices;
+	if (!ReadValue(payload, &position, &node) || !ReadIndices(payload, &position, &batch_indices)) {
+	  break;
+	}
+
+	if (payload[0] == 'D') {
+	  in_flight.insert(batch_indices.begin(), batch_indices.end());
+	} else if (payload[0] == 'C') {
+	  CompletedBatch batch;
+	  batch.indices = batch_indices;
+	  if (!ReadValue(payload, &position, &batch.offset) || !ReadValue(payload, &position, &batch.length)
+	      || batch.offset + batch.length > outputs_bytes) {
+	    break;
+	  }
+	  for (int i = 0; i < (int) batch_indices.size(); i++) {
+	    in_flight.erase(batch_indices[i]);
+	  }
+	  _completed.push_back(batch);
+	} else {
+	  break;
+	}
+	valid_bytes = ftell(journal);
+      }
+      fclose(journal);
+      _num_in_flight = in_flight.size();
+
+      // Drop whatever was only partially written so that new records
+      // follow the valid ones.
+      if (truncate(journal_filename.c_str(), valid_bytes) != 0) {
+	LOG(ERROR) << "Could not truncate the journal: " << _prefix;
+	return false;
+      }
+      _journal = fopen(journal_filename.c_str(), "ab");
+      _outputs = fopen(outputs_filename.c_str(), "a+b");
+      if (_journal == NULL || _outputs == NULL) {
+	LOG(ERROR) << "Could not reopen the journal: " << _prefix;
+	Close();
+	return false;
+      }
+
+      return true;
+    }
+
+    void JobJournal::RecordDispatched(const int& node, const vector<int>& indices) {
+      if (_journal == NULL) {
+	return;
+      }
+      string payload = "D";
+      AppendValue(node, &payload);
+      AppendIndices(indices, &payload);
+      AppendRecord(_journal, payload);
+    }
+
+    bool JobJournal::RecordCompleted(const int& node, const JobOutput& output) {
+      if (_journal == NULL || _outputs == NULL) {
+	return false;
+      }
+
+      MatlabMatrix variables(slib::util::MATLAB_CELL_ARRAY, output.variables.size(), 2);
+      int row = 0;
+      for (map<string, MatlabMatrix>::const_iterator iter = output.variables.begin();
+	   iter != output.variables.end(); iter++, row++) {
+	variables.SetCell(row, 0, MatlabMatrix(iter->first));
+	variables.SetCell(row, 1, iter->second);
+      }
+      const string serialized = variables.Serialize();
+
+      fseek(_outputs, 0, SEEK_END);
+      const long long int offset = ftell(_outputs);
+      const long long int length = serialized.length();
+      if (fwrite(serialized.data(), 1, length, _outputs) != (size_t) length) {
+	LOG(ERROR) << "Could not write to the journal: " << _prefix;
+	return false;
+      }
+      // The outputs have to reach the disk before the record that
+      // points at them can.
+      fflush(_outputs);
+      if (fsync(fileno(_outputs)) != 0) {
+	LOG(ERROR) << "Could not sync the journal: " << _prefix;
+	return false;
+      }
+
+      string payload = "C";
+      AppendValue(node, &payload);
+      AppendIndices(output.indices, &payload);
+      AppendValue(offset, &payload);
+      AppendValue(length, &payload);
+      return AppendRecord(_journal, payload);
+    }
+
+    bool JobJournal::ReadCompletedBatch(const int& batch, JobOutput* output) {
+      if (batch < 0 || batch >= (int) _completed.size() || _outputs == NULL) {
+	return false;
+      }
+
+      const CompletedBatch& completed = _completed[batch];
+      string serialized(completed.length, '\0');
+      fseek(_outputs, completed.offset, SEEK_SET);
+      if (completed.length > 0 
+	  && fread(&serialized[0], 1, completed.length, _outputs) != (size_t) completed.length) {
+	LOG(ERROR) << "Could not read batch " << batch << " from the journal: " << _prefix;
+	return false;
+      }
+
+      MatlabMatrix variables;
+      variables.Deserialize(serialized);
+      output->indices = completed.indices;
+      for (int row = 0; row < variables.rows(); row++) {
+	output->variables[variables.GetCell(row, 0).GetStringContents()] = variables.GetCell(row, 1);
+      }
+
+      return true;
+    }
+
+  }  // namespace cesium
+}  // namespace slib
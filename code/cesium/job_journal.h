@@ -0,0 +1,75 @@
+#ifndef __SLIB_CESIUM_JOB_JOURNAL_H__
+#define __SLIB_CESIUM_JOB_JOURNAL_H__
+
+#include <cesium/mpijob.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // A write-ahead journal of a job that lets a restarted master
+    // pick the job up where it left off. It consists of two
+    // append-only files:
+    //
+    //   <prefix>.journal  The job it belongs to, followed by a record
+    //                     for every batch dispatched and completed.
+    //   <prefix>.outputs  The outputs of each completed batch.
+    //
+    // The outputs of a batch are written (and synced to disk) before
+    // the record that points at them, and every record carries a
+    // checksum, so a crash at any point (of the master or of its
+    // host) leaves a journal whose valid prefix is consistent. A new
+    // journal is written next to the old one and renamed into place.
+    class JobJournal {
+    public:
+      explicit JobJournal(const std::string& prefix);
+      virtual ~JobJournal();
+
+      // Replaces any journal at the prefix with an empty one for the
+      // job. Returns false if it could not be written.
+      bool Create(const std::string& command, const std::vector<int>& indices);
+      // Reads back the journal of the same job (same command and
+      // indices) and continues appending to it. Anything after the
+      // last valid record is discarded. Returns false if there is no
+      // such journal.
+      bool Resume(const std::string& command, const std::vector<int>& indices);
+
+      void RecordDispatched(const int& node, const std::vector<int>& indices);
+      // Returns false if the batch could not be written.
+      bool RecordCompleted(const int& node, const JobOutput& output);
+
+      // The batches that had completed when the journal was resumed.
+      inline int GetNumberOfCompletedBatches() const {
+	return _completed.size();
+      }
+      // Fills in the indices and outputs of one of them.
+      bool ReadCompletedBatch(const int& batch, JobOutput* output);
+      // The number of indices that had been dispatched but not
+      // completed when the journal was resumed.
+      inline int GetNumberOfInFlightIndices() const {
+	return _num_in_flight;
+      }
+
+    private:
+      struct CompletedBatch {
+	std::vector<int> indices;
+	long long int offset;
+	long long int length;
+      };
+
+      void Close();
+      bool AppendRecord(FILE* file, const std::string& payload);
+
+      std::string _prefix;
+      FILE* _journal;
+      FILE* _outputs;
+      std::vector<CompletedBatch> _completed;
+      int _num_in_flight;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
@@ -0,0 +1,74 @@
+#include "latency_histogram.h"
+
+#include <string>
+#include <string/stringutils.h>
+#include <vector>
+
+#define LATENCY_HISTOGRAM_NUM_BUCKETS 32
+
+using slib::StringUtils;
+using std::string;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    LatencyHistogram::LatencyHistogram() {
+      Clear();
+    }
+
+    void LatencyHistogram::Clear() {
+      _buckets = vector<int>(LATENCY_HISTOGRAM_NUM_BUCKETS, 0);
+      _num_samples = 0;
+      _total_seconds = 0.0;
+      _max_seconds = 0.0;
+    }
+
+    void LatencyHistogram::AddSample(const double& seconds) {
+      const double microseconds = seconds * 1e6;
+      int bucket = 0;
+      while (bucket < LATENCY_HISTOGRAM_NUM_BUCKETS - 1 && microseconds >= (double) (1LL << bucket)) {
+	bucket++;
+      }
+      _buckets[bucket]++;
+      _num_samples++;
+      _total_seconds += seconds;
+      if (seconds > _max_seconds) {
+	_max_seconds = seconds;
+      }
+    }
+
+    double LatencyHistogram::GetMeanSeconds() const {
+      return _num_samples > 0 ? _total_seconds / ((double) _num_samples) : 0.0;
+    }
+
+    double LatencyHistogram::GetPercentileSeconds(const double& percentile) const {
+      const double target = ((double) _num_samples) * percentile / 100.0;
+      int seen = 0;
+      for (int i = 0; i < (int) _buckets.size(); i++) {
+	seen += _buckets[i];
+	if (seen > 0 && seen >= target) {
+	  return ((double) (1LL << i)) / 1e6;
+	}
+      }
+      return _max_seconds;
+    }
+
+    string LatencyHistogram::ToString() const {
+      string output = StringUtils::StringPrintf("Samples: %d, Mean: %.6fs, Max: %.6fs", 
+						_num_samples, GetMeanSeconds(), _max_seconds);
+      for (int i = 0; i < (int) _buckets.size(); i++) {
+	if (_buckets[i] == 0) {
+	  continue;
+	}
+	if (i == (int) _buckets.size() - 1) {
+	  StringUtils::StringAppendF(&output, "\n\t>= %lldus: %d", 1LL << (i - 1), _buckets[i]);
+	} else {
+	  StringUtils::StringAppendF(&output, "\n\t< %lldus: %d", 1LL << i, _buckets[i]);
+	}
+      }
+      return output;
+    }
+
+  }  // namespace cesium
+}  // namespace slib
@@ -0,0 +1,47 @@
+#ifndef __SLIB_CESIUM_LATENCY_HISTOGRAM_H__
+#define __SLIB_CESIUM_LATENCY_HISTOGRAM_H__
+
+#include <string>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // A simple histogram of latencies. Bucket i counts the samples
+    // that took less than 2^i microseconds (the last bucket catches
+    // everything else), which covers ~1us to ~1 hour in 32 buckets.
+    class LatencyHistogram {
+    public:
+      LatencyHistogram();
+
+      void AddSample(const double& seconds);
+      void Clear();
+
+      inline int GetNumberOfSamples() const {
+	return _num_samples;
+      }
+
+      double GetMeanSeconds() const;
+      inline double GetMaxSeconds() const {
+	return _max_seconds;
+      }
+
+      // Returns an (approximate) upper bound on the given percentile
+      // (0-100) based on the bucket boundaries.
+      double GetPercentileSeconds(const double& percentile) const;
+
+      // A multi-line, human-readable version of the histogram that
+      // only includes the non-empty buckets.
+      std::string ToString() const;
+
+    private:
+      std::vector<int> _buckets;
+      int _num_samples;
+      double _total_seconds;
+      double _max_seconds;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
@@ -0,0 +1,194 @@
+#include "local_job_controller.h"
+
+#include <deque>
+#include <glog/logging.h>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <util/matlab.h>
+#include <utility>
+#include <vector>
+
+using slib::util::MatlabMatrix;
+using std::deque;
+using std::list;
+using std::make_pair;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    void* __LocalNodeThread__(void* data) {
+      LocalJobController::LocalNode* local_node = static_cast<LocalJobController::LocalNode*>(data);
+      local_node->controller->Run(local_node);
+      return NULL;
+    }
+
+    LocalJobController::LocalJobController(const int& num_nodes, LocalJobRunner runner) 
+      : _runner(runner)
+      , _stopping(false) {
+      pthread_mutex_init(&_mutex, NULL);
+      pthread_cond_init(&_queued, NULL);
+      pthread_cond_init(&_completed, NULL);
+
+      for (int node = 1; node <= num_nodes; node++) {
+	LocalNode* local_node = new LocalNode;
+	local_node->controller = this;
+	local_node->node = node;
+	local_node->running = 
+	  (pthread_create(&local_node->thread, NULL, &__LocalNodeThread__, local_node) == 0);
+	if (!local_node->running) {
+	  LOG(ERROR) << "Could not start the thread of local node: " << node;
+	}
+	_nodes.push_back(local_node);
+      }
+    }
+
+    LocalJobController::~LocalJobController() {
+      pthread_mutex_lock(&_mutex);
+      _stopping = true;
+      pthread_cond_broadcast(&_queued);
+      pthread_mutex_unlock(&_mutex);
+
+      for (int i = 0; i < (int) _nodes.size(); i++) {
+	if (_nodes[i]->running) {
+	  pthread_join(_nodes[i]->thread, NULL);
+	}
+	for (deque<JobDescription*>::iterator iter = _nodes[i]->queue.begin(); 
+	     iter != _nodes[i]->queue.end(); iter++) {
+	  delete *iter;
+	}
+	delete _nodes[i];
+      }
+      for (list<pair<int, JobOutput*> >::iterator iter = _completed_jobs.begin(); 
+	   iter != _completed_jobs.end(); iter++) {
+	delete iter->second;
+      }
+
+      pthread_cond_destroy(&_completed);
+      pthread_cond_destroy(&_queued);
+      pthread_mutex_destroy(&_mutex);
+    }
+
+    void LocalJobController::Run(LocalNode* local_node) {
+      pthread_mutex_lock(&_mutex);
+      while (true) {
+	while (local_node->queue.size() == 0 && !_stopping) {
+	  pthread_cond_wait(&_queued, &_mutex);
+	}
+	if (local_node->queue.size() == 0) {
+	  break;
+	}
+	JobDescription* job = local_node->queue.front();
+	pthread_mutex_unlock(&_mutex);
+
+	JobOutput* output = new JobOutput;
+	output->command = job->command;
+	(*_runner)(job, output);
+
+	pthread_mutex_lock(&_mutex);
+	// Only taken off the queue now so that it can be cancelled
+	// while it waits, but not while it runs.
+	local_node->queue.pop_front();
+	delete job;
+	_completed_jobs.push_back(make_pair(local_node->node, output));
+	pthread_cond_signal(&_completed);
+      }
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    void LocalJobController::StartJobOnNode(const JobDescription& description, const int& node,
+					    const map<string, VariableType>& variable_types) {
+      if (node < 1 || node > (int) _nodes.size() || !_nodes[node - 1]->running) {
+	LOG(ERROR) << "Not a local node: " << node;
+	if (_error_handler != NULL) {
+	  (*_error_handler)(MPI_ERR_RANK, node);
+	}
+	return;
+      }
+
+      // The caller may change or reuse the description as soon as
+      // this returns, so the node gets a copy.
+      JobDescription* job = new JobDescription;
+      job->command = description.command;
+      job->indices = description.indices;
+      for (map<string, MatlabMatrix>::const_iterator iter = description.variables.begin();
+	   iter != description.variables.end(); iter++) {
+	MatlabMatrix& variable = job->variables[iter->first];
+	variable = iter->second;
+	VariableType type;
+	if (JobNode::UnsliceVariable(&variable, &type)) {
+	  job->variable_types[iter->first] = type;
+	}
+      }
+
+      _jobs_per_node[node]++;
+      pthread_mutex_lock(&_mutex);
+      _nodes[node - 1]->queue.push_back(job);
+      pthread_cond_broadcast(&_queued);
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    int LocalJobController::HandleCompletedJobs(const bool& wait) {
+      list<pair<int, JobOutput*> > completed;
+      pthread_mutex_lock(&_mutex);
+      while (wait && _completed_jobs.size() == 0 && _jobs_per_node.size() > 0) {
+	pthread_cond_wait(&_completed, &_mutex);
+      }
+      completed.swap(_completed_jobs);
+      pthread_mutex_unlock(&_mutex);
+
+      // The handler may start new jobs, so it is called without
+      // holding the lock.
+      for (list<pair<int, JobOutput*> >::iterator iter = completed.begin(); iter != completed.end(); iter++) {
+	const int node = iter->first;
+	if (--_jobs_per_node[node] <= 0) {
+	  _jobs_per_node.erase(node);
+	}
+	if (_completion_handler != NULL) {
+	  (*_completion_handler)(*iter->second, node);
+	}
+	delete iter->second;
+      }
+      return completed.size();
+    }
+
+    void LocalJobController::CheckForCompletion() {
+      HandleCompletedJobs(false);
+    }
+
+    int LocalJobController::WaitForCompletion() {
+      return HandleCompletedJobs(true);
+    }
+
+    int LocalJobController::GetNumberOfPendingJobs() const {
+      return _jobs_per_node.size();
+    }
+
+    int LocalJobController::GetNumberOfJobsOnNode(const int& node) const {
+      const map<int, int>::const_iterator iter = _jobs_per_node.find(node);
+      return iter == _jobs_per_node.end() ? 0 : iter->second;
+    }
+
+    void LocalJobController::CancelPendingRequests() {
+      pthread_mutex_lock(&_mutex);
+      for (int i = 0; i < (int) _nodes.size(); i++) {
+	deque<JobDescription*>& queue = _nodes[i]->queue;
+	// The front of the queue may be running.
+	while (queue.size() > 1) {
+	  delete queue.back();
+	  queue.pop_back();
+	  if (--_jobs_per_node[_nodes[i]->node] <= 0) {
+	    _jobs_per_node.erase(_nodes[i]->node);
+	  }
+	}
+      }
+      pthread_mutex_unlock(&_mutex);
+    }
+
+  }  // namespace cesium
+}  // namespace slib
@@ -0,0 +1,76 @@
+#ifndef __SLIB_CESIUM_LOCAL_JOB_CONTROLLER_H__
+#define __SLIB_CESIUM_LOCAL_JOB_CONTROLLER_H__
+
+#include <cesium/mpijob.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <utility>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // Runs the job in place of a compute node. Called on the thread
+    // of the (local) node.
+    typedef void (*LocalJobRunner)(JobDescription* job, JobOutput* output);
+
+    // A JobController whose nodes are threads of this process rather
+    // than other MPI processes, for running jobs on a single machine
+    // without mpirun. Nodes 1 through num_nodes each have a thread
+    // that runs the jobs started on it in order via the runner. The
+    // jobs and outputs are handed over in memory, without being
+    // serialized, and partial variables are expanded the way
+    // JobNode::WaitForJobData does. As with the MPI version, the
+    // CompletionHandler is only ever called from within
+    // CheckForCompletion and WaitForCompletion.
+    class LocalJobController : public JobController {
+    public:
+      LocalJobController(const int& num_nodes, LocalJobRunner runner);
+      // Finishes the jobs that were started and stops the threads.
+      virtual ~LocalJobController();
+
+      virtual void StartJobOnNode(const JobDescription& description, const int& node,
+				  const std::map<std::string, VariableType>& variable_types);
+      virtual void CheckForCompletion();
+      virtual int WaitForCompletion();
+      virtual int GetNumberOfPendingJobs() const;
+      virtual int GetNumberOfJobsOnNode(const int& node) const;
+      // Drops the jobs that have not started yet.
+      virtual void CancelPendingRequests();
+
+    private:
+      struct LocalNode {
+	LocalJobController* controller;
+	int node;
+	pthread_t thread;
+	bool running;
+	std::deque<JobDescription*> queue;
+      };
+
+      void Run(LocalNode* local_node);
+      friend void* __LocalNodeThread__(void* data);
+      // Hands the completed jobs to the CompletionHandler, waiting
+      // for one if wait is set and any job is outstanding.
+      int HandleCompletedJobs(const bool& wait);
+
+      LocalJobRunner _runner;
+      std::vector<LocalNode*> _nodes;
+      // Only touched by the thread that starts the jobs.
+      std::map<int, int> _jobs_per_node;
+
+      // Guards the members below and the queues of the nodes.
+      pthread_mutex_t _mutex;
+      // Signalled when a job is queued or the threads are stopped.
+      pthread_cond_t _queued;
+      // Signalled when a job completes.
+      pthread_cond_t _completed;
+      std::list<std::pair<int, JobOutput*> > _completed_jobs;
+      bool _stopping;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
@@ -0,0 +1,100 @@
+#include "log_exporter.h"
+
+#include <dirent.h>
+#include <glog/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <string/stringutils.h>
+#include <unistd.h>
+
+using slib::StringUtils;
+using std::string;
+
+namespace slib {
+  namespace cesium {
+
+    LogExporter::LogExporter(const string& filename) 
+      : _filename(filename)
+      , _file(NULL) {
+      pthread_mutex_init(&_mutex, NULL);
+      _file = fopen(filename.c_str(), "w");
+      if (_file == NULL) {
+	LOG(ERROR) << "Could not open the log export file: " << filename;
+	return;
+      }
+      CopyExistingLog();
+      google::AddLogSink(this);
+    }
+
+    LogExporter::~LogExporter() {
+      if (_file != NULL) {
+	google::RemoveLogSink(this);
+	fclose(_file);
+      }
+      pthread_mutex_destroy(&_mutex);
+    }
+
+    void LogExporter::CopyExistingLog() {
+      google::FlushLogFiles(google::GLOG_INFO);
+
+      // glog names its files <program>.<host>.<user>.log.INFO.<time>.<pid>.
+      const string directory = FLAGS_log_dir.length() > 0 ? FLAGS_log_dir : "/tmp";
+      const string suffix = StringUtils::StringPrintf(".%d", getpid());
+      DIR* dir = opendir(directory.c_str());
+      if (dir == NULL) {
+	return;
+      }
+      string log_filename;
+      struct dirent* entry;
+      while ((entry = readdir(dir)) != NULL) {
+	const string name(entry->d_name);
+	if (name.find(".INFO.") != string::npos && name.length() > suffix.length() 
+	    && name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0) {
+	  log_filename = directory + "/" + name;
+	  break;
+	}
+      }
+      closedir(dir);
+      if (log_filename.length() == 0) {
+	return;
+      }
+
+      FILE* log = fopen(log_filename.c_str(), "r");
+      if (log == NULL) {
+	return;
+      }
+      char buffer[1 << 16];
+      size_t length;
+      while ((length = fread(buffer, 1, sizeof(buffer), log)) > 0) {
+	fwrite(buffer, 1, length, _file);
+      }
+      fclose(log);
+      fflush(_file);
+    }
+
+    void LogExporter::send(google::LogSeverity severity, const char* full_filename,
+			   const char* base_filename, int line, const struct ::tm* tm_time,
+			   const char* message, size_t message_len) {
+      const string text = google::LogSink::ToString(severity, base_filename, line, tm_time, 
+						    message, message_len);
+      pthread_mutex_lock(&_mutex);
+      fwrite(text.data(), 1, text.length(), _file);
+      fputc('\n', _file);
+      if (severity >= google::GLOG_WARNING) {
+	fflush(_file);
+      }
+      pthread_mutex_unlock(&_mutex);
+    }
+
+    void LogExporter::Flush() {
+      if (_file == NULL) {
+	return;
+      }
+      pthread_mutex_lock(&_mutex);
+      fflush(_file);
+      pthread_mutex_unlock(&_mutex);
+    }
+
+  }  // namespace cesium
+}  // namespace slib
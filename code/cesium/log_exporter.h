@@ -0,0 +1,53 @@
+#ifndef __SLIB_CESIUM_LOG_EXPORTER_H__
+#define __SLIB_CESIUM_LOG_EXPORTER_H__
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+
+namespace slib {
+  namespace cesium {
+
+    // Mirrors the log of this process into a file (usually on the
+    // shared working directory) as it is written. It starts with a
+    // copy of the INFO log glog has written for this process so far,
+    // and from then on every message is appended by glog itself, so
+    // nothing has to be copied or forked while a job runs. Warnings
+    // and errors are flushed right away; everything else whenever
+    // Flush is called.
+    class LogExporter : public google::LogSink {
+    public:
+      // Registers itself with glog. Check IsOpen to see whether the
+      // file could be written.
+      explicit LogExporter(const std::string& filename);
+      virtual ~LogExporter();
+
+      virtual void send(google::LogSeverity severity, const char* full_filename,
+			const char* base_filename, int line, const struct ::tm* tm_time,
+			const char* message, size_t message_len);
+
+      void Flush();
+
+      inline bool IsOpen() const {
+	return _file != NULL;
+      }
+      inline const std::string& GetFilename() const {
+	return _filename;
+      }
+
+    private:
+      std::string _filename;
+      FILE* _file;
+      // send may be called from any thread that logs.
+      pthread_mutex_t _mutex;
+
+      // Copies the contents of glog's INFO log of this process, if
+      // there is one, to the file.
+      void CopyExistingLog();
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
@@ -1,7 +1,11 @@
 #include "mpijob.h"
 
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+#include <cesium/trace.h>
 #include <common/scoped_ptr.h>
 #include <glog/logging.h>
+#include <list>
 #include <map>
 #include <map>
 #include <mpi.h>
@@ -9,16 +13,51 @@
 #include <string.h>
 #include <util/matlab.h>
 #include <vector>
+#include <zlib.h>
 
 using slib::util::MatlabMatrix;
+using std::list;
 using std::map;
+using std::pair;
 using std::string;
 using std::vector;
 
+// How each variable in the payload of a job is encoded. Recorded in
+// the header so the receiver does not need to know what the sender
+// was configured to do.
+#define MPIJOB_CODEC_NONE 0
+#define MPIJOB_CODEC_ZLIB 1
+
 namespace slib {
   namespace cesium {
 
     bool JobNode::_initialized = false;
+    int JobNode::_max_message_bytes = 1 << 30;
+    long long JobNode::_compression_threshold = 1 << 16;
+    map<boost::shared_ptr<const string>, boost::shared_ptr<const string> > JobNode::_compressed_variables;
+    TransferStatistics JobNode::_statistics;
+
+    // ******* TransferStatistics Methods ****** //
+    long long TransferStatistics::GetTotalBytesSent() const {
+      long long total = 0;
+      for (map<int, long long>::const_iterator iter = bytes_sent.begin(); iter != bytes_sent.end(); iter++) {
+	total += iter->second;
+      }
+      return total;
+    }
+
+    long long TransferStatistics::GetTotalBytesReceived() const {
+      long long total = 0;
+      for (map<int, long long>::const_iterator iter = bytes_received.begin(); 
+	   iter != bytes_received.end(); iter++) {
+	total += iter->second;
+      }
+      return total;
+    }
+
+    double TransferStatistics::GetCompressionRatio() const {
+      return compressed_bytes > 0 ? (double) uncompressed_bytes / compressed_bytes : 1.0;
+    }
 
     // ******* JobData Methods ****** //
     MatlabMatrix empty_matrix;
@@ -57,6 +96,79 @@ namespace slib {
       variable_types[variable_name] = type;
     }
 
+    // ******* JobMessages Methods ****** //
+    void JobMessages::AddBytes(const string& bytes, const int& tag) {
+      AddBytes(boost::shared_ptr<const string>(new string(bytes)), tag);
+    }
+
+    void JobMessages::AddBytes(const boost::shared_ptr<const string>& bytes, const int& tag) {
+      AddBytes(vector<boost::shared_ptr<const string> >(1, bytes), tag, bytes->length());
+    }
+
+    void JobMessages::AddBytes(const vector<boost::shared_ptr<const string> >& parts, const int& tag,
+			       const int& max_message_bytes) {
+      // Message boundaries fall every max_message_bytes of the
+      // concatenated buffers, wherever the buffers themselves end.
+      long long message_bytes_left = 0;
+      for (int i = 0; i < (int) parts.size(); i++) {
+	buffers.push_back(parts[i]);
+	const char* data = parts[i]->data();
+	long long bytes_left = parts[i]->length();
+	while (bytes_left > 0) {
+	  if (message_bytes_left == 0) {
+	    segments.push_back(vector<pair<const char*, int> >());
+	    tags.push_back(tag);
+	    message_bytes_left = max_message_bytes;
+	  }
+	  const int length = (int) std::min(bytes_left, message_bytes_left);
+	  segments.back().push_back(pair<const char*, int>(data, length));
+	  data += length;
+	  bytes_left -= length;
+	  message_bytes_left -= length;
+	}
+      }
+    }
+
+    // The header of a job is a flat buffer of ints and strings (each
+    // string is preceded by its length) in the order PackJobData
+    // writes them.
+    static void AppendInt(const int& value, string* header) {
+      header->append(reinterpret_cast<const char*>(&value), sizeof(int));
+    }
+
+    static void AppendString(const string& value, string* header) {
+      AppendInt((int) value.length(), header);
+      header->append(value);
+    }
+
+    static int ReadInt(const char* header, const int& length, int* offset) {
+      CHECK(*offset + (int) sizeof(int) <= length) << "Truncated job header";
+      int value;
+      memcpy(&value, header + *offset, sizeof(int));
+      *offset += sizeof(int);
+      return value;
+    }
+
+    static void AppendLongLong(const long long& value, string* header) {
+      header->append(reinterpret_cast<const char*>(&value), sizeof(long long));
+    }
+
+    static long long ReadLongLong(const char* header, const int& length, int* offset) {
+      CHECK(*offset + (int) sizeof(long long) <= length) << "Truncated job header";
+      long long value;
+      memcpy(&value, header + *offset, sizeof(long long));
+      *offset += sizeof(long long);
+      return value;
+    }
+
+    static string ReadString(const char* header, const int& length, int* offset) {
+      const int string_length = ReadInt(header, length, offset);
+      CHECK(string_length >= 0 && *offset + string_length <= length) << "Truncated job header";
+      const string value(header + *offset, string_length);
+      *offset += string_length;
+      return value;
+    }
+
     // ******* JobController Methods ****** //
     void MPIErrorHandler (MPI_Comm* comm, int* err, ...) {
       JobController::PrintMPICommunicationError(*err);
@@ -74,6 +186,34 @@ namespace slib {
       MPI_Comm_set_errhandler(MPI_COMM_WORLD, _error_handler_mpi);
     }
 
+    JobController::~JobController() {
+      CompletePendingSends(true);
+    }
+
+    void JobController::CompletePendingSends(const bool& wait) {
+      for (list<PendingSend*>::iterator iter = _pending_sends.begin(); iter != _pending_sends.end(); ) {
+	PendingSend* pending = *iter;
+	int flag = 1;
+	if (pending->requests.size() > 0) {
+	  const int error = wait 
+	    ? MPI_Waitall((int) pending->requests.size(), &pending->requests[0], MPI_STATUSES_IGNORE)
+	    : MPI_Testall((int) pending->requests.size(), &pending->requests[0], &flag, MPI_STATUSES_IGNORE);
+	  if (error != MPI_SUCCESS) {
+	    LOG(ERROR) << "Could not send a queued job to node: " << pending->node;
+	    HandleError(error, pending->node);
+	    flag = 1;
+	  }
+	}
+	if (flag) {
+	  VLOG(2) << "Queued job handed over to node: " << pending->node;
+	  delete pending;
+	  iter = _pending_sends.erase(iter);
+	} else {
+	  iter++;
+	}
+      }
+    }
+
     void JobController::SetCommunicationErrorHandler(CommunicationErrorHandler handler) {
       _error_handler = handler;
     }
@@ -90,7 +230,7 @@ namespace slib {
 
     void JobController::SendCompletionResponse(const int& node) {
       int message = 1;
-      const int error = MPI_Send(&message, 1, MPI_INT, node, MPI_COMPLETION_TAG + 1, MPI_COMM_WORLD);
+      const int error = MPI_Send(&message, 1, MPI_INT, node, MPI_COMPLETION_RESPONSE_TAG, MPI_COMM_WORLD);
       if (error != MPI_SUCCESS) {
 	HandleError(error, node);
       }
@@ -122,7 +262,23 @@ namespace slib {
       
     }
 
+    void JobController::HandleCompletion(const int& node) {
+      VLOG(1) << "Received a completion response from node: " << node;
+      SendCompletionResponse(node);
+
+      JobOutput output = JobNode::WaitForJobData(node);
+      // Wait for the job queued behind this one, if any.
+      _jobs_per_node[node]--;
+      if (_jobs_per_node[node] > 0) {
+	PostCompletionReceive(node);
+      }
+      if (_completion_handler != NULL) {
+	(*_completion_handler)(output, node);
+      }
+    }
+
     void JobController::CheckForCompletion() {
+      CompletePendingSends(false);
       for (RequestIterator iter = _request_handlers.begin(); iter != _request_handlers.end(); iter++) {
 	int flag;
 	MPI_Status status;
@@ -144,20 +300,93 @@ namespace slib {
 	}
 
 	if (flag == true) {
-	  const int node = iter->first;
-	  VLOG(1) << "Received a completion response from node: " << node;
-	  SendCompletionResponse(node);
+	  HandleCompletion(iter->first);
+	}
+      }
+    }
 
-	  JobOutput output = JobNode::WaitForJobData(node);
-	  if (_completion_handler != NULL) {
-	    (*_completion_handler)(output, node);
-	  }
+    int JobController::WaitForCompletion() {
+      CompletePendingSends(false);
+      vector<int> nodes;
+      vector<MPI_Request> requests;
+      for (RequestIterator iter = _request_handlers.begin(); iter != _request_handlers.end(); iter++) {
+	if (iter->second != MPI_REQUEST_NULL) {
+	  nodes.push_back(iter->first);
+	  requests.push_back(iter->second);
 	}
       }
+      if (requests.size() == 0) {
+	return 0;
+      }
+
+      int num_completed = 0;
+      vector<int> completed(requests.size());
+      vector<MPI_Status> statuses(requests.size());
+      const int state = MPI_Waitsome((int) requests.size(), &requests[0], &num_completed,
+				     &completed[0], &statuses[0]);
+      // Completed requests were set to MPI_REQUEST_NULL by MPI.
+      for (int i = 0; i < (int) nodes.size(); i++) {
+	_request_handlers[nodes[i]] = requests[i];
+      }
+
+      if (state != MPI_SUCCESS && state != MPI_ERR_IN_STATUS) {
+	LOG(ERROR) << "Communication error while waiting for completion";
+	PrintMPICommunicationError(state);
+	return 0;
+      }
+      if (num_completed == MPI_UNDEFINED) {
+	return 0;
+      }
+
+      for (int i = 0; i < num_completed; i++) {
+	const int node = nodes[completed[i]];
+	if (state == MPI_ERR_IN_STATUS && statuses[i].MPI_ERROR != MPI_SUCCESS) {
+	  LOG(ERROR) << "Communication error with node: " << node;
+	  _jobs_per_node.erase(node);
+	  PrintMPICommunicationError(statuses[i].MPI_ERROR);
+	  HandleError(statuses[i].MPI_ERROR, node);
+	  continue;
+	}
+	HandleCompletion(node);
+      }
+
+      return num_completed;
+    }
+
+    int JobController::GetNumberOfPendingJobs() const {
+      int pending = 0;
+      for (map<int, MPI_Request>::const_iterator iter = _request_handlers.begin(); 
+	   iter != _request_handlers.end(); iter++) {
+	if (iter->second != MPI_REQUEST_NULL) {
+	  pending++;
+	}
+      }
+      return pending;
+    }
+
+    int JobController::GetNumberOfJobsOnNode(const int& node) const {
+      const map<int, int>::const_iterator iter = _jobs_per_node.find(node);
+      return iter == _jobs_per_node.end() ? 0 : iter->second;
     }
 
     void JobController::StartJobOnNode(const JobDescription& description, const int& node,
 				       const map<string, VariableType>& variable_types) {
+      if (_completion_handler != NULL && GetNumberOfJobsOnNode(node) > 0) {
+	// The node is busy, so don't wait for it to receive the job.
+	PendingSend* pending = new PendingSend;
+	pending->node = node;
+	JobNode::PackJobData(description, variable_types, &pending->messages);
+	const int error = JobNode::SendJobMessagesToNode(pending->messages, node, &pending->requests);
+	_pending_sends.push_back(pending);
+	if (error != MPI_SUCCESS) {
+	  HandleError(error, node);
+	  return;
+	}
+	VLOG(1) << "Queued job behind " << _jobs_per_node[node] << " on node: " << node;
+	_jobs_per_node[node]++;
+	return;
+      }
+
       // Send the job description over.
       const int error = JobNode::SendJobDataToNode(description, node, variable_types);
       if (error != MPI_SUCCESS) {
@@ -167,27 +396,31 @@ namespace slib {
 
       // Setup the handler
       if (_completion_handler != NULL) {
-	// Check to see if we are already waiting on this node for something.
-	RequestIterator iter = _request_handlers.find(node);
-	if (iter != _request_handlers.end() && iter->second != MPI_REQUEST_NULL) {
-	  LOG(ERROR) << "You cannot start more than one job on a single node";
-	  return;
-	}
+	_jobs_per_node[node] = 1;
+	PostCompletionReceive(node);
+      }
+    }
 
-	// Allocate space for the completion status and the request handler.
-	if (iter == _request_handlers.end()) {
-	  // We really shouldn't set this variable to anything, but
-	  // compilers issue a warning if we don't :(.
-	  MPI_Request request_handler = -1;  
-	  _request_handlers[node] = request_handler;
-	}
+    void JobController::PostCompletionReceive(const int& node) {
+      // Check to see if we are already waiting on this node for something.
+      RequestIterator iter = _request_handlers.find(node);
+      if (iter != _request_handlers.end() && iter->second != MPI_REQUEST_NULL) {
+	return;
+      }
 
-	// Asynchronously receive a completion response from the node.
-	const int error = MPI_Irecv(&_completion_status, 1, MPI_INT, 
-				    node, MPI_COMPLETION_TAG, MPI_COMM_WORLD, &_request_handlers[node]);
-	if (error != MPI_SUCCESS) {
-	  HandleError(error, node);
-	}
+      // Allocate space for the completion status and the request handler.
+      if (iter == _request_handlers.end()) {
+	// We really shouldn't set this variable to anything, but
+	// compilers issue a warning if we don't :(.
+	MPI_Request request_handler = -1;  
+	_request_handlers[node] = request_handler;
+      }
+
+      // Asynchronously receive a completion response from the node.
+      const int error = MPI_Irecv(&_completion_status, 1, MPI_INT, 
+				  node, MPI_COMPLETION_TAG, MPI_COMM_WORLD, &_request_handlers[node]);
+      if (error != MPI_SUCCESS) {
+	HandleError(error, node);
       }
     }
 
@@ -198,7 +431,7 @@ namespace slib {
     int JobNode::WaitForCompletionResponse(const int& node) {
       CheckInitialized();
       int message;
-      return MPI_Recv(&message, 1, MPI_INT, node, MPI_COMPLETION_TAG + 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      return MPI_Recv(&message, 1, MPI_INT, node, MPI_COMPLETION_RESPONSE_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
     }
 
     int JobNode::SendStringToNode(const string& message, const int& node) {
@@ -226,205 +459,399 @@ namespace slib {
       return string(message_c.get());
     }
 
-    int JobNode::SendJobDataToNode(const JobData& data, const int& node,
-				   const map<string, VariableType>& variable_types) {
-      CheckInitialized();
-      // Send the command.
-      int error = SendStringToNode(data.command, node);
-      if (error != MPI_SUCCESS) {
-	return error;
+    void JobNode::PackJobData(const JobData& data, const map<string, VariableType>& variable_types,
+			      JobMessages* messages) {
+      TraceSpan span("PackJobData", data.indices);
+      // The header holds everything but the variables themselves so
+      // that the receiver can size the payload from it: the command,
+      // the indices and the name and byte length of each variable.
+      string header;
+      AppendString(data.command, &header);
+      AppendInt((int) data.indices.size(), &header);
+      for (int i = 0; i < (int) data.indices.size(); i++) {
+	AppendInt(data.indices[i], &header);
       }
 
-      // Send information about the number of indices and then send
-      // over the actual indices.
-      {
-	int num_indices = data.indices.size();
-	scoped_array<int> indices(new int[num_indices]);
-	for (int i = 0; i < num_indices; i++) {
-	  indices[i] = data.indices[i];
-	}
-	error = MPI_Send(&num_indices, 1, MPI_INT, node, 0, MPI_COMM_WORLD);
-	if (error != MPI_SUCCESS) {
-	  return error;
-	}
-	error = MPI_Send(indices.get(), num_indices, MPI_INT, node, 0, MPI_COMM_WORLD);
-	if (error != MPI_SUCCESS) {
-	  return error;
-	}
-      }
+      // The receiver needs to know how the payload is split up.
+      AppendInt(_max_message_bytes, &header);
 
-      // Now we send num_variables worth of string.length information for
-      // the variable names (which are the keys in the
-      // data.variables map). We also send the byte lengths for
-      // each input.
+      // The variable names are the keys in the data.variables map. The
+      // byte lengths are 64-bit as variables can be larger than 2GB. A
+      // compressed variable also has the length it decompresses to.
       int num_variables = data.variables.size();
-      vector<string> serialized_variables;
-      int total_bytes = 0;
-      error = MPI_Send(&num_variables, 1, MPI_INT, node, 0, MPI_COMM_WORLD);
-      if (error != MPI_SUCCESS) {
-	return error;
-      }
+      vector<boost::shared_ptr<const string> > serialized_variables;
+      AppendInt(num_variables, &header);
 
       for (map<string, MatlabMatrix>::const_iterator it = data.variables.begin(); 
 	   it != data.variables.end(); 
 	   it++) {
 	const string input_name = (*it).first;
-	error = SendStringToNode(input_name, node);
-	if (error != MPI_SUCCESS) {
-	  return error;
-	}
+	AppendString(input_name, &header);
 
 	const MatlabMatrix& matrix = (*it).second;
-	string serialized = "";
-	if ((matrix.GetMatrixType() == slib::util::MATLAB_CELL_ARRAY
-	     || matrix.GetMatrixType() == slib::util::MATLAB_STRUCT)
-	    && variable_types.find(input_name) != variable_types.end()
-	    && variable_types.find(input_name)->second != COMPLETE_VARIABLE) {
+	const map<string, VariableType>::const_iterator type_iter = variable_types.find(input_name);
+	const map<string, boost::shared_ptr<const string> >::const_iterator serialized_iter 
+	  = data.serialized_variables.find(input_name);
+	const bool partial = type_iter != variable_types.end() 
+	  && (type_iter->second & (PARTIAL_VARIABLE_ROWS | PARTIAL_VARIABLE_COLS));
+	const bool compress = (type_iter != variable_types.end() && (type_iter->second & COMPRESSED_VARIABLE))
+	  || (data.GetVariableType(input_name) & COMPRESSED_VARIABLE);
+	const double start_time = MPI_Wtime();
+	boost::shared_ptr<const string> serialized;
+	if (partial && !matrix.HasStructField(MPIJOB_SLICED_VARIABLE_FIELD)) {
 	  VLOG(1) << "Found partial input: " << input_name;
-
-	  vector<int> indices = data.indices;
-	  sort(indices.begin(), indices.end());
-
-	  const VariableType type = variable_types.find(input_name)->second;
-	  if (type == PARTIAL_VARIABLE_ROWS) {
-	    MatlabMatrix partial(matrix.GetMatrixType(), matrix.GetDimensions());
-	    for (int index = 0; index < (int) indices.size(); index++) {
-	      const int row = indices[index];
-	      for (int col = 0; col < matrix.GetDimensions().y; col++) {
-		partial.Set(row, col, matrix.Get(row, col));
-	      }
-	    }
-	    serialized = partial.Serialize();
-	  } else if (type == PARTIAL_VARIABLE_COLS) {
-	    MatlabMatrix partial(matrix.GetMatrixType(), matrix.GetDimensions());
-	    for (int index = 0; index < (int) indices.size(); index++) {
-	      const int col = indices[index];
-	      for (int row = 0; row < matrix.GetDimensions().x; row++) {
-		partial.Set(row, col, matrix.Get(row, col));
-	      }
-	    }
-	    serialized = partial.Serialize();
-	  }
+	  string* bytes = new string();
+	  SliceVariable(matrix, (VariableType) (type_iter->second & ~COMPRESSED_VARIABLE), 
+			data.indices).SerializeTo(bytes);
+	  serialized.reset(bytes);
+	} else if (serialized_iter != data.serialized_variables.end()) {
+	  serialized = serialized_iter->second;
 	} else {
-	  serialized = matrix.Serialize();
+	  string* bytes = new string();
+	  matrix.SerializeTo(bytes);
+	  serialized.reset(bytes);
 	}
-	int byte_length = serialized.length();
-	error = MPI_Send(&byte_length, 1, MPI_INT, node, 0, MPI_COMM_WORLD);
-	if (error != MPI_SUCCESS) {
-	  return error;
+	_statistics.serialization_seconds += MPI_Wtime() - start_time;
+
+	bool compressed = false;
+	if (compress && (long long) serialized->length() >= _compression_threshold) {
+	  const long long uncompressed_length = serialized->length();
+	  serialized = CompressVariable(serialized, serialized_iter != data.serialized_variables.end(), &compressed);
+	  if (compressed) {
+	    _statistics.uncompressed_bytes += uncompressed_length;
+	    _statistics.compressed_bytes += serialized->length();
+	    AppendInt(MPIJOB_CODEC_ZLIB, &header);
+	    AppendLongLong(uncompressed_length, &header);
+	  }
+	}
+	if (!compressed) {
+	  AppendInt(MPIJOB_CODEC_NONE, &header);
 	}
-	
 	serialized_variables.push_back(serialized);
-	total_bytes += byte_length;
+	AppendLongLong((long long) serialized->length(), &header);
       }
-	
-      // Now comes the big boys. We have to send over the arbitrarily
-      // complicated Matlab Matrices thanks to some external
-      // dependencies and our avoidance of using the filesystem. These
-      // Sends, however, are done asynchronously as they may take a
-      // while to complete and we don't want to block on anything else
+      messages->AddBytes(header, MPI_JOB_HEADER_TAG);
 
-      // Copy the serialized strings into one big buffer.
-      scoped_array<char> serialized_variables_cstr(new char[total_bytes]);
-      int byte_offset = 0;
-      for (int i = 0; i < num_variables; i++) {
-	const int byte_length = serialized_variables[i].length();
-	memcpy(serialized_variables_cstr.get() + byte_offset, serialized_variables[i].c_str(), byte_length);
-	byte_offset += byte_length;
+      // Now comes the big boys: the arbitrarily complicated Matlab
+      // Matrices, back to back in as few messages as possible that are
+      // sent from their own buffers.
+      if (num_variables > 0) {
+	messages->AddBytes(serialized_variables, MPI_JOB_PAYLOAD_TAG, _max_message_bytes);
       }
+    }
 
-      scoped_array<MPI_Request> request_handlers(new MPI_Request[num_variables]);
-      VLOG(1) << "Sending " << num_variables << " variables to node: " << node;
-      // Allocate a buffer big enough for all of the variables.
-      byte_offset = 0;
-      for (int i = 0; i < num_variables; i++) {
-	const int byte_length = serialized_variables[i].length();
-	error = MPI_Isend(serialized_variables_cstr.get() + byte_offset, byte_length, MPI_CHAR, 
-			  node, i, MPI_COMM_WORLD, &request_handlers[i]);
-	if (error != MPI_SUCCESS) {
-	  return error;
+    boost::shared_ptr<const string> JobNode::CompressVariable(const boost::shared_ptr<const string>& bytes, 
+							     const bool& reused, bool* compressed) {
+      // Drop the variables of jobs that are gone.
+      for (map<boost::shared_ptr<const string>, boost::shared_ptr<const string> >::iterator iter 
+	     = _compressed_variables.begin(); iter != _compressed_variables.end(); ) {
+	if (iter->first.use_count() == 1) {
+	  _compressed_variables.erase(iter++);
+	} else {
+	  iter++;
 	}
-	byte_offset += byte_length;
       }
-      // Wait for them all to finish.
-      scoped_array<MPI_Status> request_statuses(new MPI_Status[num_variables]);
-      for (int i = 0; i < num_variables; i++) {
-	error = MPI_Wait(&request_handlers[i], &request_statuses[i]);
+      if (reused) {
+	const map<boost::shared_ptr<const string>, boost::shared_ptr<const string> >::const_iterator iter 
+	  = _compressed_variables.find(bytes);
+	if (iter != _compressed_variables.end()) {
+	  *compressed = (iter->second != bytes);
+	  return iter->second;
+	}
+      }
+
+      const double start_time = MPI_Wtime();
+      uLongf length = compressBound(bytes->length());
+      scoped_array<char> buffer(new char[length]);
+      const int error = compress2(reinterpret_cast<Bytef*>(buffer.get()), &length, 
+				  reinterpret_cast<const Bytef*>(bytes->data()), bytes->length(), Z_BEST_SPEED);
+      _statistics.compression_seconds += MPI_Wtime() - start_time;
+
+      boost::shared_ptr<const string> result = bytes;
+      if (error != Z_OK) {
+	LOG(WARNING) << "Could not compress a variable (zlib error: " << error << ")";
+      } else if (length < bytes->length()) {
+	result.reset(new string(buffer.get(), length));
+      }
+      if (reused) {
+	_compressed_variables[bytes] = result;
+      }
+      *compressed = (result != bytes);
+      return result;
+    }
+
+    int JobNode::SendJobMessagesToNode(const JobMessages& messages, const int& node,
+				       vector<MPI_Request>* requests) {
+      CheckInitialized();
+      for (int i = 0; i < (int) messages.segments.size(); i++) {
+	const vector<pair<const char*, int> >& segments = messages.segments[i];
+	MPI_Request request;
+	int error;
+	if (segments.size() == 1) {
+	  error = MPI_Isend(const_cast<char*>(segments[0].first), segments[0].second, MPI_CHAR, 
+			    node, messages.tags[i], MPI_COMM_WORLD, &request);
+	} else {
+	  // The datatype is made of the absolute addresses of the
+	  // pieces, so the message is sent from MPI_BOTTOM. MPI keeps
+	  // the datatype around until the send is done.
+	  vector<int> lengths(segments.size());
+	  vector<MPI_Aint> addresses(segments.size());
+	  for (int j = 0; j < (int) segments.size(); j++) {
+	    lengths[j] = segments[j].second;
+	    MPI_Get_address(const_cast<char*>(segments[j].first), &addresses[j]);
+	  }
+	  MPI_Datatype datatype;
+	  MPI_Type_create_hindexed((int) segments.size(), &lengths[0], &addresses[0], MPI_CHAR, &datatype);
+	  MPI_Type_commit(&datatype);
+	  error = MPI_Isend(MPI_BOTTOM, 1, datatype, node, messages.tags[i], MPI_COMM_WORLD, &request);
+	  MPI_Type_free(&datatype);
+	}
 	if (error != MPI_SUCCESS) {
 	  return error;
 	}
-	VLOG(1) << "Variable " << i << " of " << num_variables << " sent to node: " << node;
+	requests->push_back(request);
+	for (int j = 0; j < (int) segments.size(); j++) {
+	  _statistics.bytes_sent[node] += segments[j].second;
+	}
       }
-
       return MPI_SUCCESS;
     }
 
+    MatlabMatrix JobNode::SliceVariable(const MatlabMatrix& matrix, const VariableType& type,
+					const vector<int>& indices) {
+      const bool rows = (type == PARTIAL_VARIABLE_ROWS);
+      const Pair<int> dimensions = matrix.GetDimensions();
+      const int length = rows ? dimensions.x : dimensions.y;
+      const int width = rows ? dimensions.y : dimensions.x;
+
+      vector<int> sliced_indices;
+      for (int i = 0; i < (int) indices.size(); i++) {
+	if (indices[i] >= 0 && indices[i] < length) {
+	  sliced_indices.push_back(indices[i]);
+	} else {
+	  VLOG(1) << "Index " << indices[i] << " is outside of the partial variable (length: " << length << ")";
+	}
+      }
+      const int count = sliced_indices.size();
+
+      // Numeric matrices are read entry by entry; Get() would copy
+      // the whole matrix every time.
+      MatlabMatrix slice;
+      if (matrix.GetMatrixType() == slib::util::MATLAB_MATRIX) {
+	FloatMatrix contents(rows ? count : width, rows ? width : count);
+	for (int i = 0; i < count; i++) {
+	  for (int j = 0; j < width; j++) {
+	    if (rows) {
+	      contents(i, j) = matrix.GetMatrixEntry(sliced_indices[i], j);
+	    } else {
+	      contents(j, i) = matrix.GetMatrixEntry(j, sliced_indices[i]);
+	    }
+	  }
+	}
+	slice = MatlabMatrix(contents);
+      } else {
+	slice = MatlabMatrix(matrix.GetMatrixType(), rows ? count : width, rows ? width : count);
+	for (int i = 0; i < count; i++) {
+	  for (int j = 0; j < width; j++) {
+	    if (rows) {
+	      slice.Set(i, j, matrix.Get(sliced_indices[i], j));
+	    } else {
+	      slice.Set(j, i, matrix.Get(j, sliced_indices[i]));
+	    }
+	  }
+	}
+      }
+
+      vector<int> shape;
+      shape.push_back(dimensions.x);
+      shape.push_back(dimensions.y);
+      shape.push_back(rows ? 1 : 0);
+
+      MatlabMatrix sliced(slib::util::MATLAB_STRUCT, Pair<int>(1, 1));
+      sliced.SetStructField(MPIJOB_SLICED_VARIABLE_FIELD, slice);
+      sliced.SetStructField("indices", MatlabMatrix(sliced_indices));
+      sliced.SetStructField("shape", MatlabMatrix(shape));
+
+      return sliced;
+    }
+
+    bool JobNode::UnsliceVariable(MatlabMatrix* matrix, VariableType* type) {
+      if (!matrix->HasStructField(MPIJOB_SLICED_VARIABLE_FIELD)) {
+	return false;
+      }
+
+      const MatlabMatrix slice = matrix->GetStructField(MPIJOB_SLICED_VARIABLE_FIELD);
+      const MatlabMatrix indices = matrix->GetStructField("indices");
+      const MatlabMatrix shape = matrix->GetStructField("shape");
+      const Pair<int> dimensions((int) shape.GetMatrixEntry(0), (int) shape.GetMatrixEntry(1));
+      const bool rows = shape.GetMatrixEntry(2) != 0.0f;
+      const int count = indices.GetNumberOfElements();
+      const int width = rows ? dimensions.y : dimensions.x;
+
+      MatlabMatrix full;
+      if (slice.GetMatrixType() == slib::util::MATLAB_MATRIX) {
+	FloatMatrix contents = FloatMatrix::Zero(dimensions.x, dimensions.y);
+	for (int i = 0; i < count; i++) {
+	  const int index = (int) indices.GetMatrixEntry(i);
+	  for (int j = 0; j < width; j++) {
+	    if (rows) {
+	      contents(index, j) = slice.GetMatrixEntry(i, j);
+	    } else {
+	      contents(j, index) = slice.GetMatrixEntry(j, i);
+	    }
+	  }
+	}
+	full = MatlabMatrix(contents);
+      } else {
+	full = MatlabMatrix(slice.GetMatrixType(), dimensions);
+	for (int i = 0; i < count; i++) {
+	  const int index = (int) indices.GetMatrixEntry(i);
+	  for (int j = 0; j < width; j++) {
+	    if (rows) {
+	      full.Set(index, j, slice.Get(i, j));
+	    } else {
+	      full.Set(j, index, slice.Get(j, i));
+	    }
+	  }
+	}
+      }
+
+      matrix->Swap(full);
+      if (type != NULL) {
+	*type = rows ? PARTIAL_VARIABLE_ROWS : PARTIAL_VARIABLE_COLS;
+      }
+      return true;
+    }
+
+    int JobNode::SendJobDataToNode(const JobData& data, const int& node,
+				   const map<string, VariableType>& variable_types) {
+      CheckInitialized();
+      TraceSpan span("SendJobDataToNode", data.indices);
+      JobMessages messages;
+      PackJobData(data, variable_types, &messages);
+
+      // The sends are done asynchronously as they may take a while to
+      // complete, but we wait for them all to finish so the buffers
+      // can be released.
+      vector<MPI_Request> requests;
+      VLOG(1) << "Sending " << data.variables.size() << " variables to node: " << node;
+      int error = SendJobMessagesToNode(messages, node, &requests);
+      if (error == MPI_SUCCESS && requests.size() > 0) {
+	error = MPI_Waitall((int) requests.size(), &requests[0], MPI_STATUSES_IGNORE);
+      }
+      return error;
+    }
+
     JobData JobNode::WaitForJobData(const int& node) {
       CheckInitialized();
+      TraceSpan span("WaitForJobData");
       // These routines match the sends above.
       JobData data;
 
-      // Receive the command.
-      data.command = WaitForString(node);
-
-      // Receive the number of indices and then the actual indices.
-      int num_indices;
-      MPI_Recv(&num_indices, 1, MPI_INT, node, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-      {
-	scoped_array<int> indices(new int[num_indices]);
-	MPI_Recv(indices.get(), num_indices, MPI_INT, node, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	for (int i = 0; i < num_indices; i++) {
-	  const int index = indices[i];
-	  data.indices.push_back(index);
-	}
+      // The header is the only message whose size is not known in
+      // advance.
+      MPI_Status status;
+      MPI_Probe(node, MPI_JOB_HEADER_TAG, MPI_COMM_WORLD, &status);
+      const int source = status.MPI_SOURCE;
+      int header_length;
+      MPI_Get_count(&status, MPI_CHAR, &header_length);
+      scoped_array<char> header(new char[header_length]);
+      MPI_Recv(header.get(), header_length, MPI_CHAR, source, MPI_JOB_HEADER_TAG, MPI_COMM_WORLD, 
+	       MPI_STATUS_IGNORE);
+
+      int offset = 0;
+      data.command = ReadString(header.get(), header_length, &offset);
+      const int num_indices = ReadInt(header.get(), header_length, &offset);
+      for (int i = 0; i < num_indices; i++) {
+	data.indices.push_back(ReadInt(header.get(), header_length, &offset));
       }
 
-      // Receive the list of input variable names along with their byte lengths.
-      int num_variables;
+      const int max_message_bytes = ReadInt(header.get(), header_length, &offset);
+
+      // The list of input variable names along with their byte lengths.
+      const int num_variables = ReadInt(header.get(), header_length, &offset);
       vector<string> input_names;
-      vector<int> input_byte_lengths;
-      int total_bytes = 0;
-      MPI_Recv(&num_variables, 1, MPI_INT, node, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      vector<long long> input_byte_lengths;
+      // The decompressed lengths of the compressed variables, or -1.
+      vector<long long> input_uncompressed_lengths;
+      long long total_bytes = 0;
       for (int i = 0; i < num_variables; i++) {
-	input_names.push_back(WaitForString(node));
-	int byte_length;
-	MPI_Recv(&byte_length, 1, MPI_INT, node, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	input_names.push_back(ReadString(header.get(), header_length, &offset));
+	const int codec = ReadInt(header.get(), header_length, &offset);
+	CHECK(codec == MPIJOB_CODEC_NONE || codec == MPIJOB_CODEC_ZLIB) 
+	  << "Unknown codec for variable " << input_names[i] << ": " << codec;
+	input_uncompressed_lengths.push_back(codec == MPIJOB_CODEC_ZLIB 
+					     ? ReadLongLong(header.get(), header_length, &offset) : -1);
+	const long long byte_length = ReadLongLong(header.get(), header_length, &offset);
 
 	VLOG(2) << "Expect Variable: " << input_names[i] << " (length: " << byte_length << ")";
 	input_byte_lengths.push_back(byte_length);
 	total_bytes += byte_length;
       }
       VLOG(2) << "Expecting a total of " << total_bytes << " bytes worth of variables";
+      _statistics.bytes_received[source] += header_length + total_bytes;
 
-      // Here is where the big data comes. We can handle the set of
-      // variables async, but we wait for them all to finish to ensure
-      // the JobData is complete.
-      scoped_array<MPI_Request> request_handlers(new MPI_Request[num_variables]);
-      // Allocate a buffer big enough for all of the variables.
-      scoped_array<char> serialized_variables(new char[total_bytes]);
-      int byte_offset = 0;
-      for (int i = 0; i < num_variables; i++) {
-	const int byte_length = input_byte_lengths[i];
-	MPI_Irecv(serialized_variables.get() + byte_offset, byte_length, MPI_CHAR, 
-		  node, i, MPI_COMM_WORLD, &request_handlers[i]);
-	byte_offset += byte_length;
+      if (num_variables == 0) {
+	return data;
       }
-      // Wait for them all to finish.
-      scoped_array<MPI_Status> request_statuses(new MPI_Status[num_variables]);
-      for (int i = 0; i < num_variables; i++) {
-	MPI_Wait(&request_handlers[i], &request_statuses[i]);
+
+      // Here is where the big data comes, all of the variables back to
+      // back in messages of max_message_bytes (the last one may be
+      // shorter). They are all posted at once and arrive in order.
+      scoped_array<char> serialized_variables(new char[total_bytes]);
+      const int num_messages = (int) ((total_bytes + max_message_bytes - 1) / max_message_bytes);
+      vector<MPI_Request> requests(num_messages);
+      for (int i = 0; i < num_messages; i++) {
+	const long long start = (long long) i * max_message_bytes;
+	const int length = (int) std::min((long long) max_message_bytes, total_bytes - start);
+	MPI_Irecv(serialized_variables.get() + start, length, MPI_CHAR, source, MPI_JOB_PAYLOAD_TAG, 
+		  MPI_COMM_WORLD, &requests[i]);
       }
 
-      // Now copy the variables into matrices.
-      byte_offset = 0;
+      // Now read the variables into matrices, straight from the
+      // receive buffer, each as soon as the messages it is in have
+      // arrived.
+      long long byte_offset = 0;
+      int received_messages = 0;
       for (int i = 0; i < num_variables; i++) {
 	const string input_name = input_names[i];
-	const int byte_length = input_byte_lengths[i];
-	const string serialized_input(serialized_variables.get() + byte_offset, byte_length);
-	VLOG(2) << "Read " << serialized_input.length() << " bytes (actual: " << byte_length << ")";
+	const long long byte_length = input_byte_lengths[i];
+	while (received_messages < num_messages 
+	       && (long long) received_messages * max_message_bytes < byte_offset + byte_length) {
+	  MPI_Wait(&requests[received_messages], MPI_STATUS_IGNORE);
+	  received_messages++;
+	}
+
+	// Compressed variables are only deserialized from a buffer of
+	// their own.
+	const long long uncompressed_length = input_uncompressed_lengths[i];
+	scoped_array<char> uncompressed;
+	if (uncompressed_length >= 0) {
+	  const double start_time = MPI_Wtime();
+	  uncompressed.reset(new char[uncompressed_length]);
+	  uLongf length = uncompressed_length;
+	  const int error = uncompress(reinterpret_cast<Bytef*>(uncompressed.get()), &length, 
+				       reinterpret_cast<const Bytef*>(serialized_variables.get() + byte_offset), 
+				       byte_length);
+	  CHECK(error == Z_OK && (long long) length == uncompressed_length) 
+	    << "Could not decompress variable " << input_name << " (zlib error: " << error << ")";
+	  _statistics.decompression_seconds += MPI_Wtime() - start_time;
+	}
 
+	const double start_time = MPI_Wtime();
 	MatlabMatrix matrix;
-	matrix.Deserialize(serialized_input);
+	const long long int bytes_read = uncompressed_length >= 0 ? matrix.Deserialize(uncompressed.get())
+	  : matrix.Deserialize(serialized_variables.get(), byte_offset);
+	VLOG(2) << "Read " << bytes_read << " bytes (actual: " << byte_length << ")";
+	VariableType type;
+	if (UnsliceVariable(&matrix, &type)) {
+	  data.variable_types[input_name] = type;
+	}
+	// Passed on compressed as well (see Cesium::SubMasterLoop).
+	if (uncompressed_length >= 0) {
+	  data.variable_types[input_name] = (VariableType) (data.GetVariableType(input_name) | COMPRESSED_VARIABLE);
+	}
+	_statistics.deserialization_seconds += MPI_Wtime() - start_time;
 	data.variables[input_name] = matrix;
 
 	byte_offset += byte_length;
@@ -433,12 +860,52 @@ namespace slib {
       return data;
     }
 
+    TransferStatistics& JobNode::GetTransferStatistics() {
+      return _statistics;
+    }
+
+    void JobNode::SetMaxMessageBytes(const int& bytes) {
+      CHECK_GT(bytes, 0);
+      _max_message_bytes = bytes;
+    }
+
+    void JobNode::SetCompressionThreshold(const long long& bytes) {
+      _compression_threshold = bytes;
+    }
+
     int JobNode::SendCompletionMessage(const int& node) {
       CheckInitialized();
       int message = 1;
       return MPI_Send(&message, 1, MPI_INT, node, MPI_COMPLETION_TAG, MPI_COMM_WORLD);
     }
 
+    int JobNode::SendHeartbeat(const vector<int>& running_indices, const int& node) {
+      CheckInitialized();
+      // The count goes along so that an empty list is still a message.
+      vector<int> message(1, (int) running_indices.size());
+      message.insert(message.end(), running_indices.begin(), running_indices.end());
+      return MPI_Send(&message[0], (int) message.size(), MPI_INT, node, MPI_HEARTBEAT_TAG, MPI_COMM_WORLD);
+    }
+
+    bool JobNode::ReceiveHeartbeat(int* node, vector<int>* running_indices) {
+      CheckInitialized();
+      int flag = 0;
+      MPI_Status status;
+      MPI_Iprobe(MPI_ANY_SOURCE, MPI_HEARTBEAT_TAG, MPI_COMM_WORLD, &flag, &status);
+      if (!flag) {
+	return false;
+      }
+
+      int count;
+      MPI_Get_count(&status, MPI_INT, &count);
+      vector<int> message(std::max(count, 1));
+      MPI_Recv(&message[0], count, MPI_INT, status.MPI_SOURCE, MPI_HEARTBEAT_TAG, MPI_COMM_WORLD, 
+	       MPI_STATUS_IGNORE);
+      *node = status.MPI_SOURCE;
+      running_indices->assign(message.begin() + 1, message.end());
+      return true;
+    }
+
     bool JobNode::CheckInitialized() {
       if (_initialized) {
 	return true;
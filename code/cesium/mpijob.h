@@ -3,17 +3,37 @@
 #ifndef __SLIB_UTIL_MPI_H__
 #define __SLIB_UTIL_MPI_H__
 
+#include <boost/shared_ptr.hpp>
+#include <list>
 #include <map>
 #include <mpi.h>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define MPI_ROOT_NODE 0
 #define MPI_COMPLETION_TAG 1025
 #define MPI_STRING_MESSAGE_TAG 1026
+// Must differ from MPI_STRING_MESSAGE_TAG: a node may already have
+// the next job queued when the response arrives.
+#define MPI_COMPLETION_RESPONSE_TAG 1027
+#define MPI_HEARTBEAT_TAG 1028
+// A job goes over as one header message (the command, the indices
+// and the names and byte lengths of the variables) followed by one
+// message with the bytes of all of its variables.
+#define MPI_JOB_HEADER_TAG 1029
+#define MPI_JOB_PAYLOAD_TAG 1030
+// The pieces of the variables the master broadcasts to the idle nodes
+// when a job starts, which each node passes on to the next ones.
+#define MPI_BROADCAST_TAG 1031
 
 #define MPIJOB_COMPLETE_VARIABLE_BITMASK 3
 #define MPIJOB_CACHED_VARIABLE_BITMASK 10
+#define MPIJOB_SHARED_VARIABLE_BITMASK 11
+
+// The field of the struct that JobNode::SliceVariable packs the
+// selected rows or columns of a partial variable into.
+#define MPIJOB_SLICED_VARIABLE_FIELD "__MPIJOB_SLICED_VARIABLE__"
 
 namespace slib {
   namespace util {
@@ -37,9 +57,22 @@ namespace slib {
       // format that dswork expects. Note that only column vectors can
       // be saved in this special way.
       DSWORK_COLUMN = 1 << 5,
+      // An output that is appended to an on-disk store (see
+      // OutputStore) as each batch completes instead of being kept
+      // in memory by the master until the job finishes.
+      STREAMED_VARIABLE = 1 << 6,
+      // Compressed (with zlib) when it is sent, if it is at least
+      // cesium_compression_threshold bytes. Worth it for sparse
+      // matrices and cells of small structs on slow networks. Can
+      // safely be OR'ed with all other types.
+      COMPRESSED_VARIABLE = 1 << 7,
       // Indicates that this variable should be cached. Can safely be
       // OR'ed with all other types.
-      CACHED_VARIABLE = 1 << MPIJOB_CACHED_VARIABLE_BITMASK
+      CACHED_VARIABLE = 1 << MPIJOB_CACHED_VARIABLE_BITMASK,
+      // A large, read-only variable that is only sent to one node per
+      // host. The other nodes on that host read it from shared
+      // memory. Implies CACHED_VARIABLE.
+      SHARED_VARIABLE = 1 << MPIJOB_SHARED_VARIABLE_BITMASK
     };
 
     struct JobData {
@@ -48,6 +81,11 @@ namespace slib {
 
       std::map<std::string, slib::util::MatlabMatrix> variables;
       std::map<std::string, VariableType> variable_types;
+      // The serialized bytes of variables that stay the same for
+      // every batch of a job, by name. When a variable is sent, these
+      // are used (and shared, not copied) instead of serializing it
+      // again for every node.
+      std::map<std::string, boost::shared_ptr<const std::string> > serialized_variables;
 
       // These two methods are exactly the same.
       const slib::util::MatlabMatrix& GetVariable(const std::string& name) const; 
@@ -65,9 +103,68 @@ namespace slib {
 	indices.clear();
 	variables.clear();
 	variable_types.clear();
+	serialized_variables.clear();
       }
     };
 
+    // A JobData flattened into the MPI messages that transfer it, in
+    // the order they are sent: the header on MPI_JOB_HEADER_TAG and,
+    // if the job has any variables, the payload on
+    // MPI_JOB_PAYLOAD_TAG, split into as many messages as it takes to
+    // keep each one under the maximum message size. Built by
+    // JobNode::PackJobData so that the same messages can be sent
+    // either blocking or asynchronously.
+    struct JobMessages {
+      // The buffers the messages are sent from. They are kept alive
+      // here until the sends are done.
+      std::vector<boost::shared_ptr<const std::string> > buffers;
+      // The (start, length) pieces of the buffers that make up each
+      // message, back to back.
+      std::vector<std::vector<std::pair<const char*, int> > > segments;
+      std::vector<int> tags;
+
+      void AddBytes(const std::string& bytes, const int& tag);
+      // Sends the bytes without copying them.
+      void AddBytes(const boost::shared_ptr<const std::string>& bytes, const int& tag);
+      // Sends the buffers back to back, straight from where they are
+      // (see JobNode::SendJobMessagesToNode), in messages of at most
+      // max_message_bytes each.
+      void AddBytes(const std::vector<boost::shared_ptr<const std::string> >& parts, const int& tag,
+		    const int& max_message_bytes);
+    };
+
+    // What this process has sent to and received from each other
+    // node through JobNode, in bytes, and the time it spent
+    // serializing and deserializing variables for that. Only the
+    // thread that makes the MPI calls updates it.
+    struct TransferStatistics {
+      std::map<int, long long> bytes_sent;
+      std::map<int, long long> bytes_received;
+      double serialization_seconds;
+      double deserialization_seconds;
+      // The bytes of the COMPRESSED_VARIABLEs sent before and after
+      // compressing them, and the time spent compressing them and
+      // decompressing the ones received.
+      long long uncompressed_bytes;
+      long long compressed_bytes;
+      double compression_seconds;
+      double decompression_seconds;
+
+      TransferStatistics() 
+	: serialization_seconds(0.0)
+	, deserialization_seconds(0.0)
+	, uncompressed_bytes(0)
+	, compressed_bytes(0)
+	, compression_seconds(0.0)
+	, decompression_seconds(0.0) {}
+
+      long long GetTotalBytesSent() const;
+      long long GetTotalBytesReceived() const;
+      // How many times smaller the compressed variables were on the
+      // wire (1 if none were sent).
+      double GetCompressionRatio() const;
+    };
+
     struct JobQueue {
 #if 0
       std::vector<MPI_Request> requests;
@@ -85,6 +182,9 @@ namespace slib {
     class JobController {
     public:
       JobController();
+      // Blocks until every job that was queued on a busy node has
+      // been handed over.
+      virtual ~JobController();
 
       // You should almost always set a completion handler or jobs may
       // never actually complete correctly. In some cases you can omit
@@ -100,32 +200,69 @@ namespace slib {
       void SetCommunicationErrorHandler(CommunicationErrorHandler handler);
 
       // Starts a job on the specified node. Non-blocking. 
-      void StartJobOnNode(const JobDescription& description, const int& node,
-			  const std::map<std::string, VariableType>& variable_types);
+      //
+      // If the node is still running a previous job, the new job is
+      // sent asynchronously and queued behind it: the node can
+      // receive it while it computes and start it as soon as the
+      // current job is done. Completions are reported in the order
+      // the jobs were started.
+      virtual void StartJobOnNode(const JobDescription& description, const int& node,
+				  const std::map<std::string, VariableType>& variable_types);
       // Almost always use this method unless you know what you're
       // doing and understand VariableTypes.
       inline void StartJobOnNode(const JobDescription& description, const int& node) {
 	StartJobOnNode(description, node, std::map<std::string, VariableType>());
       }
 
-      // You have to run this method periodically to have the
-      // CompletionHandler method called appropriately.
-      //
-      // TODO(sarietta): This shouldn't be necessary, but without
-      // spawning a new thread to poll MPI it must remain this way.
-      void CheckForCompletion();
+      // Non-blocking check of every outstanding job. The
+      // CompletionHandler is called for each job that has completed.
+      virtual void CheckForCompletion();
 
-      void CancelPendingRequests();
+      // Blocks (via MPI_Waitsome) until at least one outstanding job
+      // completes and calls the CompletionHandler for every job that
+      // completed in the meantime. Returns the number of completed
+      // jobs, or 0 immediately if there were no outstanding jobs.
+      virtual int WaitForCompletion();
 
-    private:
+      // The number of nodes with jobs started via StartJobOnNode that
+      // have not completed yet.
+      virtual int GetNumberOfPendingJobs() const;
+      // The number of jobs started on the node that have not
+      // completed yet (including queued ones).
+      virtual int GetNumberOfJobsOnNode(const int& node) const;
+
+      virtual void CancelPendingRequests();
+
+    protected:
       CompletionHandler _completion_handler;
       CommunicationErrorHandler _error_handler;
+
+    private:
       std::map<int, MPI_Request> _request_handlers;
+      std::map<int, int> _jobs_per_node;
       int _completion_status;
+
+      // Jobs sent to busy nodes whose messages have not been fully
+      // handed to MPI yet. The buffers must stay alive until then.
+      struct PendingSend {
+	int node;
+	JobMessages messages;
+	std::vector<MPI_Request> requests;
+      };
+      std::list<PendingSend*> _pending_sends;
+      // Frees the pending sends that have completed. If wait is true,
+      // blocks until all of them have.
+      void CompletePendingSends(const bool& wait);
+      // Posts the receive for the next completion message from the
+      // node.
+      void PostCompletionReceive(const int& node);
       MPI_Errhandler _error_handler_mpi;
 
       static void PrintMPICommunicationError(const int& state);
       void HandleError(const int& error, const int& node);
+      // Acknowledges the completion message from the node, receives
+      // its output and hands it to the CompletionHandler.
+      void HandleCompletion(const int& node);
 
       // When a node completes, it should send a completion message
       // via SendCompletionMessage. The master receives this message
@@ -165,6 +302,35 @@ namespace slib {
       }
       static int SendStringToNode(const std::string& message, const int& node);
 
+      // Flattens the job into the messages SendJobDataToNode sends
+      // (and WaitForJobData expects).
+      static void PackJobData(const JobData& data, const std::map<std::string, VariableType>& variable_types,
+			      JobMessages* messages);
+      // Starts sending the messages without waiting for them. The
+      // messages must stay alive until all of the requests complete. A
+      // message of several pieces is described to MPI as one derived
+      // datatype over them, so it is never copied into one buffer.
+      static int SendJobMessagesToNode(const JobMessages& messages, const int& node,
+				       std::vector<MPI_Request>* requests);
+
+      // Copies only the rows (PARTIAL_VARIABLE_ROWS) or columns
+      // (PARTIAL_VARIABLE_COLS) of matrix listed in indices into a
+      // small struct that also records the indices and the full
+      // dimensions, so a batch of a huge variable costs about as much
+      // to send as the batch itself. WaitForJobData expands it again
+      // via UnsliceVariable.
+      static slib::util::MatlabMatrix SliceVariable(const slib::util::MatlabMatrix& matrix, 
+						    const VariableType& type,
+						    const std::vector<int>& indices);
+      // Replaces a matrix built by SliceVariable with one of the
+      // original dimensions that holds the sliced rows or columns at
+      // their original indices. Returns false, leaving the matrix
+      // alone, if it was not sliced. If given, type is set to the
+      // partial type the matrix was sliced as. WaitForJobData records
+      // it in the variable_types of the job so the job can be sliced
+      // again when it is passed on (see Cesium::SubMasterLoop).
+      static bool UnsliceVariable(slib::util::MatlabMatrix* matrix, VariableType* type = NULL);
+
       // Alert the master that this node is done with an operation.
       static int SendCompletionMessage(const int& node);
       // Blocking call to wait for the master to acknowledge the
@@ -172,8 +338,41 @@ namespace slib {
       // after previous method.
       static int WaitForCompletionResponse(const int& node);
 
+      // Tells the node that this one is still alive and which indices
+      // it is running right now.
+      static int SendHeartbeat(const std::vector<int>& running_indices, const int& node);
+      // Non-blocking. Receives the next heartbeat sent to this node by
+      // any other node, if there is one.
+      static bool ReceiveHeartbeat(int* node, std::vector<int>* running_indices);
+
+      // The running totals of this process. Mutable so that the
+      // serialization done outside of this class (see
+      // Cesium::SerializeJobVariables) can be counted too.
+      static TransferStatistics& GetTransferStatistics();
+
+      // The largest message the payload of a job is sent in. Only
+      // matters on the sending side: the receiver reads it from the
+      // header.
+      static void SetMaxMessageBytes(const int& bytes);
+      // COMPRESSED_VARIABLEs smaller than this are sent as they are.
+      static void SetCompressionThreshold(const long long& bytes);
+
     private:
       static bool _initialized;
+      static int _max_message_bytes;
+      static long long _compression_threshold;
+      // The compressed bytes of the serialized variables that are sent
+      // with every batch of a job (see JobData::serialized_variables)
+      // so they are only compressed once. An entry is dropped once
+      // nothing but this map refers to its variable anymore.
+      static std::map<boost::shared_ptr<const std::string>, 
+		      boost::shared_ptr<const std::string> > _compressed_variables;
+      // Returns the bytes to send for the variable and whether they
+      // are compressed. They are only compressed if that makes them
+      // smaller.
+      static boost::shared_ptr<const std::string> 
+      CompressVariable(const boost::shared_ptr<const std::string>& bytes, const bool& reused, bool* compressed);
+      static TransferStatistics _statistics;
       static bool CheckInitialized();
     };
   }  // namespace cesium
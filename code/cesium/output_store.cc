@@ -0,0 +1,225 @@
+#include "output_store.h"
+
+#include <algorithm>
+#include <common/types.h>
+#undef Success
+#include <Eigen/Dense>
+#include <functional>
+#include <glog/logging.h>
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::util::MatlabMatrix;
+using std::greater;
+using std::make_pair;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    OutputStore::OutputStore(const string& filename, const bool& truncate) 
+      : _filename(filename)
+      , _num_records(0)
+      , _loaded(false) {
+      const char* mode = truncate ? "w+b" : "a+b";
+      _data = fopen(filename.c_str(), mode);
+      _index = fopen((filename + ".index").c_str(), mode);
+      if (_data == NULL || _index == NULL) {
+	LOG(ERROR) << "Could not open output store: " << filename;
+      }
+    }
+
+    OutputStore::~OutputStore() {
+      if (_data != NULL) {
+	fclose(_data);
+      }
+      if (_index != NULL) {
+	fclose(_index);
+      }
+    }
+
+    bool OutputStore::Append(const vector<int>& indices, const MatlabMatrix& matrix) {
+      if (_data == NULL || _index == NULL) {
+	return false;
+      }
+
+      const string serialized = matrix.Serialize();
+      fseek(_data, 0, SEEK_END);
+      const long long int offset = ftell(_data);
+      const long long int length = serialized.length();
+      if (fwrite(serialized.data(), 1, length, _data) != (size_t) length) {
+	LOG(ERROR) << "Could not append to output store: " << _filename;
+	return false;
+      }
+
+      fseek(_index, 0, SEEK_END);
+      if (_loaded) {
+	_record_indices.push_back(indices);
+      }
+      for (int i = 0; i < (int) indices.size(); i++) {
+	const int index = indices[i];
+	fwrite(&index, sizeof(int), 1, _index);
+	fwrite(&offset, sizeof(long long int), 1, _index);
+	fwrite(&length, sizeof(long long int), 1, _index);
+	if (_loaded) {
+	  _records[index] = make_pair(offset, length);
+	  _indices.push_back(index);
+	}
+      }
+
+      // Flushed so that the store is complete up to the last batch if
+      // the master dies.
+      fflush(_data);
+      fflush(_index);
+      _num_records++;
+
+      return true;
+    }
+
+    void OutputStore::LoadIndex() {
+      _loaded = true;
+      if (_index == NULL) {
+	return;
+      }
+
+      fflush(_index);
+      fseek(_index, 0, SEEK_SET);
+      int index;
+      long long int offset, length;
+      long long int last_offset = -1;
+      while (fread(&index, sizeof(int), 1, _index) == 1
+	     && fread(&offset, sizeof(long long int), 1, _index) == 1
+	     && fread(&length, sizeof(long long int), 1, _index) == 1) {
+	_records[index] = make_pair(offset, length);
+	_indices.push_back(index);
+	// The indices of a record are written together.
+	if (offset != last_offset) {
+	  _record_indices.push_back(vector<int>());
+	  last_offset = offset;
+	}
+	_record_indices.back().push_back(index);
+      }
+    }
+
+    bool OutputStore::Read(const int& index, MatlabMatrix* matrix) {
+      if (!_loaded) {
+	LoadIndex();
+      }
+
+      const map<int, pair<long long int, long long int> >::const_iterator iter = _records.find(index);
+      if (iter == _records.end() || _data == NULL) {
+	return false;
+      }
+
+      const long long int offset = iter->second.first;
+      const long long int length = iter->second.second;
+      string serialized(length, '\0');
+      fflush(_data);
+      fseek(_data, offset, SEEK_SET);
+      if (fread(&serialized[0], 1, length, _data) != (size_t) length) {
+	LOG(ERROR) << "Could not read index " << index << " from output store: " << _filename;
+	return false;
+      }
+      matrix->Deserialize(serialized);
+
+      return true;
+    }
+
+    vector<int> OutputStore::GetIndices() {
+      if (!_loaded) {
+	LoadIndex();
+      }
+      return _indices;
+    }
+
+    vector<vector<int> > OutputStore::GetRecords() {
+      if (!_loaded) {
+	LoadIndex();
+      }
+      return _record_indices;
+    }
+
+    void SumReducer::Reduce(const vector<int>& indices, const MatlabMatrix& batch, MatlabMatrix* reduced) {
+      if (batch.GetMatrixType() != slib::util::MATLAB_MATRIX) {
+	LOG(ERROR) << "Only matrices can be summed";
+	return;
+      }
+      if (reduced->GetMatrixType() == slib::util::MATLAB_NO_TYPE) {
+	*reduced = batch;
+	return;
+      }
+
+      const FloatMatrix sum = reduced->GetCopiedContents() + batch.GetCopiedContents();
+      *reduced = MatlabMatrix(sum);
+    }
+
+    void ConcatRowsReducer::Reduce(const vector<int>& indices, const MatlabMatrix& batch, MatlabMatrix* reduced) {
+      if (batch.GetMatrixType() != slib::util::MATLAB_MATRIX) {
+	LOG(ERROR) << "Only the rows of matrices can be concatenated";
+	return;
+      }
+      if (reduced->GetMatrixType() == slib::util::MATLAB_NO_TYPE || reduced->GetNumberOfElements() == 0) {
+	*reduced = batch;
+	return;
+      }
+
+      const FloatMatrix top = reduced->GetCopiedContents();
+      const FloatMatrix bottom = batch.GetCopiedContents();
+      if (bottom.rows() == 0) {
+	return;
+      }
+      if (top.cols() != bottom.cols()) {
+	LOG(ERROR) << "Cannot concatenate the rows of matrices with " << top.cols() 
+		   << " and " << bottom.cols() << " columns";
+	return;
+      }
+
+      FloatMatrix rows(top.rows() + bottom.rows(), top.cols());
+      rows.topRows(top.rows()) = top;
+      rows.bottomRows(bottom.rows()) = bottom;
+      *reduced = MatlabMatrix(rows);
+    }
+
+    TopRowsReducer::TopRowsReducer(const int& k, const int& column) 
+      : _k(k)
+      , _column(column) {}
+
+    void TopRowsReducer::Reduce(const vector<int>& indices, const MatlabMatrix& batch, MatlabMatrix* reduced) {
+      if (batch.GetMatrixType() != slib::util::MATLAB_MATRIX) {
+	LOG(ERROR) << "Only the rows of matrices can be ranked";
+	return;
+      }
+
+      // Rank the rows kept so far together with the new ones.
+      ConcatRowsReducer concat;
+      MatlabMatrix candidates = *reduced;
+      concat.Reduce(indices, batch, &candidates);
+      const FloatMatrix rows = candidates.GetCopiedContents();
+      if (_column >= rows.cols()) {
+	LOG(ERROR) << "Cannot rank rows by column " << _column << " (only " << rows.cols() << " columns)";
+	return;
+      }
+
+      vector<pair<float, int> > scores;
+      for (int row = 0; row < rows.rows(); row++) {
+	scores.push_back(make_pair(rows(row, _column), row));
+      }
+      const int k = std::min(_k, (int) scores.size());
+      partial_sort(scores.begin(), scores.begin() + k, scores.end(), greater<pair<float, int> >());
+
+      FloatMatrix top(k, rows.cols());
+      for (int i = 0; i < k; i++) {
+	top.row(i) = rows.row(scores[i].second);
+      }
+      *reduced = MatlabMatrix(top);
+    }
+
+  }  // namespace cesium
+}  // namespace slib
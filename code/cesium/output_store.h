@@ -0,0 +1,108 @@
+#ifndef __SLIB_CESIUM_OUTPUT_STORE_H__
+#define __SLIB_CESIUM_OUTPUT_STORE_H__
+
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <util/matlab.h>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // An append-only, on-disk store for the output of a
+    // STREAMED_VARIABLE. Each batch a node returns is appended as one
+    // record to filename and every index of the batch is listed in
+    // filename.index along with the position of its record, so the
+    // master never holds more than the batch it is writing.
+    class OutputStore {
+    public:
+      // Opens the store for appending, first emptying it if truncate
+      // is set.
+      explicit OutputStore(const std::string& filename, const bool& truncate = false);
+      virtual ~OutputStore();
+
+      // Returns false if the store could not be opened or written.
+      bool Append(const std::vector<int>& indices, const slib::util::MatlabMatrix& matrix);
+
+      // Reads the record (i.e. the whole batch) the index was
+      // appended with. Returns false if the index is not in the
+      // store. The index is loaded on the first call, so only call
+      // these once the writing is done.
+      bool Read(const int& index, slib::util::MatlabMatrix* matrix);
+      // All of the indices in the store, in the order they were
+      // appended.
+      std::vector<int> GetIndices();
+      // The indices of each record, in the order they were appended.
+      std::vector<std::vector<int> > GetRecords();
+
+      inline const std::string& GetFilename() const {
+	return _filename;
+      }
+      inline int GetNumberOfRecords() const {
+	return _num_records;
+      }
+
+    private:
+      void LoadIndex();
+
+      std::string _filename;
+      FILE* _data;
+      FILE* _index;
+      int _num_records;
+
+      // (offset, length) of the record of each index. Only filled in
+      // for reading.
+      std::map<int, std::pair<long long int, long long int> > _records;
+      std::vector<int> _indices;
+      std::vector<std::vector<int> > _record_indices;
+      bool _loaded;
+    };
+
+    // Folds the output of each batch of a STREAMED_VARIABLE into a
+    // (small) running result as it arrives. Register one via
+    // Cesium::SetOutputReducer; the reduced result is returned as the
+    // variable's output.
+    class OutputReducer {
+    public:
+      virtual ~OutputReducer() {}
+      // reduced is empty (MATLAB_NO_TYPE) for the first batch.
+      virtual void Reduce(const std::vector<int>& indices, const slib::util::MatlabMatrix& batch,
+			  slib::util::MatlabMatrix* reduced) = 0;
+    };
+
+    // The element-wise sum of every batch. All batches must be
+    // matrices of the same size.
+    class SumReducer : public OutputReducer {
+    public:
+      virtual void Reduce(const std::vector<int>& indices, const slib::util::MatlabMatrix& batch,
+			  slib::util::MatlabMatrix* reduced);
+    };
+
+    // The rows of every batch stacked in the order they arrive. All
+    // batches must be matrices with the same number of columns.
+    class ConcatRowsReducer : public OutputReducer {
+    public:
+      virtual void Reduce(const std::vector<int>& indices, const slib::util::MatlabMatrix& batch,
+			  slib::util::MatlabMatrix* reduced);
+    };
+
+    // The k rows with the largest values in the given column over all
+    // batches (e.g. the best scoring detections), largest first.
+    class TopRowsReducer : public OutputReducer {
+    public:
+      TopRowsReducer(const int& k, const int& column);
+
+      virtual void Reduce(const std::vector<int>& indices, const slib::util::MatlabMatrix& batch,
+			  slib::util::MatlabMatrix* reduced);
+
+    private:
+      int _k;
+      int _column;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
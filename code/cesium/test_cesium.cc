@@ -24,6 +24,7 @@
 
 using slib::cesium::Cesium;
 using slib::cesium::JobDescription;
+using slib::cesium::JobNode;
 using slib::cesium::JobOutput;
 using slib::util::Directory;
 using slib::util::MatlabMatrix;
@@ -137,6 +138,31 @@ void TestFunction5(const JobDescription& job, JobOutput* output) {
   output->variables["output"] = matrix;
 }
 
+#define PARTIAL_ROWS 10000
+
+void TestFunction6(const JobDescription& job, JobOutput* output) {
+  VLOG(1) << "\n\nTestFunction6";
+
+  output->indices = job.indices;
+
+  // Only this batch was sent, but the inputs keep their full size.
+  const MatlabMatrix& numbers = job.GetInputByName("numbers");
+  const MatlabMatrix& cells = job.GetInputByName("cells");
+  ASSERT_EQ(PARTIAL_ROWS, numbers.GetDimensions().x);
+  ASSERT_EQ(2, numbers.GetDimensions().y);
+  ASSERT_EQ(PARTIAL_ROWS, cells.GetDimensions().x);
+
+  MatlabMatrix matrix(slib::util::MATLAB_CELL_ARRAY, Pair<int>(PARTIAL_ROWS, 1));
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    const float value = numbers.GetMatrixEntry(index, 0) + numbers.GetMatrixEntry(index, 1)
+      + cells.GetCell(index, 0).GetScalar();
+    matrix.SetCell(index, MatlabMatrix(value));
+  }
+
+  output->variables["output"] = matrix;
+}
+
 bool TEST_MATLAB_MATRIX_EQUAL(const MatlabMatrix& A, const MatlabMatrix& B) {
   return (A.Serialize() == B.Serialize());
 }
@@ -160,6 +186,7 @@ int main(int argc, char** argv) {
   CESIUM_REGISTER_COMMAND(TestFunction3_2);
   CESIUM_REGISTER_COMMAND(TestFunction4);
   CESIUM_REGISTER_COMMAND(TestFunction5);
+  CESIUM_REGISTER_COMMAND(TestFunction6);
 
   Cesium* instance = Cesium::GetInstance();
   if (instance->Start() == slib::cesium::CesiumMasterNode) {
@@ -328,6 +355,100 @@ int main(int argc, char** argv) {
 
       ASSERT_TRUE(TEST_MATLAB_MATRIX_EQUAL(output.variables["output"], golden));      
     }
+#endif
+#if 1
+    {
+      JobDescription job;
+      job.command = "TestFunction6";
+      job.indices.push_back(0);
+      job.indices.push_back(17);
+      job.indices.push_back(PARTIAL_ROWS / 2);
+      job.indices.push_back(PARTIAL_ROWS - 1);
+
+      FloatMatrix contents(PARTIAL_ROWS, 2);
+      MatlabMatrix cells(slib::util::MATLAB_CELL_ARRAY, Pair<int>(PARTIAL_ROWS, 1));
+      for (int i = 0; i < PARTIAL_ROWS; i++) {
+	contents(i, 0) = i;
+	contents(i, 1) = 2 * i;
+	cells.SetCell(i, MatlabMatrix((float) (3 * i)));
+      }
+      const MatlabMatrix numbers(contents);
+
+      instance->SetVariableType("numbers", numbers, slib::cesium::PARTIAL_VARIABLE_ROWS);
+      instance->SetVariableType("cells", cells, slib::cesium::PARTIAL_VARIABLE_ROWS);
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      instance->ExecuteJob(job, &output);
+
+      const MatlabMatrix& result = output.variables["output"];
+      for (int i = 0; i < (int) job.indices.size(); i++) {
+	const int index = job.indices[i];
+	ASSERT_EQ(6.0f * index, result.GetCell(index).GetScalar());
+      }
+
+      // The slices themselves only carry the requested rows.
+      vector<int> indices;
+      indices.push_back(17);
+      const MatlabMatrix sliced = JobNode::SliceVariable(cells, slib::cesium::PARTIAL_VARIABLE_ROWS, indices);
+      ASSERT_TRUE(sliced.Serialize().length() < 1000);
+      MatlabMatrix unsliced = sliced;
+      ASSERT_TRUE(JobNode::UnsliceVariable(&unsliced));
+      ASSERT_EQ(PARTIAL_ROWS, unsliced.GetDimensions().x);
+      ASSERT_EQ(51.0f, unsliced.GetCell(17).GetScalar());
+
+      // Variables serialized back to back can be read straight from
+      // the buffer they were received into.
+      string buffer;
+      numbers.SerializeTo(&buffer);
+      const long long int numbers_length = buffer.length();
+      cells.SerializeTo(&buffer);
+      MatlabMatrix numbers_copy;
+      MatlabMatrix cells_copy;
+      ASSERT_EQ(numbers_length, numbers_copy.Deserialize(buffer.data()));
+      ASSERT_EQ((long long int) buffer.length() - numbers_length, cells_copy.Deserialize(buffer.data(), numbers_length));
+      ASSERT_TRUE(TEST_MATLAB_MATRIX_EQUAL(numbers, numbers_copy));
+      ASSERT_TRUE(TEST_MATLAB_MATRIX_EQUAL(cells, cells_copy));
+
+      // Non-square matrices of every class come back with each entry
+      // in place: single precision ones (which are written straight
+      // from their Matlab data) as well as doubles (which are not).
+      FloatMatrix values(2, 3);
+      values << 1, 2, 3, 4, 5, 6;
+      mxArray* doubles = mxCreateDoubleMatrix(2, 3, mxREAL);
+      for (int j = 0; j < 2; j++) {
+	for (int i = 0; i < 3; i++) {
+	  mxGetPr(doubles)[j + i * 2] = values(j, i);
+	}
+      }
+      const string filename = FLAGS_cesium_temporary_directory + "/test_cesium_doubles.mat";
+      MATFile* file = matOpen(filename.c_str(), "w");
+      ASSERT_TRUE(file != NULL);
+      matPutVariable(file, "doubles", doubles);
+      matClose(file);
+      mxDestroyArray(doubles);
+
+      const MatlabMatrix singles(values);
+      const MatlabMatrix loaded = MatlabMatrix::LoadFromFile(filename);
+      remove(filename.c_str());
+      MatlabMatrix singles_copy;
+      MatlabMatrix loaded_copy;
+      singles_copy.Deserialize(singles.Serialize());
+      loaded_copy.Deserialize(loaded.Serialize());
+      for (int j = 0; j < 2; j++) {
+	for (int i = 0; i < 3; i++) {
+	  ASSERT_EQ(values(j, i), loaded.GetMatrixEntry(j, i));
+	  ASSERT_EQ(values(j, i), singles_copy.GetMatrixEntry(j, i));
+	  ASSERT_EQ(values(j, i), loaded_copy.GetMatrixEntry(j, i));
+	}
+      }
+      // Both are written row by row, as they always have been.
+      ASSERT_TRUE(TEST_MATLAB_MATRIX_EQUAL(singles, loaded));
+      const string serialized = singles.Serialize();
+      ASSERT_EQ(0, memcmp(serialized.data() + 1 + 2 * sizeof(int), values.data(), sizeof(float) * 6));
+    }
 #endif
     instance->Finish();
   }
@@ -0,0 +1,135 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <string>
+#include <unistd.h>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 10
+
+// Stores index * scale + rank at each index so we can tell which
+// nodes ran which job.
+void AsyncTestFunction(const JobDescription& job, JobOutput* output) {
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  const float scale = job.GetInputByName("scale").GetScalar();
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    usleep(100000);
+    A.SetCell(job.indices[i], 0, MatlabMatrix(job.indices[i] * scale + rank));
+    output->indices.push_back(job.indices[i]);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+JobDescription MakeJob(const float& scale) {
+  JobDescription job;
+  job.command = "AsyncTestFunction";
+  job.variables["scale"] = MatlabMatrix(scale);
+  for (int i = 0; i < NUM_INDICES; i++) {
+    job.indices.push_back(i);
+  }
+  return job;
+}
+
+// Checks the output and returns the set of nodes that ran the job.
+vector<int> CheckOutput(const JobOutput& output, const float& scale) {
+  vector<int> nodes;
+  const MatlabMatrix& testmat = output.variables.find("testmat")->second;
+  ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+  for (int i = 0; i < NUM_INDICES; i++) {
+    const int node = (int) (testmat.GetCell(i, 0).GetScalar() - i * scale + 0.5f);
+    ASSERT_TRUE(node >= 1);
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(AsyncTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+    ASSERT_TRUE(instance->GetNumProcessingNodes() >= 2);
+
+    // Partitioned: each job only runs on its own nodes.
+    {
+      vector<int> first_nodes, second_nodes;
+      for (int node = 1; node <= instance->GetNumProcessingNodes(); node++) {
+	if (node % 2 == 1) {
+	  first_nodes.push_back(node);
+	} else {
+	  second_nodes.push_back(node);
+	}
+      }
+
+      JobOutput first_output, second_output;
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(1);
+      instance->SetExecutionNodes(first_nodes);
+      const int first = instance->ExecuteJobAsync(MakeJob(100.0f), &first_output);
+
+      instance->DisableIntelligentParameters();
+      instance->SetExecutionNodes(second_nodes);
+      const int second = instance->ExecuteJobAsync(MakeJob(1000.0f), &second_output);
+      ASSERT_TRUE(first >= 0 && second >= 0 && first != second);
+
+      ASSERT_TRUE(instance->WaitForJob(second));
+      ASSERT_TRUE(instance->WaitForJob(first));
+      ASSERT_TRUE(!instance->WaitForJob(first));
+
+      const vector<int> first_ran = CheckOutput(first_output, 100.0f);
+      for (int i = 0; i < (int) first_ran.size(); i++) {
+	ASSERT_EQ(1, first_ran[i] % 2);
+      }
+      const vector<int> second_ran = CheckOutput(second_output, 1000.0f);
+      for (int i = 0; i < (int) second_ran.size(); i++) {
+	ASSERT_EQ(0, second_ran[i] % 2);
+      }
+    }
+
+    // Shared: both jobs draw from the whole pool.
+    {
+      JobOutput first_output, second_output;
+      instance->SetBatchSize(2);
+      const int first = instance->ExecuteJobAsync(MakeJob(100.0f), &first_output);
+      const int second = instance->ExecuteJobAsync(MakeJob(1000.0f), &second_output);
+      while (!instance->IsJobFinished(first)) {
+	usleep(10000);
+      }
+      ASSERT_TRUE(instance->WaitForJob(first));
+      ASSERT_TRUE(instance->WaitForJob(second));
+      CheckOutput(first_output, 100.0f);
+      CheckOutput(second_output, 1000.0f);
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
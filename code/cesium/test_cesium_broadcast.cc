@@ -0,0 +1,106 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <algorithm>
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobNode;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 20
+#define MATRIX_SIZE 200
+
+// Stores the diagonal entry of the model plus the first entry of the
+// row of the partial variable at each index.
+void BroadcastTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& model = job.GetInputByName("model");
+  const MatlabMatrix& rows = job.GetInputByName("rows");
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix(model.GetMatrixEntry(index, index) + rows.GetMatrixEntry(index, 0)));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(BroadcastTestFunction);
+
+  // Must be set on the compute nodes, so before Start().
+  FLAGS_cesium_broadcast_variables = true;
+
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    FloatMatrix rows = FloatMatrix::Zero(NUM_INDICES, 1);
+    for (int i = 0; i < NUM_INDICES; i++) {
+      rows(i, 0) = 1000.0f * i;
+    }
+
+    // A new model each time, so each job broadcasts its own.
+    long long int bytes_sent = 0;
+    for (int k = 1; k <= 2; k++) {
+      JobDescription job;
+      job.command = "BroadcastTestFunction";
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+      FloatMatrix model = FloatMatrix::Zero(MATRIX_SIZE, MATRIX_SIZE);
+      for (int i = 0; i < MATRIX_SIZE; i++) {
+	model(i, i) = k * i;
+      }
+      job.variables["model"] = MatlabMatrix(model);
+      instance->SetVariableType("rows", MatlabMatrix(rows), slib::cesium::PARTIAL_VARIABLE_ROWS);
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ((float) (k * i + 1000 * i), testmat.GetCell(i, 0).GetScalar());
+      }
+
+      // The master only sends the model to its (at most two)
+      // children in the tree, and none of the batches carry it.
+      const long long int sent = JobNode::GetTransferStatistics().GetTotalBytesSent() - bytes_sent;
+      const long long int model_bytes = job.variables["model"].Serialize().length();
+      LOG(INFO) << "Bytes sent: " << sent << " (model: " << model_bytes << ")";
+      ASSERT_TRUE(sent < std::min(size - 1, 2) * model_bytes + model_bytes / 2);
+      bytes_sent += sent;
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
@@ -23,6 +23,7 @@
 #include <vector>
 
 using slib::cesium::Cesium;
+using slib::cesium::CheckpointWriter;
 using slib::cesium::JobDescription;
 using slib::cesium::JobOutput;
 using slib::util::Directory;
@@ -47,6 +48,48 @@ void TestFunction(const JobDescription& job, JobOutput* output) {
   output->variables["testmat"].Merge(A);
 }
 
+MatlabMatrix MakeCells(const int& first, const int& last) {
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, 14, 1);
+  for (int i = first; i < last; i++) {
+    A.SetCell(i, 0, MatlabMatrix((float) i));
+  }
+  return A;
+}
+
+vector<int> MakeIndices(const int& first, const int& last) {
+  vector<int> indices;
+  for (int i = first; i < last; i++) {
+    indices.push_back(i);
+  }
+  return indices;
+}
+
+void TestCheckpointWriter() {
+  const string prefix = FLAGS_cesium_temporary_directory + "/writer_checkpoint";
+  CheckpointWriter writer(2);
+
+  // Three deltas, the first two of which get compacted.
+  for (int k = 0; k < 3; k++) {
+    MatlabMatrix delta = MakeCells(4 * k, 4 * k + 4);
+    writer.Append(prefix, &delta, MakeIndices(4 * k, 4 * k + 4), k == 0);
+    ASSERT_EQ(slib::util::MATLAB_NO_TYPE, delta.GetMatrixType());
+  }
+  MatlabMatrix checkpoint;
+  vector<int> indices;
+  ASSERT_TRUE(writer.Load(prefix, &checkpoint, &indices));
+  ASSERT_EQ(12, (int) indices.size());
+  ASSERT_TRUE(TEST_MATLAB_MATRIX_EQUAL(checkpoint, MakeCells(0, 12)));
+
+  // A reset drops everything written before.
+  MatlabMatrix delta = MakeCells(12, 14);
+  writer.Append(prefix, &delta, MakeIndices(12, 14), true);
+  checkpoint = MatlabMatrix();
+  indices.clear();
+  ASSERT_TRUE(writer.Load(prefix, &checkpoint, &indices));
+  ASSERT_EQ(2, (int) indices.size());
+  ASSERT_TRUE(TEST_MATLAB_MATRIX_EQUAL(checkpoint, MakeCells(12, 14)));
+}
+
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
@@ -63,6 +106,8 @@ int main(int argc, char** argv) {
   if (instance->Start() == slib::cesium::CesiumMasterNode) {
     FLAGS_logtostderr = true;
 
+    TestCheckpointWriter();
+
     const FloatMatrix A = FloatMatrix::Random(10, 10);
     const MatlabMatrix large_matrix(A);
 
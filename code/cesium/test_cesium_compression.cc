@@ -0,0 +1,107 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobNode;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 30
+#define MATRIX_SIZE 200
+
+// Stores the sum of the rows of both (mostly empty) matrices at each
+// index, in a (compressed) matrix of its own.
+void CompressionTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& sparse = job.GetInputByName("sparse");
+  const MatlabMatrix& rows = job.GetInputByName("rows");
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    float sum = 0.0f;
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      sum += sparse.GetMatrixEntry(index, j) + rows.GetMatrixEntry(index, j);
+    }
+    FloatMatrix result = FloatMatrix::Zero(50, 50);
+    result(0, 0) = sum;
+    A.SetCell(index, 0, MatlabMatrix(result));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+  output->SetVariableType("testmat", slib::cesium::COMPRESSED_VARIABLE);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(CompressionTestFunction);
+
+  if (FLAGS_cesium_compression_threshold == 1 << 16) {
+    FLAGS_cesium_compression_threshold = 1000;
+  }
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    JobDescription job;
+    job.command = "CompressionTestFunction";
+    for (int i = 0; i < NUM_INDICES; i++) {
+      job.indices.push_back(i);
+    }
+
+    FloatMatrix contents = FloatMatrix::Zero(MATRIX_SIZE, MATRIX_SIZE);
+    for (int i = 0; i < MATRIX_SIZE; i++) {
+      contents(i, i) = i;
+    }
+    job.variables["sparse"] = MatlabMatrix(contents);
+    job.SetVariableType("sparse", (slib::cesium::VariableType) 
+			(slib::cesium::COMPLETE_VARIABLE | slib::cesium::COMPRESSED_VARIABLE));
+    const MatlabMatrix rows(contents);
+    instance->SetVariableType("rows", rows, (slib::cesium::VariableType) 
+			      (slib::cesium::PARTIAL_VARIABLE_ROWS | slib::cesium::COMPRESSED_VARIABLE));
+
+    instance->DisableIntelligentParameters();
+    instance->SetBatchSize(5);
+
+    JobOutput output;
+    ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+    const MatlabMatrix& testmat = output.variables["testmat"];
+    ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+    for (int i = 0; i < NUM_INDICES; i++) {
+      const MatlabMatrix cell = testmat.GetCell(i, 0);
+      ASSERT_EQ(2500, cell.GetNumberOfElements());
+      ASSERT_EQ(2.0f * i, cell.GetMatrixEntry(0, 0));
+    }
+
+    // Mostly zeros compress very well, both ways.
+    const slib::cesium::TransferStatistics& statistics = JobNode::GetTransferStatistics();
+    LOG(INFO) << "Compression ratio: " << statistics.GetCompressionRatio();
+    ASSERT_TRUE((statistics.GetCompressionRatio() > 10.0));
+    ASSERT_TRUE((statistics.GetTotalBytesSent() < (long long) (MATRIX_SIZE * MATRIX_SIZE * sizeof(float))));
+    ASSERT_TRUE((statistics.GetTotalBytesReceived() < (long long) (NUM_INDICES * 2500 * sizeof(float))));
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
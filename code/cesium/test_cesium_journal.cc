@@ -0,0 +1,171 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+#include "job_journal.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <stdio.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobJournal;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 12
+
+// Stores the index at each index.
+void JournalTestFunction(const JobDescription& job, JobOutput* output) {
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    A.SetCell(job.indices[i], 0, MatlabMatrix((float) job.indices[i]));
+    output->indices.push_back(job.indices[i]);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+vector<int> AllIndices() {
+  vector<int> indices;
+  for (int i = 0; i < NUM_INDICES; i++) {
+    indices.push_back(i);
+  }
+  return indices;
+}
+
+// A completed batch whose outputs differ from what
+// JournalTestFunction computes, so that we can tell they were not
+// recomputed.
+JobOutput MakeBatch(const int& first, const int& last) {
+  JobOutput output;
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = first; i < last; i++) {
+    A.SetCell(i, 0, MatlabMatrix(100.0f + i));
+    output.indices.push_back(i);
+  }
+  output.variables["testmat"] = A;
+  return output;
+}
+
+void TestJournal() {
+  const string prefix = FLAGS_cesium_temporary_directory + "/test_journal";
+  const vector<int> indices = AllIndices();
+  {
+    JobJournal journal(prefix);
+    ASSERT_TRUE(journal.Create("JournalTestFunction", indices));
+    journal.RecordDispatched(1, MakeBatch(0, 2).indices);
+    journal.RecordDispatched(2, MakeBatch(2, 4).indices);
+    ASSERT_TRUE(journal.RecordCompleted(1, MakeBatch(0, 2)));
+  }
+
+  // A record that was cut short by a crash is ignored.
+  FILE* file = fopen((prefix + ".journal").c_str(), "ab");
+  const int length = 1000;
+  fwrite(&length, sizeof(int), 1, file);
+  fwrite("C", 1, 1, file);
+  fclose(file);
+
+  {
+    JobJournal journal(prefix);
+    ASSERT_TRUE(!journal.Resume("OtherFunction", indices));
+    ASSERT_TRUE(journal.Resume("JournalTestFunction", indices));
+    ASSERT_EQ(1, journal.GetNumberOfCompletedBatches());
+    ASSERT_EQ(2, journal.GetNumberOfInFlightIndices());
+
+    JobOutput output;
+    ASSERT_TRUE(journal.ReadCompletedBatch(0, &output));
+    ASSERT_EQ(2, (int) output.indices.size());
+    ASSERT_EQ(101.0f, output.variables["testmat"].GetCell(1, 0).GetScalar());
+
+    // New records follow the valid ones.
+    ASSERT_TRUE(journal.RecordCompleted(2, MakeBatch(2, 4)));
+  }
+  {
+    JobJournal journal(prefix);
+    ASSERT_TRUE(journal.Resume("JournalTestFunction", indices));
+    ASSERT_EQ(2, journal.GetNumberOfCompletedBatches());
+    ASSERT_EQ(0, journal.GetNumberOfInFlightIndices());
+  }
+
+  // Nor is one whose length was garbled, without allocating it.
+  file = fopen((prefix + ".journal").c_str(), "ab");
+  const unsigned int garbled_length = 0xfffffff0;
+  fwrite(&garbled_length, sizeof(unsigned int), 1, file);
+  fclose(file);
+  {
+    JobJournal journal(prefix);
+    ASSERT_TRUE(journal.Resume("JournalTestFunction", indices));
+    ASSERT_EQ(2, journal.GetNumberOfCompletedBatches());
+  }
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(JournalTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    TestJournal();
+
+    // Pretend an earlier run of the first job finished the first
+    // four indices before the master died.
+    {
+      JobJournal journal(FLAGS_cesium_temporary_directory + "/journal_0_JournalTestFunction");
+      ASSERT_TRUE(journal.Create("JournalTestFunction", AllIndices()));
+      ASSERT_TRUE(journal.RecordCompleted(1, MakeBatch(0, 4)));
+    }
+
+    FLAGS_cesium_journal_jobs = true;
+    FLAGS_cesium_resume_jobs = true;
+
+    JobDescription job;
+    job.command = "JournalTestFunction";
+    job.indices = AllIndices();
+
+    instance->DisableIntelligentParameters();
+    instance->SetBatchSize(2);
+
+    JobOutput output;
+    ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+    const MatlabMatrix& testmat = output.variables["testmat"];
+    ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+    for (int i = 0; i < NUM_INDICES; i++) {
+      const float expected = (i < 4) ? 100.0f + i : (float) i;
+      ASSERT_EQ(expected, testmat.GetCell(i, 0).GetScalar());
+    }
+
+    // Everything is in the journal now.
+    JobJournal journal(FLAGS_cesium_temporary_directory + "/journal_0_JournalTestFunction");
+    ASSERT_TRUE(journal.Resume("JournalTestFunction", AllIndices()));
+    int num_indices = 0;
+    for (int batch = 0; batch < journal.GetNumberOfCompletedBatches(); batch++) {
+      JobOutput completed;
+      ASSERT_TRUE(journal.ReadCompletedBatch(batch, &completed));
+      num_indices += completed.indices.size();
+    }
+    ASSERT_EQ(NUM_INDICES, num_indices);
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
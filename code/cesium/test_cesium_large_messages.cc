@@ -0,0 +1,98 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 30
+#define MATRIX_SIZE 100
+
+// Stores the sum of the row of the matrix (and a few more copies of
+// it, so the outputs are split up too) at each index.
+void LargeMessagesTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& matrix = job.GetInputByName("matrix");
+  const MatlabMatrix& rows = job.GetInputByName("rows");
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    float sum = 0.0f;
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      sum += matrix.GetMatrixEntry(index, j) + rows.GetMatrixEntry(index, j);
+    }
+    A.SetCell(index, 0, MatlabMatrix(FloatMatrix::Constant(10, 10, sum)));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+// Sends the variables of every job (and every output) in messages of
+// 1000 bytes, so that they are split both within and across
+// variables.
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(LargeMessagesTestFunction);
+
+  if (FLAGS_cesium_max_message_bytes == 1 << 30) {
+    FLAGS_cesium_max_message_bytes = 1000;
+  }
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    JobDescription job;
+    job.command = "LargeMessagesTestFunction";
+    for (int i = 0; i < NUM_INDICES; i++) {
+      job.indices.push_back(i);
+    }
+
+    FloatMatrix contents(MATRIX_SIZE, MATRIX_SIZE);
+    for (int i = 0; i < MATRIX_SIZE; i++) {
+      for (int j = 0; j < MATRIX_SIZE; j++) {
+	contents(i, j) = i;
+      }
+    }
+    job.variables["matrix"] = MatlabMatrix(contents);
+    const MatlabMatrix rows(contents);
+    instance->SetVariableType("rows", rows, slib::cesium::PARTIAL_VARIABLE_ROWS);
+
+    instance->DisableIntelligentParameters();
+    instance->SetBatchSize(4);
+
+    JobOutput output;
+    ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+    const MatlabMatrix& testmat = output.variables["testmat"];
+    ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+    for (int i = 0; i < NUM_INDICES; i++) {
+      const MatlabMatrix cell = testmat.GetCell(i, 0);
+      ASSERT_EQ(100, cell.GetNumberOfElements());
+      ASSERT_EQ(2.0f * MATRIX_SIZE * i, cell.GetMatrixEntry(9, 9));
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
@@ -0,0 +1,90 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 50
+
+// Stores the value of the partial variable plus the (cached) offset
+// at each index.
+void LocalTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& values = job.GetInputByName("values");
+  const float offset = job.GetInputByName("offset").GetScalar();
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix(values.GetCell(index, 0).GetScalar() + offset));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+// Run this without mpirun (or with a single process): the jobs run on
+// threads of the master.
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(LocalTestFunction);
+
+  if (FLAGS_cesium_local_workers == 0) {
+    FLAGS_cesium_local_workers = 3;
+  }
+
+  Cesium* instance = Cesium::GetInstance();
+  ASSERT_TRUE(instance->Start() == slib::cesium::CesiumMasterNode);
+  FLAGS_logtostderr = true;
+
+  for (int k = 0; k < 2; k++) {
+    JobDescription job;
+    job.command = "LocalTestFunction";
+    for (int i = 0; i < NUM_INDICES; i++) {
+      job.indices.push_back(i);
+    }
+
+    MatlabMatrix values(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+    for (int i = 0; i < NUM_INDICES; i++) {
+      values.SetCell(i, 0, MatlabMatrix((float) (2 * i)));
+    }
+    instance->SetVariableType("values", values, slib::cesium::PARTIAL_VARIABLE_ROWS);
+    const MatlabMatrix offset((float) (100 * k));
+    job.variables["offset"] = offset;
+    instance->SetVariableType("offset", offset, slib::cesium::CACHED_VARIABLE);
+
+    instance->DisableIntelligentParameters();
+    instance->SetBatchSize(4);
+
+    JobOutput output;
+    ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+    const MatlabMatrix& testmat = output.variables["testmat"];
+    ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+    for (int i = 0; i < NUM_INDICES; i++) {
+      ASSERT_EQ(100.0f * k + 2 * i, testmat.GetCell(i, 0).GetScalar());
+    }
+  }
+
+  instance->Finish();
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
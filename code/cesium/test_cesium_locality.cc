@@ -0,0 +1,106 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+// The rank of this process. The function may run on a thread that
+// must not make MPI calls.
+int rank = -1;
+
+#define NUM_INDICES 40
+
+// Stores the value of the partial variable and the rank of the node
+// that ran each index.
+void LocalityTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& values = job.GetInputByName("values");
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  MatlabMatrix ranks(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix(values.GetCell(index, 0).GetScalar()));
+    ranks.SetCell(index, 0, MatlabMatrix((float) rank));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+  output->variables["ranks"].Merge(ranks);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  CESIUM_REGISTER_COMMAND(LocalityTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+    FLAGS_cesium_locality_aware_scheduling = true;
+
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    const int num_nodes = size - 1;
+
+    // Each node takes a single batch. The second time around every
+    // node should get back the same indices (and rows of "values").
+    vector<int> first_ranks;
+    for (int k = 0; k < 2; k++) {
+      JobDescription job;
+      job.command = "LocalityTestFunction";
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      MatlabMatrix values(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	values.SetCell(i, 0, MatlabMatrix((float) (3 * i)));
+      }
+      instance->SetVariableType("values", values, slib::cesium::PARTIAL_VARIABLE_ROWS);
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize((NUM_INDICES + num_nodes - 1) / num_nodes);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      const MatlabMatrix& ranks = output.variables["ranks"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      ASSERT_EQ(NUM_INDICES, ranks.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(3.0f * i, testmat.GetCell(i, 0).GetScalar());
+	const int node = (int) ranks.GetCell(i, 0).GetScalar();
+	ASSERT_TRUE(node > 0 && node < size);
+	if (k == 0) {
+	  first_ranks.push_back(node);
+	} else {
+	  ASSERT_EQ(first_ranks[i], node);
+	}
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
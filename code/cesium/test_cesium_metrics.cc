@@ -0,0 +1,106 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+#include "log_exporter.h"
+
+#include <common/types.h>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <sstream>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::cesium::LogExporter;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 20
+
+// Stores the offset + index at each index.
+void MetricsTestFunction(const JobDescription& job, JobOutput* output) {
+  const float offset = job.GetInputByName("offset").GetScalar();
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix(offset + index));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+string ReadFile(const string& filename) {
+  std::ifstream in(filename.c_str());
+  std::stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(MetricsTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+    FLAGS_cesium_metrics_file = FLAGS_cesium_temporary_directory + "/cesium_metrics.prom";
+
+    {
+      JobDescription job;
+      job.command = "MetricsTestFunction";
+      job.variables["offset"] = MatlabMatrix(10.0f);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(4);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(10.0f + i, testmat.GetCell(i, 0).GetScalar());
+      }
+
+      // Written once more as the job finishes.
+      const string metrics = ReadFile(FLAGS_cesium_metrics_file);
+      ASSERT_TRUE(metrics.find("# TYPE cesium_bytes_sent_total counter") != string::npos);
+      ASSERT_TRUE(metrics.find("cesium_bytes_sent_total{node=\"1\"}") != string::npos);
+      ASSERT_TRUE(metrics.find("cesium_bytes_received_total{node=\"1\"}") != string::npos);
+      ASSERT_TRUE(metrics.find("cesium_serialization_seconds_total") != string::npos);
+      ASSERT_TRUE(metrics.find("cesium_node_busy{node=\"1\"} 0") != string::npos);
+      ASSERT_TRUE(slib::cesium::JobNode::GetTransferStatistics().GetTotalBytesSent() > 0);
+    }
+
+    // Everything logged while the exporter is around ends up in its
+    // file.
+    {
+      const string filename = FLAGS_cesium_temporary_directory + "/cesium_exported.log";
+      LogExporter exporter(filename);
+      ASSERT_TRUE(exporter.IsOpen());
+      LOG(INFO) << "Exported log line";
+      exporter.Flush();
+      ASSERT_TRUE(ReadFile(filename).find("Exported log line") != string::npos);
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
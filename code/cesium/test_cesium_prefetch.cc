@@ -0,0 +1,85 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <string>
+#include <unistd.h>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 30
+
+// Stores the (cached) offset + index at each index.
+void PrefetchTestFunction(const JobDescription& job, JobOutput* output) {
+  const float offset = job.GetInputByName("offset").GetScalar();
+
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    usleep(20000);
+    A.SetCell(job.indices[i], 0, MatlabMatrix(offset + job.indices[i]));
+    output->indices.push_back(job.indices[i]);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(PrefetchTestFunction);
+
+  // Must be set on the compute nodes, so before Start().
+  FLAGS_cesium_prefetch_batches = true;
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    // Run twice so that the second job starts while the nodes may
+    // still have batches queued from the first.
+    for (int k = 0; k < 2; k++) {
+      JobDescription job;
+      job.command = "PrefetchTestFunction";
+      const MatlabMatrix offset(1000.0f);
+      job.variables["offset"] = offset;
+      instance->SetVariableType("offset", offset, slib::cesium::CACHED_VARIABLE);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(1000.0f + i, testmat.GetCell(i, 0).GetScalar());
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
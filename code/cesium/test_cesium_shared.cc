@@ -0,0 +1,88 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 24
+#define MODEL_SIZE 1000
+
+// Looks up each index in the shared model.
+void SharedTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& model = job.GetInputByName("model");
+  ASSERT_EQ(MODEL_SIZE, model.GetNumberOfElements());
+
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix(model.Get(index, 0).GetScalar()));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(SharedTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    // Every node runs on one host here, so each job's model is
+    // published once and read from shared memory by all of them.
+    for (int k = 0; k < 2; k++) {
+      vector<float> values;
+      for (int i = 0; i < MODEL_SIZE; i++) {
+	values.push_back(1000.0f * k + i);
+      }
+      const MatlabMatrix model(values);
+
+      JobDescription job;
+      job.command = "SharedTestFunction";
+      job.variables["model"] = model;
+      instance->SetVariableType("model", model, slib::cesium::SHARED_VARIABLE);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(1000.0f * k + i, testmat.GetCell(i, 0).GetScalar());
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
@@ -0,0 +1,112 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <string>
+#include <unistd.h>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+DEFINE_int32(slow_node, 1, "The node that takes much longer than the others to process an index.");
+DEFINE_int32(slow_node_seconds, 3, "The number of seconds the slow node spends on each index.");
+DEFINE_int32(slow_index_seconds, 8, "The number of seconds any node spends on the slow index of a job.");
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::cesium::SumReducer;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 12
+
+void SpeculativeTestFunction(const JobDescription& job, JobOutput* output) {
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  const int slow_index = (int) job.GetInputByName("slow_index").GetScalar();
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    if (rank == FLAGS_slow_node) {
+      sleep(FLAGS_slow_node_seconds);
+    }
+    if (job.indices[i] == slow_index) {
+      sleep(FLAGS_slow_index_seconds);
+    }
+    A.SetCell(job.indices[i], 0, MatlabMatrix((float) job.indices[i]));
+    output->indices.push_back(job.indices[i]);
+  }
+  output->variables["testmat"].Merge(A);
+  // Commands are run an index at a time into the output of the whole
+  // batch, which reports how many indices it ran.
+  const float count = output->HasInput("count") ? output->GetInputByName("count").GetScalar() : 0.0f;
+  output->variables["count"] = MatlabMatrix(count + job.indices.size());
+}
+
+// The slow index (if not -1) is slow on every node.
+void RunJob(Cesium* instance, const int& slow_index) {
+  JobDescription job;
+  job.command = "SpeculativeTestFunction";
+  for (int i = 0; i < NUM_INDICES; i++) {
+    job.indices.push_back(i);
+  }
+  job.variables["slow_index"] = MatlabMatrix((float) slow_index);
+
+  instance->DisableIntelligentParameters();
+  instance->SetBatchSize(2);
+  instance->SetOutputReducer("count", new SumReducer());
+
+  JobOutput output;
+  ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+  // Each index is counted once, however many copies of it ran.
+  ASSERT_EQ((float) NUM_INDICES, output.variables["count"].GetScalar());
+
+  const MatlabMatrix& testmat = output.variables["testmat"];
+  ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+  for (int i = 0; i < NUM_INDICES; i++) {
+    ASSERT_EQ((float) i, testmat.GetCell(i, 0).GetScalar());
+  }
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(SpeculativeTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+    FLAGS_cesium_speculative_execution_fraction = 0.5;
+
+    // The slow node also holds a prefetched batch, which is slow on
+    // any node. Its first batch finishes before the copy of both
+    // does.
+    FLAGS_cesium_prefetch_batches = true;
+    RunJob(instance, 6);
+    FLAGS_cesium_prefetch_batches = false;
+
+    // The slow node's batch should be picked up by an idle node so
+    // neither job waits on it. The second job starts while the slow
+    // node is still busy with the first.
+    RunJob(instance, -1);
+    RunJob(instance, -1);
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+#include "output_store.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <set>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::ConcatRowsReducer;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::cesium::OutputStore;
+using slib::cesium::SumReducer;
+using slib::cesium::TopRowsReducer;
+using slib::util::MatlabMatrix;
+using std::set;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 20
+
+// Each index i produces the row [i, score], where the scores are a
+// permutation of 0..NUM_INDICES-1.
+float Score(const int& index) {
+  return (float) ((index * 7) % NUM_INDICES);
+}
+
+void StreamTestFunction(const JobDescription& job, JobOutput* output) {
+  FloatMatrix rows(job.indices.size(), 2);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    rows(i, 0) = job.indices[i];
+    rows(i, 1) = Score(job.indices[i]);
+  }
+  output->indices = job.indices;
+  output->variables["detections"] = MatlabMatrix(rows);
+  output->variables["all"] = MatlabMatrix(rows);
+  output->variables["raw"] = MatlabMatrix(rows);
+  output->variables["count"] = MatlabMatrix((float) job.indices.size());
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(StreamTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+    FLAGS_cesium_working_directory = "/tmp";
+
+    JobDescription job;
+    job.command = "StreamTestFunction";
+    for (int i = 0; i < NUM_INDICES; i++) {
+      job.indices.push_back(i);
+    }
+
+    JobOutput output;
+    output.SetVariableType("raw", slib::cesium::STREAMED_VARIABLE);
+    instance->SetOutputReducer("detections", new TopRowsReducer(5, 1));
+    instance->SetOutputReducer("all", new ConcatRowsReducer());
+    instance->SetOutputReducer("count", new SumReducer());
+    instance->EnableAllIndicesAtOnce();
+    instance->DisableIntelligentParameters();
+    instance->SetBatchSize(3);
+
+    ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+    ASSERT_EQ((float) NUM_INDICES, output.variables["count"].GetScalar());
+
+    // The best five, best first.
+    const FloatMatrix detections = output.variables["detections"].GetCopiedContents();
+    ASSERT_EQ(5, (int) detections.rows());
+    for (int i = 0; i < 5; i++) {
+      ASSERT_EQ((float) (NUM_INDICES - 1 - i), detections(i, 1));
+      ASSERT_EQ(Score((int) detections(i, 0)), detections(i, 1));
+    }
+
+    const FloatMatrix all = output.variables["all"].GetCopiedContents();
+    ASSERT_EQ(NUM_INDICES, (int) all.rows());
+    set<int> seen;
+    for (int i = 0; i < NUM_INDICES; i++) {
+      seen.insert((int) all(i, 0));
+    }
+    ASSERT_EQ(NUM_INDICES, (int) seen.size());
+
+    // Without a reducer the batches are only on disk.
+    ASSERT_TRUE(output.variables.find("raw") == output.variables.end());
+    OutputStore store(instance->GetOutputStoreFilename("raw"));
+    ASSERT_EQ(NUM_INDICES, (int) store.GetIndices().size());
+    for (int i = 0; i < NUM_INDICES; i++) {
+      MatlabMatrix batch;
+      ASSERT_TRUE(store.Read(i, &batch));
+      const FloatMatrix rows = batch.GetCopiedContents();
+      bool found = false;
+      for (int row = 0; row < rows.rows(); row++) {
+	if ((int) rows(row, 0) == i) {
+	  found = true;
+	  ASSERT_EQ(Score(i), rows(row, 1));
+	}
+      }
+      ASSERT_TRUE(found);
+    }
+    MatlabMatrix missing;
+    ASSERT_TRUE(!store.Read(NUM_INDICES, &missing));
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
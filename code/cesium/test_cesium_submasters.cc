@@ -0,0 +1,116 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+// The rank of this process. The function may run on a thread that
+// must not make MPI calls.
+int rank = -1;
+
+#define NUM_INDICES 40
+
+// Stores the value of the partial variable plus the cached offset at
+// each index, and the rank of the node that ran it.
+void SubMasterTestFunction(const JobDescription& job, JobOutput* output) {
+  const MatlabMatrix& values = job.GetInputByName("values");
+  const float offset = job.GetInputByName("offset").GetScalar();
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  MatlabMatrix ranks(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix(values.GetCell(index, 0).GetScalar() + offset));
+    ranks.SetCell(index, 0, MatlabMatrix((float) rank));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+  output->variables["ranks"].Merge(ranks);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  CESIUM_REGISTER_COMMAND(SubMasterTestFunction);
+
+  // Every node has to agree on the tree before Start().
+  if (FLAGS_cesium_submaster_group_size == 0) {
+    FLAGS_cesium_submaster_group_size = 3;
+  }
+  const int group_size = FLAGS_cesium_submaster_group_size;
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    // This assumes all of the nodes are on the master's host, so the
+    // groups are simply consecutive ranks starting at 1.
+    vector<bool> is_submaster(size, false);
+    for (int node = 1; node < size; node += group_size) {
+      is_submaster[node] = (node + 1 < size);
+    }
+
+    // The second job finds the cached variable on the workers.
+    for (int k = 0; k < 2; k++) {
+      JobDescription job;
+      job.command = "SubMasterTestFunction";
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      MatlabMatrix values(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	values.SetCell(i, 0, MatlabMatrix((float) (2 * i)));
+      }
+      instance->SetVariableType("values", values, slib::cesium::PARTIAL_VARIABLE_ROWS);
+      const MatlabMatrix offset(100.0f);
+      job.variables["offset"] = offset;
+      instance->SetVariableType("offset", offset, slib::cesium::CACHED_VARIABLE);
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(3);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      const MatlabMatrix& ranks = output.variables["ranks"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      ASSERT_EQ(NUM_INDICES, ranks.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(100.0f + 2 * i, testmat.GetCell(i, 0).GetScalar());
+	// Sub-masters only hand out work.
+	const int rank = (int) ranks.GetCell(i, 0).GetScalar();
+	ASSERT_TRUE(rank > 0 && rank < size);
+	ASSERT_TRUE(!is_submaster[rank]);
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
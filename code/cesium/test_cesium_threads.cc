@@ -0,0 +1,91 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <string>
+#include <unistd.h>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 40
+
+// Reads the shared input and stores input + index at each index. It
+// also builds and throws away a few matrices, so the threads allocate
+// and free Matlab arrays at the same time.
+void ThreadedTestFunction(const JobDescription& job, JobOutput* output) {
+  const float offset = job.GetInputByName("offset").GetScalar();
+
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    for (int j = 0; j < 100; j++) {
+      MatlabMatrix scratch(slib::util::MATLAB_STRUCT, 1, 1);
+      scratch.SetStructField("values", MatlabMatrix(FloatMatrix::Constant(10, 10, j)));
+      scratch.SetStructField("name", MatlabMatrix(string("scratch")));
+      MatlabMatrix copy;
+      copy.Deserialize(scratch.Serialize());
+    }
+    usleep(10000);
+    A.SetCell(job.indices[i], 0, MatlabMatrix(offset + job.indices[i]));
+    output->indices.push_back(job.indices[i]);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(ThreadedTestFunction);
+
+  // Must be set on the compute nodes, so before Start().
+  FLAGS_cesium_compute_threads = 4;
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    // The same threads run the batches of every job.
+    for (int k = 1; k <= 2; k++) {
+      JobDescription job;
+      job.command = "ThreadedTestFunction";
+      job.variables["offset"] = MatlabMatrix(1000.0f * k);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(10);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(1000.0f * k + i, testmat.GetCell(i, 0).GetScalar());
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
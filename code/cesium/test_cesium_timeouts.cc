@@ -0,0 +1,124 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <string>
+#include <unistd.h>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+// The rank of this process. The function may run on a thread that
+// must not make MPI calls.
+int rank = -1;
+
+#define NUM_INDICES 12
+
+// Stores the index at each index. Index 5 hangs node 1 for a while
+// (once), index 7 hangs every node that runs it.
+void TimeoutTestFunction(const JobDescription& job, JobOutput* output) {
+  static bool hung_once = false;
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    if (index == 5 && rank == 1 && !hung_once) {
+      hung_once = true;
+      sleep(3);
+    }
+    if (index == 7 && job.HasInput("hang")) {
+      sleep(2);
+    }
+    A.SetCell(index, 0, MatlabMatrix((float) index));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  CESIUM_REGISTER_COMMAND(TimeoutTestFunction);
+
+  // The nodes need these too, to send heartbeats.
+  FLAGS_cesium_index_timeout = 1.0;
+  FLAGS_cesium_heartbeat_interval = 0.1;
+  FLAGS_cesium_max_index_failures = 2;
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    // If node 1 hangs on index 5 it loses its batch, which another
+    // node completes.
+    {
+      JobDescription job;
+      job.command = "TimeoutTestFunction";
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ((float) i, testmat.GetCell(i, 0).GetScalar());
+      }
+      ASSERT_EQ(0, (int) instance->GetQuarantinedIndices().size());
+    }
+
+    // Index 7 hangs both nodes in turn and is then given up on. The
+    // nodes rejoin once they are done with it.
+    {
+      JobDescription job;
+      job.command = "TimeoutTestFunction";
+      job.variables["hang"] = MatlabMatrix(1.0f);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const vector<int>& quarantined = instance->GetQuarantinedIndices();
+      ASSERT_EQ(1, (int) quarantined.size());
+      ASSERT_EQ(7, quarantined[0]);
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      for (int i = 0; i < NUM_INDICES; i++) {
+	if (i != 7) {
+	  ASSERT_EQ((float) i, testmat.GetCell(i, 0).GetScalar());
+	}
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+
+#include <common/types.h>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <mpi.h>
+#include <sstream>
+#include <string>
+#include <string/stringutils.h>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::StringUtils;
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::util::MatlabMatrix;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 12
+
+// Stores the index at each index.
+void TraceTestFunction(const JobDescription& job, JobOutput* output) {
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    const int index = job.indices[i];
+    A.SetCell(index, 0, MatlabMatrix((float) index));
+    output->indices.push_back(index);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(TraceTestFunction);
+
+  // Every node records its part of the trace.
+  FLAGS_cesium_trace_file = FLAGS_cesium_temporary_directory + "/cesium_trace.json";
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    JobDescription job;
+    job.command = "TraceTestFunction";
+    for (int i = 0; i < NUM_INDICES; i++) {
+      job.indices.push_back(i);
+    }
+
+    instance->DisableIntelligentParameters();
+    instance->SetBatchSize(3);
+
+    JobOutput output;
+    ASSERT_TRUE(instance->ExecuteJob(job, &output));
+    const MatlabMatrix& testmat = output.variables["testmat"];
+    for (int i = 0; i < NUM_INDICES; i++) {
+      ASSERT_EQ((float) i, testmat.GetCell(i, 0).GetScalar());
+    }
+
+    // The trace is gathered and written once everything is done.
+    instance->Finish();
+
+    std::ifstream in(FLAGS_cesium_trace_file.c_str());
+    std::stringstream contents;
+    contents << in.rdbuf();
+    const string trace = contents.str();
+    ASSERT_TRUE(trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+    ASSERT_TRUE(trace.find("\"name\":\"PackJobData\"") != string::npos);
+    ASSERT_TRUE(trace.find("\"name\":\"HandleJobCompleted\"") != string::npos);
+    ASSERT_TRUE(trace.find("\"name\":\"MergeJobOutput\"") != string::npos);
+    // Every index ran once, on one of the nodes.
+    const string span = "\"name\":\"TraceTestFunction\",\"ph\":\"X\"";
+    for (int i = 0; i < NUM_INDICES; i++) {
+      const string index = StringUtils::StringPrintf("\"args\":{\"index\":%d}", i);
+      int count = 0;
+      for (size_t position = trace.find(span); position != string::npos; position = trace.find(span, position + 1)) {
+	if (trace.compare(trace.find("\"args\"", position), index.length(), index) == 0) {
+	  count++;
+	}
+      }
+      ASSERT_EQ(1, count);
+    }
+    for (int node = 1; node < size; node++) {
+      const string process = StringUtils::StringPrintf("\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,", node);
+      ASSERT_TRUE(trace.find(process) != string::npos);
+      const string wait = StringUtils::StringPrintf("\"name\":\"WaitForJobData\",\"ph\":\"X\",\"pid\":%d,", node);
+      ASSERT_TRUE(trace.find(wait) != string::npos);
+    }
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+#define SLIB_NO_DEFINE_64BIT
+#define cimg_display 0
+
+#include "cesium.h"
+#include "variable_cache.h"
+
+#include <common/types.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <map>
+#include <mpi.h>
+#include <set>
+#include <string>
+#include <util/assert.h>
+#include <util/matlab.h>
+#include <vector>
+
+using slib::cesium::Cesium;
+using slib::cesium::JobDescription;
+using slib::cesium::JobOutput;
+using slib::cesium::VariableCache;
+using slib::util::MatlabMatrix;
+using std::set;
+using std::string;
+using std::vector;
+
+#define NUM_INDICES 12
+
+// Stores the cached model at each index.
+void CacheTestFunction(const JobDescription& job, JobOutput* output) {
+  const float model = job.GetInputByName("model").GetScalar();
+
+  MatlabMatrix A(slib::util::MATLAB_CELL_ARRAY, NUM_INDICES, 1);
+  for (int i = 0; i < (int) job.indices.size(); i++) {
+    A.SetCell(job.indices[i], 0, MatlabMatrix(model));
+    output->indices.push_back(job.indices[i]);
+  }
+  output->variables["testmat"].Merge(A);
+}
+
+void TestVariableCache() {
+  MatlabMatrix A(1.0f), B(2.0f), C(3.0f);
+  const string hash_A = VariableCache::Hash(A);
+  const string hash_B = VariableCache::Hash(B);
+  const string hash_C = VariableCache::Hash(C);
+  ASSERT_TRUE(hash_A != hash_B);
+  ASSERT_EQ(hash_A, VariableCache::Hash(MatlabMatrix(1.0f)));
+  ASSERT_EQ((long long int) A.Serialize().length(), VariableCache::GetHashedBytes(hash_A));
+
+  // Room for two of them.
+  VariableCache cache(VariableCache::GetHashedBytes(hash_A) + VariableCache::GetHashedBytes(hash_B));
+  const set<string> keep;
+  cache.Insert(hash_A, &A, keep);
+  cache.Insert(hash_B, &B, keep);
+  ASSERT_EQ(2, cache.GetNumberOfEntries());
+  // The inserted matrices now refer to the cached copies.
+  ASSERT_EQ(1.0f, A.GetScalar());
+
+  // A was used last, so B is evicted.
+  MatlabMatrix lookup;
+  ASSERT_TRUE(cache.Lookup(hash_A, &lookup));
+  ASSERT_EQ(1.0f, lookup.GetScalar());
+  cache.Insert(hash_C, &C, keep);
+  ASSERT_TRUE(cache.Contains(hash_A));
+  ASSERT_TRUE(!cache.Contains(hash_B));
+  ASSERT_TRUE(cache.Contains(hash_C));
+
+  // Entries that are still needed are never evicted.
+  set<string> needed;
+  needed.insert(hash_A);
+  needed.insert(hash_C);
+  MatlabMatrix D(2.0f);
+  cache.Insert(hash_B, &D, needed);
+  ASSERT_EQ(3, cache.GetNumberOfEntries());
+
+  // Nor is anything larger than the whole cache.
+  VariableCache small(1);
+  MatlabMatrix E(1.0f);
+  small.Insert(hash_A, &E, keep);
+  ASSERT_EQ(0, small.GetNumberOfEntries());
+  ASSERT_EQ(1.0f, E.GetScalar());
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  MPI_Init(&argc, &argv);
+
+  CESIUM_REGISTER_COMMAND(CacheTestFunction);
+
+  Cesium* instance = Cesium::GetInstance();
+  if (instance->Start() == slib::cesium::CesiumMasterNode) {
+    FLAGS_logtostderr = true;
+
+    TestVariableCache();
+
+    // The same variable name with new contents must not pick up the
+    // cached copy of the old contents, while going back to the old
+    // contents can.
+    const float models[] = {1.0f, 2.0f, 1.0f};
+    for (int k = 0; k < 3; k++) {
+      JobDescription job;
+      job.command = "CacheTestFunction";
+      const MatlabMatrix model(models[k]);
+      job.variables["model"] = model;
+      instance->SetVariableType("model", model, slib::cesium::CACHED_VARIABLE);
+      for (int i = 0; i < NUM_INDICES; i++) {
+	job.indices.push_back(i);
+      }
+
+      instance->DisableIntelligentParameters();
+      instance->SetBatchSize(2);
+
+      JobOutput output;
+      ASSERT_TRUE(instance->ExecuteJob(job, &output));
+
+      const MatlabMatrix& testmat = output.variables["testmat"];
+      ASSERT_EQ(NUM_INDICES, testmat.GetNumberOfElements());
+      for (int i = 0; i < NUM_INDICES; i++) {
+	ASSERT_EQ(models[k], testmat.GetCell(i, 0).GetScalar());
+      }
+    }
+
+    instance->Finish();
+  }
+
+  LOG(INFO) << "ALL TESTS PASSED";
+
+  return 0;
+}
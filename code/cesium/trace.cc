@@ -0,0 +1,136 @@
+#include "trace.h"
+
+#include <boost/signals2/mutex.hpp>
+#include <glog/logging.h>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <string/stringutils.h>
+#include <sys/time.h>
+#include <vector>
+
+using slib::StringUtils;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace slib {
+  namespace cesium {
+
+    bool Tracer::_enabled = false;
+    int Tracer::_pid = 0;
+
+    // The events are appended by whichever thread ends a span.
+    static boost::signals2::mutex trace_mutex;
+    static string trace_events;
+    // Small, stable thread ids for the timeline.
+    static map<pthread_t, int> trace_thread_ids;
+
+    static void AppendEvent(const string& event) {
+      if (trace_events.length() > 0) {
+	trace_events += ",\n";
+      }
+      trace_events += event;
+    }
+
+    void Tracer::Enable(const int& pid, const string& process_name) {
+      trace_mutex.lock(); {
+	_pid = pid;
+	AppendEvent(StringUtils::StringPrintf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+					      "\"args\":{\"name\":\"%s\"}}", pid, process_name.c_str()));
+	AppendEvent(StringUtils::StringPrintf("{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,"
+					      "\"args\":{\"sort_index\":%d}}", pid, pid));
+      }
+      trace_mutex.unlock();
+      _enabled = true;
+    }
+
+    double Tracer::Now() {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      return 1e6 * now.tv_sec + now.tv_usec;
+    }
+
+    void Tracer::AddSpan(const char* name, const double& start, const double& end, const string& arguments) {
+      trace_mutex.lock(); {
+	const pthread_t thread = pthread_self();
+	map<pthread_t, int>::const_iterator iter = trace_thread_ids.find(thread);
+	if (iter == trace_thread_ids.end()) {
+	  iter = trace_thread_ids.insert(std::make_pair(thread, (int) trace_thread_ids.size())).first;
+	}
+	AppendEvent(StringUtils::StringPrintf("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+					      "\"ts\":%.0f,\"dur\":%.0f,\"args\":{%s}}", 
+					      name, _pid, iter->second, start, end - start, arguments.c_str()));
+      }
+      trace_mutex.unlock();
+    }
+
+    string Tracer::GetEvents() {
+      trace_mutex.lock();
+      const string events = trace_events;
+      trace_mutex.unlock();
+      return events;
+    }
+
+    void Tracer::AddEvents(const string& events) {
+      if (events.length() == 0) {
+	return;
+      }
+      trace_mutex.lock(); {
+	AppendEvent(events);
+      }
+      trace_mutex.unlock();
+    }
+
+    bool Tracer::WriteToFile(const string& filename) {
+      const string events = GetEvents();
+      FILE* fid = fopen(filename.c_str(), "w");
+      if (fid == NULL) {
+	LOG(ERROR) << "Could not write the trace: " << filename;
+	return false;
+      }
+      fprintf(fid, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+      fwrite(events.data(), 1, events.length(), fid);
+      fprintf(fid, "\n]}\n");
+      if (fclose(fid) != 0) {
+	LOG(ERROR) << "Could not write the trace: " << filename;
+	return false;
+      }
+      return true;
+    }
+
+    TraceSpan::TraceSpan(const char* name) 
+      : _name(name)
+      , _start(Tracer::IsEnabled() ? Tracer::Now() : -1.0)
+      , _first_index(-1)
+      , _num_indices(0) {}
+
+    TraceSpan::TraceSpan(const char* name, const int& index) 
+      : _name(name)
+      , _start(Tracer::IsEnabled() ? Tracer::Now() : -1.0)
+      , _first_index(index)
+      , _num_indices(1) {}
+
+    TraceSpan::TraceSpan(const char* name, const vector<int>& indices) 
+      : _name(name)
+      , _start(Tracer::IsEnabled() ? Tracer::Now() : -1.0)
+      , _first_index(indices.size() > 0 ? indices[0] : -1)
+      , _num_indices(indices.size()) {}
+
+    TraceSpan::~TraceSpan() {
+      if (_start < 0.0) {
+	return;
+      }
+      string arguments;
+      if (_num_indices == 1) {
+	arguments = StringUtils::StringPrintf("\"index\":%d", _first_index);
+      } else if (_num_indices > 1) {
+	arguments = StringUtils::StringPrintf("\"first_index\":%d,\"num_indices\":%d", 
+					      _first_index, _num_indices);
+      }
+      Tracer::AddSpan(_name, _start, Tracer::Now(), arguments);
+    }
+
+  }  // namespace cesium
+}  // namespace slib
@@ -0,0 +1,70 @@
+#ifndef __SLIB_CESIUM_TRACE_H__
+#define __SLIB_CESIUM_TRACE_H__
+
+#include <string>
+#include <vector>
+
+namespace slib {
+  namespace cesium {
+
+    // Collects spans of time spent in the different stages of a job
+    // (serialization, transfers, commands, merging, checkpointing) as
+    // Chrome trace events, which chrome://tracing (or Perfetto) shows
+    // as one timeline per process and thread. Each process collects
+    // its own events; Cesium gathers them on the master when it
+    // finishes (see cesium_trace_file). Until Enable is called nothing
+    // is recorded and a span costs a single branch.
+    class Tracer {
+    public:
+      // Starts recording. The events are attributed to the given
+      // process id (the rank), which is shown under the given name.
+      static void Enable(const int& pid, const std::string& process_name);
+      static inline bool IsEnabled() {
+	return _enabled;
+      }
+
+      // Microseconds since the epoch. Nodes on different hosts are
+      // only as far apart as their clocks.
+      static double Now();
+
+      // Records a complete event. arguments is either empty or the
+      // members of a JSON object, e.g. "\"index\":3".
+      static void AddSpan(const char* name, const double& start, const double& end, 
+			  const std::string& arguments);
+
+      // The events recorded so far (including any added below) as a
+      // comma-separated list of JSON objects, to be passed to
+      // AddEvents on another process.
+      static std::string GetEvents();
+      static void AddEvents(const std::string& events);
+
+      // Writes every event recorded so far as a JSON trace. Returns
+      // false if the file could not be written.
+      static bool WriteToFile(const std::string& filename);
+
+    private:
+      static bool _enabled;
+      static int _pid;
+    };
+
+    // Records the time from its construction to its destruction as an
+    // event with the given name, optionally tagged with the indices of
+    // the batch it belongs to. The name must outlive the span.
+    class TraceSpan {
+    public:
+      explicit TraceSpan(const char* name);
+      TraceSpan(const char* name, const int& index);
+      TraceSpan(const char* name, const std::vector<int>& indices);
+      ~TraceSpan();
+
+    private:
+      const char* _name;
+      double _start;
+      int _first_index;
+      int _num_indices;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
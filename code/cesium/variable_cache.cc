@@ -0,0 +1,99 @@
+#include "variable_cache.h"
+
+#include <boost/crc.hpp>
+#include <list>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include <string>
+#include <string/stringutils.h>
+#include <util/matlab.h>
+
+using slib::StringUtils;
+using slib::util::MatlabMatrix;
+using std::list;
+using std::map;
+using std::set;
+using std::string;
+
+namespace slib {
+  namespace cesium {
+
+    VariableCache::VariableCache(const long long int& max_bytes) 
+      : _max_bytes(max_bytes)
+      , _num_bytes(0) {}
+
+    string VariableCache::Hash(const MatlabMatrix& matrix) {
+      return HashSerialized(matrix.Serialize());
+    }
+
+    string VariableCache::HashSerialized(const string& serialized) {
+      boost::crc_32_type crc;
+      crc.process_bytes(serialized.data(), serialized.length());
+      return StringUtils::StringPrintf("%08x.%lld", crc.checksum(), (long long int) serialized.length());
+    }
+
+    long long int VariableCache::GetHashedBytes(const string& hash) {
+      const string::size_type separator = hash.find('.');
+      if (separator == string::npos) {
+	return 0;
+      }
+      return atoll(hash.c_str() + separator + 1);
+    }
+
+    bool VariableCache::Lookup(const string& hash, MatlabMatrix* matrix) {
+      const map<string, Entry>::iterator iter = _entries.find(hash);
+      if (iter == _entries.end()) {
+	return false;
+      }
+
+      _recently_used.erase(iter->second.position);
+      _recently_used.push_front(hash);
+      iter->second.position = _recently_used.begin();
+
+      matrix->Share(iter->second.matrix);
+      return true;
+    }
+
+    void VariableCache::Insert(const string& hash, MatlabMatrix* matrix, const set<string>& keep) {
+      if (Contains(hash)) {
+	Lookup(hash, matrix);
+	return;
+      }
+
+      const long long int bytes = GetHashedBytes(hash);
+      if (bytes > _max_bytes) {
+	return;
+      }
+
+      // Evict from the least recently used end, skipping anything the
+      // caller still needs. If that is not enough the cache is
+      // allowed to grow past its budget.
+      list<string>::iterator iter = _recently_used.end();
+      while (_num_bytes + bytes > _max_bytes && iter != _recently_used.begin()) {
+	iter--;
+	if (keep.find(*iter) != keep.end()) {
+	  continue;
+	}
+	const map<string, Entry>::iterator entry = _entries.find(*iter);
+	_num_bytes -= entry->second.bytes;
+	_entries.erase(entry);
+	iter = _recently_used.erase(iter);
+      }
+
+      Entry& entry = _entries[hash];
+      entry.matrix.Swap(*matrix);
+      entry.bytes = bytes;
+      _recently_used.push_front(hash);
+      entry.position = _recently_used.begin();
+      _num_bytes += bytes;
+
+      matrix->Share(entry.matrix);
+    }
+
+    bool VariableCache::Contains(const string& hash) const {
+      return _entries.find(hash) != _entries.end();
+    }
+
+  }  // namespace cesium
+}  // namespace slib
@@ -0,0 +1,67 @@
+#ifndef __SLIB_CESIUM_VARIABLE_CACHE_H__
+#define __SLIB_CESIUM_VARIABLE_CACHE_H__
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <util/matlab.h>
+
+namespace slib {
+  namespace cesium {
+
+    // The variables a compute node has been sent, keyed by a hash of
+    // their contents so that an updated variable is never mistaken
+    // for an old one with the same name. Entries are kept across jobs
+    // and the least recently used ones are evicted once the cache
+    // grows past its byte budget.
+    class VariableCache {
+    public:
+      explicit VariableCache(const long long int& max_bytes);
+
+      // The CRC-32 of the serialized matrix along with its length in
+      // bytes. Computed by the master; the nodes only compare them.
+      static std::string Hash(const slib::util::MatlabMatrix& matrix);
+      // The same for a matrix that has already been serialized.
+      static std::string HashSerialized(const std::string& serialized);
+      // The (serialized) size of a matrix given its hash.
+      static long long int GetHashedBytes(const std::string& hash);
+
+      // Makes matrix refer to the cached copy WITHOUT copying it (see
+      // MatlabMatrix::Share) and marks it as recently used. Returns
+      // false if the hash is not cached.
+      bool Lookup(const std::string& hash, slib::util::MatlabMatrix* matrix);
+      // Takes over the contents of matrix, which is left referring to
+      // the cached copy. Least recently used entries that are not in
+      // keep are evicted to make room. A matrix larger than the whole
+      // budget is not cached and is left untouched.
+      void Insert(const std::string& hash, slib::util::MatlabMatrix* matrix, 
+		  const std::set<std::string>& keep);
+
+      bool Contains(const std::string& hash) const;
+      inline long long int GetNumberOfBytes() const {
+	return _num_bytes;
+      }
+      inline int GetNumberOfEntries() const {
+	return _entries.size();
+      }
+
+    private:
+      struct Entry {
+	slib::util::MatlabMatrix matrix;
+	long long int bytes;
+	// Position in _recently_used.
+	std::list<std::string>::iterator position;
+      };
+
+      long long int _max_bytes;
+      long long int _num_bytes;
+      std::map<std::string, Entry> _entries;
+      // Hashes ordered from most to least recently used.
+      std::list<std::string> _recently_used;
+    };
+
+  }  // namespace cesium
+}  // namespace slib
+
+#endif
@@ -1,13 +1,14 @@
 #include "matlab.h"
 
 #include "assert.h"
+#include <algorithm>
 #include <CImg.h>
 #include <common/types.h>
 #include <glog/logging.h>
 #include <iostream>
 #include <mat.h>
+#include <pthread.h>
 #include <string>
-#include <sstream>
 #include <svm/detector.h>
 #include <vector>
 #include <wchar.h>
@@ -18,12 +19,33 @@ using slib::svm::DetectorFactory;
 using slib::svm::Detector;
 using slib::svm::Model;
 using std::string;
-using std::stringstream;
 using std::vector;
 
 namespace slib {
   namespace util {
 
+    // Recursive, since MatlabMatrix methods that hold it call each
+    // other.
+    static pthread_mutex_t matlab_api_mutex;
+    static pthread_once_t matlab_api_mutex_once = PTHREAD_ONCE_INIT;
+
+    static void InitializeMatlabApiMutex() {
+      pthread_mutexattr_t attributes;
+      pthread_mutexattr_init(&attributes);
+      pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+      pthread_mutex_init(&matlab_api_mutex, &attributes);
+      pthread_mutexattr_destroy(&attributes);
+    }
+
+    MatlabApiLock::MatlabApiLock() {
+      pthread_once(&matlab_api_mutex_once, &InitializeMatlabApiMutex);
+      pthread_mutex_lock(&matlab_api_mutex);
+    }
+
+    MatlabApiLock::~MatlabApiLock() {
+      pthread_mutex_unlock(&matlab_api_mutex);
+    }
+
     MatlabMatrix::MatlabMatrix() 
       : _matrix(NULL)
       , _shared(false)
@@ -64,6 +86,7 @@ namespace slib {
     }
 
     void MatlabMatrix::Initialize(const MatlabMatrixType& type, const Pair<int>& dimensions) {
+      MatlabApiLock lock;
       _shared = false;
       _type = type;
       if (_type == MATLAB_STRUCT) {
@@ -82,6 +105,7 @@ namespace slib {
     }
 
     MatlabMatrix::~MatlabMatrix() {
+      MatlabApiLock lock;
       if (_matrix != NULL && !_shared) {
 	mxDestroyArray(_matrix);
       }
@@ -92,6 +116,7 @@ namespace slib {
       : _matrix(NULL)
       , _shared(false)
       , _type(MATLAB_NO_TYPE) {
+      MatlabApiLock lock;
       if (data != NULL) {
 	_type = GetType(data);
 	_matrix = mxDuplicateArray(data);
@@ -113,6 +138,7 @@ namespace slib {
       : _matrix(NULL)
       , _shared(false)
       , _type(matrix._type) {
+      MatlabApiLock lock;
       if (matrix._matrix != NULL) {
 	_matrix = mxDuplicateArray(matrix._matrix);
       }
@@ -165,6 +191,7 @@ namespace slib {
     }
 
     void MatlabMatrix::Assign(const MatlabMatrix& other) {
+      MatlabApiLock lock;
       if (_matrix != NULL) {
 	mxDestroyArray(_matrix);
 	_matrix = NULL;
@@ -178,6 +205,23 @@ namespace slib {
       _shared = false;
     }
 
+    void MatlabMatrix::Share(const MatlabMatrix& other) {
+      MatlabApiLock lock;
+      if (_matrix != NULL && !_shared) {
+	mxDestroyArray(_matrix);
+      }
+      // WARNING: This is NOT a deep copy. Shared pointer!
+      _matrix = other._matrix;
+      _type = other._type;
+      _shared = true;
+    }
+
+    void MatlabMatrix::Swap(MatlabMatrix& other) {
+      std::swap(_matrix, other._matrix);
+      std::swap(_shared, other._shared);
+      std::swap(_type, other._type);
+    }
+
     void MatlabMatrix::Assign(const FloatMatrix& other) {
       _type = MATLAB_MATRIX;
       _shared = false;
@@ -185,6 +229,7 @@ namespace slib {
     }
 
     MatlabMatrix& MatlabMatrix::Merge(const MatlabMatrix& other) {
+      MatlabApiLock lock;
       if (_type == MATLAB_NO_TYPE && _matrix == NULL) {
 	Initialize(other._type, other.GetDimensions());
       }
@@ -705,6 +750,7 @@ namespace slib {
     }
 
     string MatlabMatrix::GetStringContents() const {
+      MatlabApiLock lock;
       string contents;
       if (_matrix != NULL && _type == MATLAB_STRING) {
 	const int rows = mxGetM(_matrix);
@@ -795,6 +841,7 @@ namespace slib {
     }
 
     MatlabMatrix& MatlabMatrix::SetStructField(const string& field, const int& index, const MatlabMatrix& contents) {
+      MatlabApiLock lock;
       if (_matrix != NULL && _type == MATLAB_STRUCT) {
 	// Check to see if the field already exists.
 	if (mxGetFieldNumber(_matrix, field.c_str()) != -1) {
@@ -829,6 +876,7 @@ namespace slib {
     }
 
     MatlabMatrix& MatlabMatrix::SetCell(const int& index, const MatlabMatrix& contents) {
+      MatlabApiLock lock;
       if (_matrix != NULL && _type == MATLAB_CELL_ARRAY) {
 	// Check to see if the cell has already been set.
 	if (mxGetCell(_matrix, index) != NULL) {
@@ -853,6 +901,7 @@ namespace slib {
     }
 
     MatlabMatrix& MatlabMatrix::SetContents(const FloatMatrix& contents) {
+      MatlabApiLock lock;
       if (_type == MATLAB_MATRIX) {
 	// Overwrite the already existing data if necessary.
 	if (_matrix != NULL) {
@@ -874,6 +923,7 @@ namespace slib {
     }
 
     MatlabMatrix& MatlabMatrix::SetContents(const float* contents, const int& length, const bool& iscol) {
+      MatlabApiLock lock;
       const int rows = iscol ? length : 1;
       const int cols = iscol ? 1 : length;
       if (_type == MATLAB_MATRIX) {
@@ -893,6 +943,7 @@ namespace slib {
     }
 
     MatlabMatrix& MatlabMatrix::SetStringContents(const string& contents) {
+      MatlabApiLock lock;
       if (_type == MATLAB_STRING) {
 	// Overwrite the already existing data if necessary.
 	if (_matrix != NULL) {
@@ -908,6 +959,7 @@ namespace slib {
     }
         
     void MatlabMatrix::LoadMatrixFromFile(const string& filename, const bool& multivariable) {
+      MatlabApiLock lock;
       MATFile* pmat = matOpen(filename.c_str(), "r");
       if (pmat == NULL) {
 	LOG(ERROR) << "Error Opening MAT File: " << filename;
@@ -969,6 +1021,7 @@ namespace slib {
     }
 
     bool MatlabMatrix::SaveToFile(const string& filename, const bool& struct_format) const {
+      MatlabApiLock lock;
       MATFile* pmat = matOpen(filename.c_str(), "w");
       if (pmat == NULL) {
 	LOG(ERROR) << "Error Opening MAT File: " << filename;
@@ -1004,25 +1057,33 @@ namespace slib {
     }
 
     string MatlabMatrix::Serialize() const {
-      stringstream ss(stringstream::out | stringstream::binary);
+      string bytes;
+      SerializeTo(&bytes);
+      return bytes;
+    }
+
+    static void AppendBytes(const void* data, const size_t& length, string* bytes) {
+      bytes->append(reinterpret_cast<const char*>(data), length);
+    }
 
+    void MatlabMatrix::SerializeTo(string* bytes) const {
       switch(GetType(_matrix)) {
       case MATLAB_STRUCT: {
 	// Indicate that we have a struct.
-	ss.put('S');
+	bytes->push_back('S');
 	// Indicate the rows x columns. 3D NOT ALLOWED.
 	const Pair<int> dimensions = GetDimensions();
-	ss.write(reinterpret_cast<const char*>(&dimensions.x), sizeof(int));
-	ss.write(reinterpret_cast<const char*>(&dimensions.y), sizeof(int));
+	AppendBytes(&dimensions.x, sizeof(int), bytes);
+	AppendBytes(&dimensions.y, sizeof(int), bytes);
 	// Get the list of fields and write to stream.
 	vector<string> field_names = GetStructFieldNames();
 	const int field_names_length = field_names.size();
-	ss.write(reinterpret_cast<const char*>(&field_names_length), sizeof(int));
+	AppendBytes(&field_names_length, sizeof(int), bytes);
 	for (uint32 i = 0; i < field_names.size(); i++) {
 	  const string field = field_names[i];
 	  const int field_length = field.length();
-	  ss.write(reinterpret_cast<const char*>(&field_length), sizeof(int));
-	  ss.write(field.data(), field.length());
+	  AppendBytes(&field_length, sizeof(int), bytes);
+	  bytes->append(field);
 	}
 
 	// Now write out the actual data.
@@ -1032,66 +1093,84 @@ namespace slib {
 	  for (int j = 0; j < length; j++) {
 	    const int index = j;
 	    // Serialize each field to the stream.
-	    string field_serialized = GetCopiedStructField(field, index).Serialize();
-	    ss.write(field_serialized.data(), field_serialized.length());
+	    GetCopiedStructField(field, index).SerializeTo(bytes);
 	  }
 	}
 	break;
       }
       case MATLAB_CELL_ARRAY: {
 	// Indicate that we have a cell array.
-	ss.put('C');
+	bytes->push_back('C');
 	// Indicate the rows x columns. 3D NOT ALLOWED.
 	const Pair<int> dimensions = GetDimensions();
-	ss.write(reinterpret_cast<const char*>(&dimensions.x), sizeof(int));
-	ss.write(reinterpret_cast<const char*>(&dimensions.y), sizeof(int));
+	AppendBytes(&dimensions.x, sizeof(int), bytes);
+	AppendBytes(&dimensions.y, sizeof(int), bytes);
 	// Write out the actual data.
 	const int length = dimensions.x * dimensions.y;
 	for (int j = 0; j < length; j++) {
 	  const int index = j;
 	  // Serialize each field to the stream.
-	  string cell_serialized = GetCopiedCell(index).Serialize();
-	  ss.write(cell_serialized.data(), cell_serialized.length());
+	  GetCopiedCell(index).SerializeTo(bytes);
 	}
 	break;
       }
       case MATLAB_MATRIX: {
 	// Indicate that we have a matrix.
-	ss.put('M');
+	bytes->push_back('M');
 	// Indicate the rows x columns. 3D NOT ALLOWED.
 	const Pair<int> dimensions = GetDimensions();
-	ss.write(reinterpret_cast<const char*>(&dimensions.x), sizeof(int));
-	ss.write(reinterpret_cast<const char*>(&dimensions.y), sizeof(int));
-	// Write out the actual data.
-	const FloatMatrix contents = GetCopiedContents();
-	const int length = contents.rows() * contents.cols();
-	ss.write(reinterpret_cast<const char*>(contents.data()), sizeof(float) * length);
+	AppendBytes(&dimensions.x, sizeof(int), bytes);
+	AppendBytes(&dimensions.y, sizeof(int), bytes);
+	// Write out the actual data, row by row (as in a FloatMatrix).
+	// Single precision matrices are read straight from their
+	// column-major Matlab data.
+	if (mxIsSingle(_matrix) && mxGetNumberOfDimensions(_matrix) == 2) {
+	  const int rows = mxGetM(_matrix);
+	  const int cols = mxGetN(_matrix);
+	  const float* data = (const float*) mxGetData(_matrix);
+	  const size_t start = bytes->length();
+	  bytes->resize(start + sizeof(float) * rows * cols);
+	  char* row_major = &(*bytes)[start];
+	  for (int j = 0; j < rows; j++) {
+	    for (int i = 0; i < cols; i++) {
+	      memcpy(row_major, &data[j + i * rows], sizeof(float));
+	      row_major += sizeof(float);
+	    }
+	  }
+	} else {
+	  const FloatMatrix contents = GetCopiedContents();
+	  const int length = contents.rows() * contents.cols();
+	  AppendBytes(contents.data(), sizeof(float) * length, bytes);
+	}
 	break;
       }
       case MATLAB_STRING: {
 	// Indicate we have a string.
-	ss.put('Z');
+	bytes->push_back('Z');
 	const Pair<int> dimensions = GetDimensions();
-	ss.write(reinterpret_cast<const char*>(&dimensions.x), sizeof(int));
-	ss.write(reinterpret_cast<const char*>(&dimensions.y), sizeof(int));
+	AppendBytes(&dimensions.x, sizeof(int), bytes);
+	AppendBytes(&dimensions.y, sizeof(int), bytes);
 	// Write out the actual data.
 	const string contents = GetStringContents();
 	VLOG(2) << "Writing string: " << contents;
-	ss.write(contents.c_str(), sizeof(char) * (contents.length() + 1));
+	AppendBytes(contents.c_str(), sizeof(char) * (contents.length() + 1), bytes);
 	break;
       }
       default:
 	// In this case, we assume an empty matrix, and indicate that.
-	ss.put('E');
+	bytes->push_back('E');
 	break;
       }
-      ss.flush();
-      return ss.str();
     }
 
     long long int MatlabMatrix::Deserialize(const string& str, const long long int& position) {
+      return Deserialize(str.data(), position);
+    }
+
+    long long int MatlabMatrix::Deserialize(const char* data, const long long int& position) {
+      MatlabApiLock lock;
       // These methods mirror the above methods.
-      const char* ss = str.c_str() + position;
+      const char* ss = data + position;
 
       // Read the first element, it determines the root matrix type.
       char type;
@@ -1141,7 +1220,7 @@ namespace slib {
 	    const int index = j;
 	    // Deserialize the field and then save it.
 	    MatlabMatrix field_matrix;
-	    const long long int bytes_read = field_matrix.Deserialize(str, offset);
+	    const long long int bytes_read = field_matrix.Deserialize(data, offset);
 	    if (bytes_read == 0L) {
 	      LOG(ERROR) << "Malformed field: " << field << " (index: " << index << ")";
 #if 1
@@ -1172,7 +1251,7 @@ namespace slib {
 	  const int index = j;
 	  // Deserialize the field and then save it.
 	  MatlabMatrix cell_matrix;
-	  const long long int bytes_read = cell_matrix.Deserialize(str, offset);
+	  const long long int bytes_read = cell_matrix.Deserialize(data, offset);
 	  if (bytes_read == 0L) {
 	    LOG(ERROR) << "Malformed cell at index: " << index;
 	    return 0;
@@ -1191,17 +1270,22 @@ namespace slib {
 	memcpy(&dimensions.x, ss, sizeof(int)); ss += sizeof(int);
 	memcpy(&dimensions.y, ss, sizeof(int)); ss += sizeof(int);
 	offset += sizeof(int) * 2;
-	// No initialization necessary as the SetContents method takes care of it.
-	// And now the actual data.
+	// And now the actual data, row by row, which goes straight into
+	// the column-major data of a single precision Matlab matrix.
 	const int rows = dimensions.x;
 	const int cols = dimensions.y;
 	VLOG(2) << "Matrix size: " << rows << " x " << cols;
-	FloatMatrix contents(rows, cols);
-	contents.fill(0.0f);
-
-	memcpy(contents.data(), ss, sizeof(float) * rows * cols); ss += sizeof(float) * rows * cols;
+	if (_matrix != NULL) {
+	  mxDestroyArray(_matrix);
+	}
+	_matrix = mxCreateNumericMatrix(rows, cols, mxSINGLE_CLASS, mxREAL);
+	float* data = (float*) mxGetData(_matrix);
+	for (int j = 0; j < rows; j++) {
+	  for (int i = 0; i < cols; i++) {
+	    memcpy(&data[j + i * rows], ss, sizeof(float)); ss += sizeof(float);
+	  }
+	}
 	offset += sizeof(float) * rows * cols;
-	SetContents(contents);
 	break;
       }
       case 'Z': {  // String
@@ -1368,6 +1452,7 @@ namespace slib {
     }
 
     MatlabMatrix MatlabConverter::ConvertDetectorToMatrix(const Detector& detector) {
+      MatlabApiLock lock;
       MatlabMatrix matrix(MATLAB_STRUCT, Pair<int>(1,1));
 
       MatlabMatrix firstLevModels(MATLAB_STRUCT, Pair<int>(1,1));
@@ -33,6 +33,24 @@ namespace slib {
       MATLAB_STRING, MATLAB_NO_TYPE, MATLAB_MATRIX_SPARSE
     };
 
+    // Holds the process-wide lock on the Matlab API, which is not
+    // thread-safe, for as long as it is in scope. Every MatlabMatrix
+    // method that allocates, frees or restructures an mxArray takes
+    // it, so matrices can be built and destroyed on several threads
+    // at once (but a single matrix must still not be changed by two
+    // threads at once). Code that calls the mx* or mat* functions
+    // directly from more than one thread should take it as well. A
+    // thread that holds it may take it again.
+    class MatlabApiLock {
+    public:
+      MatlabApiLock();
+      ~MatlabApiLock();
+
+    private:
+      MatlabApiLock(const MatlabApiLock&);
+      void operator=(const MatlabApiLock&);
+    };
+
     /**
        This class is an abstraction of the MATLAB matrix type. It is
        quite simplified since I never need the more advanced
@@ -118,6 +136,15 @@ namespace slib {
       void Assign(const MatlabMatrix& other);
       void Assign(const FloatMatrix& other);
 
+      // Makes this matrix refer to the data of other WITHOUT copying
+      // it. The result must not outlive other and should only be
+      // read. Useful for handing the same (large) inputs to several
+      // threads.
+      void Share(const MatlabMatrix& other);
+      // Exchanges the contents of the two matrices without copying
+      // them.
+      void Swap(MatlabMatrix& other);
+
       static MatlabMatrix LoadFromFile(const std::string& filename, const bool& multivariable = false);
       static MatlabMatrix LoadFromBinaryFile(const std::string& filename);
       bool SaveToFile(const std::string& filename, const bool& struct_format = false) const;
@@ -234,11 +261,17 @@ namespace slib {
       // Although the return type is a "string", the contents of that
       // string will be fwrite-style bytes.
       std::string Serialize() const;
+      // Same as above, but appends the bytes to the given string
+      // rather than building a new one.
+      void SerializeTo(std::string* bytes) const;
       // The stream knows its own length, however this function is
       // recursive and needs to be able to start reading from the
       // correct position in the stream. A calling method does not
       // need to worry with these details... just use the default.
       long long int Deserialize(const std::string& str, const long long int& position = 0L);
+      // Same as above, straight from a buffer (e.g. the one a message
+      // was received into) without copying it into a string first.
+      long long int Deserialize(const char* data, const long long int& position = 0L);
 
       Pair<int> GetDimensions() const;
       std::vector<std::string> GetStructFieldNames() const;